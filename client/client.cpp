@@ -1,8 +1,12 @@
 // Client for the server defined in ../server/server.cpp.
 
 #include <RHReliableDatagram.h>
+#if (RH_PLATFORM == RH_PLATFORM_SIMULATOR)
+#include "simulated_radio.h"
+#else
 #include <RH_NRF24.h>
 #include <SPI.h>
+#endif
 #include <limits.h>
 
 #include "timer.h"
@@ -230,8 +234,15 @@ void onReporting()
 void setup() 
 {
   Serial.begin(9600);
+
+#if (RH_PLATFORM == RH_PLATFORM_SIMULATOR)
+  // Several simulated clients can share one build, with the address given on the command line.
+  if (_simulator_argc >= 2)
+    theManager.setThisAddress(atoi(_simulator_argv[1]));
+#endif
+
   Serial.print("Started client ");
-  Serial.print(CLIENT_ADDRESS);
+  Serial.print(theManager.thisAddress());
   Serial.println(". Welcome!");
 
   if (theManager.init())
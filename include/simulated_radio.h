@@ -0,0 +1,46 @@
+#ifndef DLY_SIMULATED_RADIO_H
+#define DLY_SIMULATED_RADIO_H
+
+// Stands in for the nRF24 driver when the server and clients are built for the RadioHead
+// simulator (see ../server/simbuild and ../client/simbuild), so they can be run on Linux
+// against tools/etherSimulator. Tuning is passed on to the simulated ether, so nodes on different
+// channels or data rates do not hear each other, and power decides which of two colliding packets survives.
+
+#include <RH_TCP.h>
+
+class RH_NRF24 : public RH_TCP
+{
+public:
+  // Same values as the real driver, since they are sent in Message::Data::TuningParams.
+  typedef enum
+  {
+    DataRate1Mbps = 0,
+    DataRate2Mbps,
+    DataRate250kbps
+  } DataRate;
+
+  typedef enum
+  {
+    TransmitPowerm18dBm = 0,
+    TransmitPowerm12dBm,
+    TransmitPowerm6dBm,
+    TransmitPower0dBm
+  } TransmitPower;
+
+  // Starts like the real radio after init(): channel 2, 2Mbps, 0dBm
+  RH_NRF24(uint8_t chipEnablePin = 8, uint8_t slaveSelectPin = 10)
+  {
+    setChannel(2);
+    setRF(DataRate2Mbps, TransmitPower0dBm);
+  }
+
+  bool setChannel(uint8_t channel) { return RH_TCP::setChannel(channel); }
+  bool setRF(DataRate dataRate, TransmitPower power)
+  {
+    static const uint32_t bitsPerSecond[] = { 1000000, 2000000, 250000 };
+    static const int8_t dBm[] = { -18, -12, -6, 0 };
+    return RH_TCP::setRF(bitsPerSecond[dataRate], dBm[power]);
+  }
+};
+
+#endif
@@ -16,4 +16,11 @@ extern uint16_t RHcrc_xmodem_update (uint16_t crc, uint8_t data);
 extern uint16_t RHcrc_ccitt_update (uint16_t crc, uint8_t data);
 extern uint8_t  RHcrc_ibutton_update(uint8_t crc, uint8_t data);
 
+// Update the CRC with len octets from data. Same result as calling the corresponding
+// _update function for each octet, but faster on platforms with CRC tables
+extern uint16_t RHcrc16_buf(uint16_t crc, const uint8_t* data, uint16_t len);
+extern uint16_t RHcrc_xmodem_buf(uint16_t crc, const uint8_t* data, uint16_t len);
+extern uint16_t RHcrc_ccitt_buf(uint16_t crc, const uint8_t* data, uint16_t len);
+extern uint8_t  RHcrc_ibutton_buf(uint8_t crc, const uint8_t* data, uint16_t len);
+
 #endif
@@ -36,6 +36,12 @@ bool RHDatagram::sendto(uint8_t* buf, uint8_t len, uint8_t address)
     return _driver.send(buf, len);
 }
 
+bool RHDatagram::sendtoFragments(const RHGenericDriver::Fragment* fragments, uint8_t count, uint8_t address)
+{
+    setHeaderTo(address);
+    return _driver.sendFragments(fragments, count);
+}
+
 bool RHDatagram::recvfrom(uint8_t* buf, uint8_t* len, uint8_t* from, uint8_t* to, uint8_t* id, uint8_t* flags)
 {
     if (_driver.recv(buf, len))
@@ -49,6 +55,24 @@ bool RHDatagram::recvfrom(uint8_t* buf, uint8_t* len, uint8_t* from, uint8_t* to
     return false;
 }
 
+bool RHDatagram::recvfromBorrow(uint8_t** buf, uint8_t* len, uint8_t* from, uint8_t* to, uint8_t* id, uint8_t* flags)
+{
+    if (_driver.recvBorrow(buf, len))
+    {
+	if (from)  *from =  headerFrom();
+	if (to)    *to =    headerTo();
+	if (id)    *id =    headerId();
+	if (flags) *flags = headerFlags();
+	return true;
+    }
+    return false;
+}
+
+void RHDatagram::recvRelease()
+{
+    _driver.recvRelease();
+}
+
 bool RHDatagram::available()
 {
     return _driver.available();
@@ -8,10 +8,6 @@
 
 #include <RHGenericDriver.h>
 
-// This is the maximum possible message size for radios supported by RadioHead.
-// Not all radios support this length, and many are much smaller
-#define RH_MAX_MESSAGE_LEN 255
-
 /////////////////////////////////////////////////////////////////////
 /// \class RHDatagram RHDatagram.h <RHDatagram.h>
 /// \brief Manager class for addressed, unreliable messages
@@ -69,6 +65,14 @@ public:
     /// \return true if the message not too loing fot eh driver, and the message was transmitted.
     bool sendto(uint8_t* buf, uint8_t len, uint8_t address);
 
+    /// Like sendto(), but the message is made of several fragments, 
+    /// eg a header and a payload. See RHGenericDriver::sendFragments()
+    /// \param[in] fragments The pieces of the message, in order
+    /// \param[in] count Number of fragments
+    /// \param[in] address The address to send the message to.
+    /// \return true if the message not too long for the driver, and the message was transmitted.
+    bool sendtoFragments(const RHGenericDriver::Fragment* fragments, uint8_t count, uint8_t address);
+
     /// Turns the receiver on if it not already on.
     /// If there is a valid message available for this node, copy it to buf and return true
     /// The SRC address is placed in *from if present and not NULL.
@@ -86,6 +90,21 @@ public:
     /// \return true if a valid message was copied to buf
     bool recvfrom(uint8_t* buf, uint8_t* len, uint8_t* from = NULL, uint8_t* to = NULL, uint8_t* id = NULL, uint8_t* flags = NULL);
 
+    /// Like recvfrom(), but lends the message in place instead of copying it. 
+    /// See RHGenericDriver::recvBorrow(). The message must be given back with recvRelease()
+    /// before anything else can be received.
+    /// \param[out] buf Set to point at the message
+    /// \param[out] len Set to the length of the message
+    /// \param[in] from If present and not NULL, the referenced uint8_t will be set to the FROM address
+    /// \param[in] to If present and not NULL, the referenced uint8_t will be set to the TO address
+    /// \param[in] id If present and not NULL, the referenced uint8_t will be set to the ID
+    /// \param[in] flags If present and not NULL, the referenced uint8_t will be set to the FLAGS
+    /// \return true if a message was lent. Always false if the driver cannot lend messages
+    bool recvfromBorrow(uint8_t** buf, uint8_t* len, uint8_t* from = NULL, uint8_t* to = NULL, uint8_t* id = NULL, uint8_t* flags = NULL);
+
+    /// Gives back the message lent by recvfromBorrow(). Does nothing if the driver cannot lend messages
+    void recvRelease();
+
     /// Tests whether a new message is available
     /// from the Driver.
     /// On most drivers, this will also put the Driver into RHModeRx mode until
@@ -13,9 +13,16 @@ RHGenericDriver::RHGenericDriver()
     _txHeaderFrom(RH_BROADCAST_ADDRESS),
     _txHeaderId(0),
     _txHeaderFlags(0),
+    _lastRssi(0),
     _rxBad(0),
     _rxGood(0),
-    _txGood(0)
+    _txGood(0),
+    _rxQueueOverflows(0),
+    _rxQueue(0),
+    _rxQueueSlots(0),
+    _rxQueueSlotLen(0),
+    _rxQueueHead(0),
+    _rxQueueTail(0)
 {
 }
 
@@ -170,6 +177,122 @@ uint16_t RHGenericDriver::txGood()
     return _txGood;
 }
 
+bool RHGenericDriver::hasHardwareAck()
+{
+    return false;
+}
+
+bool RHGenericDriver::sendFragments(const Fragment* fragments, uint8_t count)
+{
+    if (count == 1)
+	return send(fragments[0].data, fragments[0].len);
+    uint8_t buf[RH_MAX_MESSAGE_LEN]; // No driver can send more than this anyway
+    uint16_t len = fragmentsLen(fragments, count);
+    if (len > maxMessageLength() || len > sizeof(buf))
+	return false;
+    uint8_t* p = buf;
+    for (uint8_t i = 0; i < count; i++)
+    {
+	memcpy(p, fragments[i].data, fragments[i].len);
+	p += fragments[i].len;
+    }
+    return send(buf, len);
+}
+
+uint16_t RHGenericDriver::fragmentsLen(const Fragment* fragments, uint8_t count)
+{
+    uint16_t len = 0;
+    while (count--)
+	len += fragments++->len;
+    return len;
+}
+
+bool RHGenericDriver::recvBorrow(uint8_t** buf, uint8_t* len)
+{
+    if (!canBorrowRecv() || !available())
+	return false;
+    // available() has peeked, so the oldest slot is ours until it is popped
+    uint8_t* slot = _rxQueue + (_rxQueueTail & (_rxQueueSlots - 1)) * _rxQueueSlotLen;
+    *buf = slot + RH_RX_QUEUE_OVERHEAD;
+    *len = slot[0] - (RH_RX_QUEUE_OVERHEAD - 1);
+    return true;
+}
+
+void RHGenericDriver::recvRelease()
+{
+    if (canBorrowRecv())
+	rxQueuePop(NULL, NULL);
+}
+
+bool RHGenericDriver::canBorrowRecv()
+{
+    return _rxQueue != NULL;
+}
+
+uint16_t RHGenericDriver::rxQueueOverflows()
+{
+    return _rxQueueOverflows;
+}
+
+void RHGenericDriver::rxQueueInit(uint8_t* storage, uint8_t slots, uint16_t slotLen)
+{
+    _rxQueue = storage;
+    _rxQueueSlots = slots;
+    _rxQueueSlotLen = slotLen;
+    _rxQueueHead = _rxQueueTail = 0;
+}
+
+// Called by the producer only
+uint8_t* RHGenericDriver::rxQueueSlot()
+{
+    // The indexes are free running, and the number of slots divides 256, so this works across wraparound
+    if ((uint8_t)(_rxQueueHead - _rxQueueTail) >= _rxQueueSlots)
+	return NULL; // Full
+    return _rxQueue + (_rxQueueHead & (_rxQueueSlots - 1)) * _rxQueueSlotLen + 1;
+}
+
+// Called by the producer only
+void RHGenericDriver::rxQueuePush(uint8_t len)
+{
+    _rxQueue[(_rxQueueHead & (_rxQueueSlots - 1)) * _rxQueueSlotLen] = len;
+    // The message must be complete before the consumer can see it
+    RH_MEMORY_BARRIER
+    _rxQueueHead++;
+}
+
+// Called by the consumer only
+bool RHGenericDriver::rxQueuePeek()
+{
+    if (_rxQueueHead == _rxQueueTail)
+	return false;
+    RH_MEMORY_BARRIER
+    uint8_t* slot = _rxQueue + (_rxQueueTail & (_rxQueueSlots - 1)) * _rxQueueSlotLen;
+    _rxHeaderTo    = slot[1];
+    _rxHeaderFrom  = slot[2];
+    _rxHeaderId    = slot[3];
+    _rxHeaderFlags = slot[4];
+    return true;
+}
+
+// Called by the consumer only
+bool RHGenericDriver::rxQueuePop(uint8_t* buf, uint8_t* len)
+{
+    if (!rxQueuePeek())
+	return false;
+    uint8_t* slot = _rxQueue + (_rxQueueTail & (_rxQueueSlots - 1)) * _rxQueueSlotLen;
+    if (buf && len)
+    {
+	uint8_t payloadLen = slot[0] - (RH_RX_QUEUE_OVERHEAD - 1);
+	if (*len > payloadLen)
+	    *len = payloadLen;
+	memcpy(buf, slot + RH_RX_QUEUE_OVERHEAD, *len);
+    }
+    // Finished with the slot before the producer can reuse it
+    RH_MEMORY_BARRIER
+    _rxQueueTail++;
+    return true;
+}
+
 #if (RH_PLATFORM == RH_PLATFORM_ARDUINO) && defined(RH_PLATFORM_ATTINY)
 // Tinycore does not have __cxa_pure_virtual, so without this we
 // get linking complaints from the default code generated for pure virtual functions
@@ -8,12 +8,20 @@
 
 #include <RadioHead.h>
 
+// This is the maximum possible message size for radios supported by RadioHead.
+// Not all radios support this length, and many are much smaller
+#define RH_MAX_MESSAGE_LEN 255
+
 // Defines bits of the FLAGS header reserved for use by the RadioHead library and 
 // the flags available for use by applications
 #define RH_FLAGS_RESERVED                 0xf0
 #define RH_FLAGS_APPLICATION_SPECIFIC     0x0f
 #define RH_FLAGS_NONE                     0
 
+// Number of octets in front of the payload of each message in the receive queue:
+// length, then the TO, FROM, ID and FLAGS headers
+#define RH_RX_QUEUE_OVERHEAD              5
+
 /////////////////////////////////////////////////////////////////////
 /// \class RHGenericDriver RHGenericDriver.h <RHGenericDriver.h>
 /// \brief Abstract base class for a RadioHead driver.
@@ -35,6 +43,29 @@
 /// -ID A message ID, distinct (over short time scales) for each message sent by a particilar node
 /// -FLAGS A bitmask of flags. The most significant 4 bits are reserved for use by RadioHead. The least
 /// significant 4 bits are reserved for applications.
+///
+/// \par Receive queue
+///
+/// Many drivers can hold only one received message, and another message arriving before the application
+/// has collected it with recv() is lost. Drivers can instead provide storage for a queue of received messages
+/// with rxQueueInit(), fill it with rxQueueSlot() and rxQueuePush() from their interrupt handler or 
+/// from available(), and empty it with rxQueuePeek() and rxQueuePop() in available() and recv().
+/// There may be one producer (eg an interrupt handler) and one consumer (the application)
+/// at once, without disabling interrupts. Messages that arrive when the queue is full are dropped, 
+/// and counted by rxQueueOverflows().
+///
+/// \par Zero-copy receive
+///
+/// recv() copies each message out of the driver. Drivers that use the receive queue can instead lend 
+/// the oldest message to the caller in place with recvBorrow(), until it is given back with recvRelease(),
+/// so that the managers can parse their headers where the message lies and copy only the application payload.
+///
+/// \par Scatter-gather send
+///
+/// sendFragments() sends a message made of several separate pieces, such as the headers added by each 
+/// manager layer followed by the application payload, as if they had been concatenated. Drivers that
+/// override it write each piece straight to the radio, so the layers do not need to copy the payload
+/// into a buffer behind their headers.
 class RHGenericDriver
 {
 public:
@@ -51,6 +82,13 @@ public:
 	RHModeRx                ///< Transport is in the process of receiving a message.
     } RHMode;
 
+    /// \brief One piece of a message passed to sendFragments()
+    typedef struct
+    {
+	const uint8_t* data; ///< The octets of this piece
+	uint8_t        len;  ///< Number of octets
+    } Fragment;
+
     /// Constructor
     RHGenericDriver();
 
@@ -79,6 +117,24 @@ public:
     /// \return true if a valid message was copied to buf
     virtual bool recv(uint8_t* buf, uint8_t* len) = 0;
 
+    /// Like recv(), but instead of copying the message, points at it where it lies in the driver.
+    /// The message stays there, and available() and the headerTo() etc values refer to it, until 
+    /// recvRelease() is called. The caller may modify it in place. Nothing else may be received
+    /// while it is borrowed, but messages may be sent.
+    /// \param[out] buf Set to point at the message payload
+    /// \param[out] len Set to the length of the message payload
+    /// \return true if a message was lent. Always false if canBorrowRecv() is false
+    virtual bool recvBorrow(uint8_t** buf, uint8_t* len);
+
+    /// Gives back the message lent by recvBorrow() and removes it, as if it had been collected by recv().
+    /// Does nothing if canBorrowRecv() is false
+    virtual void recvRelease();
+
+    /// Tells whether this driver can lend received messages with recvBorrow().
+    /// \return true if recvBorrow() is supported. The default implementation returns true
+    /// for drivers that use the receive queue
+    virtual bool canBorrowRecv();
+
     /// Waits until any previous transmit packet is finished being transmitted with waitPacketSent().
     /// Then loads a message into the transmitter and starts the transmitter. Note that a message length
     /// of 0 is NOT permitted. If the message is too long for the underlying radio technology, send() will
@@ -88,6 +144,21 @@ public:
     /// \return true if the message length was valid and it was correctly queued for transmit
     virtual bool send(const uint8_t* data, uint8_t len) = 0;
 
+    /// Sends a message made of several fragments, exactly as if they had been concatenated and passed
+    /// to send(). Unless there is only one, the default implementation concatenates them in a buffer on 
+    /// the stack the size of the message, which may be no longer than maxMessageLength(), and calls send(). 
+    /// Drivers override it to write the fragments straight to the radio.
+    /// \param[in] fragments The pieces of the message, in order
+    /// \param[in] count Number of fragments
+    /// \return true if the total length was valid and the message was correctly queued for transmit
+    virtual bool sendFragments(const Fragment* fragments, uint8_t count);
+
+    /// Returns the total length of the fragments of a message
+    /// \param[in] fragments The pieces of the message
+    /// \param[in] count Number of fragments
+    /// \return The sum of their lengths
+    static uint16_t fragmentsLen(const Fragment* fragments, uint8_t count);
+
     /// Returns the maximum message length 
     /// available in this Driver.
     /// \return The maximum legal message length
@@ -206,7 +277,46 @@ public:
     /// \return The number of packets successfully transmitted
     uint16_t       txGood();
 
+    /// Tells whether the transport hardware acknowledges and retransmits messages by itself.
+    /// If so, when waitPacketSent() returns true after sending a message to a single node (not a broadcast), 
+    /// that node has received it, and RHReliableDatagram does not need to send or wait for ACK messages.
+    /// \return true if messages are acknowledged in hardware. The default implementation returns false
+    virtual bool   hasHardwareAck();
+
+    /// Returns the count of the number of good received messages that were dropped because
+    /// the receive queue was full. Always 0 for drivers that do not use the receive queue.
+    /// \return The number of messages dropped
+    uint16_t       rxQueueOverflows();
+
 protected:
+    /// Sets up the receive queue. Called by drivers that use it, normally from their constructor.
+    /// \param[in] storage Space for the queue, slots * slotLen octets
+    /// \param[in] slots Number of messages the queue can hold. Must be a power of 2, no more than 128
+    /// \param[in] slotLen Space for each message: the driver's maximum message length 
+    /// plus RH_RX_QUEUE_OVERHEAD
+    void           rxQueueInit(uint8_t* storage, uint8_t slots, uint16_t slotLen);
+
+    /// Returns where to put the next received message: the 4 headers followed by the payload,
+    /// in the order TO, FROM, ID, FLAGS. Nothing is queued until rxQueuePush() is called.
+    /// If the queue is full, the driver may leave the message where it is (eg in the radio's own FIFO)
+    /// until there is room, or drop it and count it in _rxQueueOverflows.
+    /// \return Pointer to slotLen - 1 octets, or NULL if the queue is full
+    uint8_t*       rxQueueSlot();
+
+    /// Adds the message written to rxQueueSlot() to the queue
+    /// \param[in] len Number of octets written, including the 4 headers
+    void           rxQueuePush(uint8_t len);
+
+    /// Sets the received header values returned by headerTo() etc from the oldest queued message.
+    /// \return true if there is a message in the queue
+    bool           rxQueuePeek();
+
+    /// Copies the payload of the oldest queued message and removes it from the queue
+    /// \param[in] buf Location to copy the message payload, or NULL to discard it
+    /// \param[in,out] len Available space in buf. Set to the actual number of octets copied.
+    /// \return true if there was a message in the queue
+    bool           rxQueuePop(uint8_t* buf, uint8_t* len);
+
 
     /// The current transport operating mode
     volatile RHMode     _mode;
@@ -252,8 +362,23 @@ protected:
 
     /// Count of the number of bad messages (correct checksum etc) received
     volatile uint16_t   _txGood;
+
+    /// Count of the number of good messages dropped because the receive queue was full
+    volatile uint16_t   _rxQueueOverflows;
     
 private:
+    /// Receive queue storage provided by the driver, NULL if the driver does not use the queue
+    uint8_t*            _rxQueue;
+
+    /// Number of messages and octets per message in _rxQueue
+    uint8_t             _rxQueueSlots;
+    uint16_t            _rxQueueSlotLen;
+
+    /// Free running count of messages added to the queue, written only by the producer
+    volatile uint8_t    _rxQueueHead;
+
+    /// Free running count of messages removed from the queue, written only by the consumer
+    volatile uint8_t    _rxQueueTail;
 
 };
 
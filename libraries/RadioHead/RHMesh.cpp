@@ -13,18 +13,43 @@
 
 #include <RHMesh.h>
 
-uint8_t RHMesh::_tmpMessage[RH_ROUTER_MAX_MESSAGE_LEN];
-
 ////////////////////////////////////////////////////////////////////
 // Constructors
 RHMesh::RHMesh(RHGenericDriver& driver, uint8_t thisAddress) 
     : RHRouter(driver, thisAddress)
 {
+    _arpTimeout = RH_MESH_DEFAULT_ARP_TIMEOUT;
+    _arpRetries = RH_MESH_DEFAULT_ARP_RETRIES;
+    uint8_t i;
+    for (i = 0; i < RH_MESH_MAX_DISCOVERIES; i++)
+	_arps[i].tries = 0;
+    for (i = 0; i < RH_MESH_MAX_PENDING; i++)
+	_sendtos[i].result = RH_MESH_SEND_FREE;
+    _sendtoCallback = NULL;
+    for (i = 0; i < RH_MESH_SEEN_CACHE_SIZE; i++)
+	_seen[i].source = RH_BROADCAST_ADDRESS;
+    _seenNext = 0;
+    _rebroadcastJitter = RH_MESH_DEFAULT_REBROADCAST_JITTER;
+    _rebroadcastLen = 0;
+    _heldValid = false;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHMesh::setArpTimeout(uint16_t timeout, uint8_t retries)
+{
+    _arpTimeout = timeout;
+    _arpRetries = retries;
 }
 
 ////////////////////////////////////////////////////////////////////
 // Public methods
 
+////////////////////////////////////////////////////////////////////
+void RHMesh::setRebroadcastJitter(uint16_t jitter)
+{
+    _rebroadcastJitter = jitter;
+}
+
 ////////////////////////////////////////////////////////////////////
 // Discovers a route to the destination (if necessary), sends and 
 // waits for delivery to the next hop (but not for delivery to the final destination)
@@ -40,49 +65,294 @@ uint8_t RHMesh::sendtoWait(uint8_t* buf, uint8_t len, uint8_t address, uint8_t f
 	    return RH_ROUTER_ERROR_NO_ROUTE;
     }
 
-    // Now have a route. Contruct an application layer message and send it via that route
-    MeshApplicationMessage* a = (MeshApplicationMessage*)&_tmpMessage;
-    a->header.msgType = RH_MESH_MESSAGE_TYPE_APPLICATION;
-    memcpy(a->data, buf, len);
-    return RHRouter::sendtoWait(_tmpMessage, sizeof(RHMesh::MeshMessageHeader) + len, address, flags);
+    // Now have a route. Put an application layer header in front of the message and send it via that route
+    MeshMessageHeader header;
+    header.msgType = RH_MESH_MESSAGE_TYPE_APPLICATION;
+    RHGenericDriver::Fragment message[2] = { { (uint8_t*)&header, sizeof(header) }, { buf, len } };
+    return RHRouter::sendtoWaitFragments(message, 2, address, flags);
 }
 
 ////////////////////////////////////////////////////////////////////
 bool RHMesh::doArp(uint8_t address)
 {
-    // Need to discover a route
-    // Broadcast a route discovery message with nothing in it
-    MeshRouteDiscoveryMessage* p = (MeshRouteDiscoveryMessage*)&_tmpMessage;
-    p->header.msgType = RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_REQUEST;
-    p->destlen = 1; 
-    p->dest = address; // Who we are looking for
-    uint8_t error = RHRouter::sendtoWait((uint8_t*)p, sizeof(RHMesh::MeshMessageHeader) + 2, RH_BROADCAST_ADDRESS);
-    if (error !=  RH_ROUTER_ERROR_NONE)
+    if (!startArp(address))
 	return false;
-    
-    // Wait for a reply, which will be unicast back to us
-    // It will contain the complete route to the destination
-    uint8_t messageLen = sizeof(_tmpMessage);
-    // FIXME: timeout should be configurable
-    unsigned long starttime = millis();
-    while ((millis() - starttime) < 4000)
+
+    // Wait for a reply, which will be unicast back to us. peekAtMessage() adds the route 
+    // to the dest to the routing table, unless we already had a better one.
+    // Meanwhile go on relaying and answering everyone else's messages and route discoveries.
+    // An application message for us is kept for the next recvfromAck(). There is only room 
+    // for one, so that ends the wait, and the discovery carries on in recvfromAck() and poll()
+    while (isArping(address) && !_heldValid)
+    {
+	uint8_t* data;
+	flushRebroadcast(false);
+	_heldValid = recvfromAckApplication(&data, &_heldLen, &_heldSource, &_heldDest, &_heldId, &_heldFlags);
+	if (_heldValid)
+	{
+	    // Keep it in _spare, where recvfromAckInto() leaves it if the driver cant lend it
+	    uint8_t* held = ((MeshApplicationMessage*)_spare.data)->data;
+	    if (data != held)
+		memcpy(held, data, _heldLen);
+	    recvRelease();
+	}
+	pollArps();
+	// Sleep until something arrives or a discovery needs repeating, if the driver can
+	if (!_heldValid)
+	    waitAvailableTimeout(waitLimit(_arpTimeout));
+    }
+    return getRouteTo(address) != NULL;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHMesh::startArp(uint8_t address)
+{
+    if (isArping(address))
+	return true;
+    for (uint8_t i = 0; i < RH_MESH_MAX_DISCOVERIES; i++)
+    {
+	if (_arps[i].tries == 0)
+	{
+	    _arps[i].address = address;
+	    _arps[i].tries = 1;
+	    _arps[i].timeout = _arpTimeout;
+	    _arps[i].sentAt = millis();
+	    // If the request cant be sent, it will be repeated when the timeout expires
+	    sendArpRequest(address);
+	    return true;
+	}
+    }
+    return false; // All in use
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHMesh::isArping(uint8_t address)
+{
+    for (uint8_t i = 0; i < RH_MESH_MAX_DISCOVERIES; i++)
+	if (_arps[i].tries && _arps[i].address == address)
+	    return true;
+    return false;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHMesh::sendArpRequest(uint8_t address)
+{
+    // Broadcast a route discovery message with nothing in it
+    struct
+    {
+	MeshMessageHeader header;
+	uint8_t           destlen;
+	uint8_t           dest;
+    } p;
+    p.header.msgType = RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_REQUEST;
+    p.destlen = 1; 
+    p.dest = address; // Who we are looking for
+    return RHRouter::sendtoWait((uint8_t*)&p, sizeof(p), RH_BROADCAST_ADDRESS) == RH_ROUTER_ERROR_NONE;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHMesh::pollArps()
+{
+    for (uint8_t i = 0; i < RH_MESH_MAX_DISCOVERIES; i++)
     {
-	if (RHRouter::recvfromAck(_tmpMessage, &messageLen))
+	if (_arps[i].tries == 0)
+	    continue;
+	if (getRouteTo(_arps[i].address))
+	    _arps[i].tries = 0; // Found it
+	else if ((millis() - _arps[i].sentAt) >= _arps[i].timeout)
 	{
-	    if (   messageLen > 1
-		&& p->header.msgType == RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_RESPONSE)
+	    if (_arps[i].tries > _arpRetries)
 	    {
-		// Got a reply, now add the next hop to the dest to the routing table
-		// The first hop taken is the first octet
-		addRouteTo(address, headerFrom());
-		return true;
+		_arps[i].tries = 0; // Give up
+		continue;
 	    }
+	    // Try again, waiting twice as long
+	    _arps[i].tries++;
+	    _arps[i].timeout <<= 1;
+	    _arps[i].sentAt = millis();
+	    sendArpRequest(_arps[i].address);
+	}
+    }
+}
+
+////////////////////////////////////////////////////////////////////
+uint16_t RHMesh::waitLimit(uint16_t limit)
+{
+    unsigned long now = millis();
+    if (_rebroadcastLen)
+    {
+	long due = (long)(_rebroadcastAt - now);
+	if (due < (long)limit)
+	    limit = due > 0 ? due : 0;
+    }
+    // Discoveries that are already overdue are left for the next pollArps()
+    for (uint8_t i = 0; i < RH_MESH_MAX_DISCOVERIES; i++)
+    {
+	unsigned long waited = now - _arps[i].sentAt;
+	if (_arps[i].tries && waited < _arps[i].timeout && _arps[i].timeout - waited < limit)
+	    limit = _arps[i].timeout - waited;
+    }
+    return limit;
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHMesh::startSendto(uint8_t* buf, uint8_t len, uint8_t address, uint8_t flags)
+{
+    if (len > RH_MESH_MAX_MESSAGE_LEN)
+	return 0;
+    for (uint8_t i = 0; i < RH_MESH_MAX_PENDING; i++)
+    {
+	if (_sendtos[i].result == RH_MESH_SEND_FREE)
+	{
+	    _sendtos[i].buf = buf;
+	    _sendtos[i].len = len;
+	    _sendtos[i].address = address;
+	    _sendtos[i].flags = flags;
+	    _sendtos[i].arped = false;
+	    _sendtos[i].handle = 0;
+	    _sendtos[i].result = RH_MESH_SEND_PENDING;
+	    return i + 1;
 	}
-	YIELD;
     }
+    return 0; // All in use
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHMesh::poll()
+{
+    // This counts our sends to their next hops that are still waiting for an ACK
+    uint8_t pending = RHReliableDatagram::poll();
+    flushRebroadcast(false);
+    pollArps();
+
+    // Finish the sends whose next hop has acknowledged or given up, and start sending to the next hop
+    // those whose route is known. Start discoveries for the others, or fail them if discovery did not find a route
+    for (uint8_t i = 0; i < RH_MESH_MAX_PENDING; i++)
+    {
+	if (_sendtos[i].result != RH_MESH_SEND_PENDING)
+	    continue;
+	if (_sendtos[i].handle)
+	{
+	    uint8_t tries = sendTries(_sendtos[i].handle);
+	    SendStatus status = sendStatus(_sendtos[i].handle);
+	    if (status == SendPending)
+		continue; // Already counted
+	    _sendtos[i].handle = 0;
+	    if (status == SendAcked)
+	    {
+		addRetransmissionCost(_sendtos[i].address, tries - 1);
+		finishSendto(i, RH_ROUTER_ERROR_NONE);
+	    }
+	    else
+	    {
+		// Cant deliver to the next hop. Delete the route, as route() does
+		deleteRouteTo(_sendtos[i].address);
+		finishSendto(i, RH_ROUTER_ERROR_UNABLE_TO_DELIVER);
+	    }
+	    continue;
+	}
+	RoutingTableEntry* route = NULL;
+	if (   _sendtos[i].address == RH_BROADCAST_ADDRESS
+	    || (route = getRouteTo(_sendtos[i].address)))
+	{
+	    if (   _sendtos[i].len + sizeof(_sendtos[i].headers) + RH_RELIABLE_DATAGRAM_ID_OVERHEAD 
+		> _driver.maxMessageLength())
+	    {
+		finishSendto(i, RH_ROUTER_ERROR_INVALID_LENGTH);
+		continue;
+	    }
+	    // The RHRouter and application layer headers go in front of the message
+	    _sendtos[i].headers.routed.dest = _sendtos[i].address;
+	    _sendtos[i].headers.routed.source = _thisAddress;
+	    _sendtos[i].headers.routed.hops = 0;
+	    _sendtos[i].headers.routed.id = _lastE2ESequenceNumber;
+	    _sendtos[i].headers.routed.flags = _sendtos[i].flags;
+	    _sendtos[i].headers.mesh.msgType = RH_MESH_MESSAGE_TYPE_APPLICATION;
+	    _sendtos[i].fragments[0].data = (uint8_t*)&_sendtos[i].headers;
+	    _sendtos[i].fragments[0].len = sizeof(_sendtos[i].headers);
+	    _sendtos[i].fragments[1].data = _sendtos[i].buf;
+	    _sendtos[i].fragments[1].len = _sendtos[i].len;
+	    // Try again next time if there are too many sends in progress
+	    _sendtos[i].handle = startSendFragments(_sendtos[i].fragments, 2, 
+						    route ? route->next_hop : RH_BROADCAST_ADDRESS);
+	    if (_sendtos[i].handle)
+		_lastE2ESequenceNumber++;
+	    pending++;
+	    continue;
+	}
+	if (!isArping(_sendtos[i].address))
+	{
+	    if (_sendtos[i].arped)
+	    {
+		finishSendto(i, RH_ROUTER_ERROR_NO_ROUTE);
+		continue;
+	    }
+	    // Try again next time if there are too many discoveries in progress
+	    _sendtos[i].arped = startArp(_sendtos[i].address);
+	}
+	pending++;
+    }
+    return pending;
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHMesh::sendtoResult(uint8_t handle)
+{
+    if (handle == 0 || handle > RH_MESH_MAX_PENDING)
+	return RH_MESH_SEND_FREE;
+    uint8_t result = _sendtos[handle - 1].result;
+    if (result != RH_MESH_SEND_PENDING)
+	_sendtos[handle - 1].result = RH_MESH_SEND_FREE;
+    return result;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHMesh::setSendtoCallback(SendtoCallback callback)
+{
+    _sendtoCallback = callback;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHMesh::finishSendto(uint8_t index, uint8_t error)
+{
+    _sendtos[index].result = error;
+    if (_sendtoCallback)
+    {
+	// Free the handle first, so the callback can reuse it
+	_sendtos[index].result = RH_MESH_SEND_FREE;
+	_sendtoCallback(index + 1, error);
+    }
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHMesh::seenRequest(uint8_t source, uint8_t id)
+{
+    uint8_t i;
+    for (i = 0; i < RH_MESH_SEEN_CACHE_SIZE; i++)
+	if (   _seen[i].source == source 
+	    && _seen[i].id == id
+	    && (millis() - _seen[i].seenAt) < RH_MESH_SEEN_TIMEOUT)
+	    return true;
+    // New one. Replace the oldest
+    _seen[_seenNext].source = source;
+    _seen[_seenNext].id = id;
+    _seen[_seenNext].seenAt = millis();
+    if (++_seenNext >= RH_MESH_SEEN_CACHE_SIZE)
+	_seenNext = 0;
     return false;
 }
 
+////////////////////////////////////////////////////////////////////
+void RHMesh::flushRebroadcast(bool force)
+{
+    if (!_rebroadcastLen || (!force && (long)(millis() - _rebroadcastAt) < 0))
+	return;
+    RHGenericDriver::Fragment data = { _rebroadcast, _rebroadcastLen };
+    _rebroadcastLen = 0;
+    // REVISIT: if this fails what can we do?
+    route(&_rebroadcastHeader, &data, 1);
+}
+
 ////////////////////////////////////////////////////////////////////
 // Called by RHRouter::recvfromAck whenever a message goes past
 void RHMesh::peekAtMessage(RoutedMessage* message, uint8_t messageLen)
@@ -95,16 +365,18 @@ void RHMesh::peekAtMessage(RoutedMessage* message, uint8_t messageLen)
 	// being routed back to the originator here. Want to scrape some routing data out of the response
 	// We can find the routes to all the nodes between here and the responding node
 	MeshRouteDiscoveryMessage* d = (MeshRouteDiscoveryMessage*)message->data;
-	addRouteTo(d->dest, headerFrom());
 	uint8_t numRoutes = messageLen - sizeof(RoutedMessageHeader) - sizeof(MeshMessageHeader) - 2;
 	uint8_t i;
-	// Find us in the list of nodes that were traversed to get to the responding node
+	// Find us in the list of nodes that were traversed to get to the responding node.
+	// If we are not there, we are the originator, just before the first of them
 	for (i = 0; i < numRoutes; i++)
 	    if (d->route[i] == _thisAddress)
 		break;
-	i++;
-	while (i++ < numRoutes)
-	    addRouteTo(d->route[i], headerFrom());
+	uint8_t us = (i < numRoutes) ? i + 1 : 0;
+	// The nodes after us in the list, then the responding node, are 1, 2, 3... hops away
+	for (i = us; i < numRoutes; i++)
+	    offerRouteTo(d->route[i], headerFrom(), i - us + 1);
+	offerRouteTo(d->dest, headerFrom(), numRoutes - us + 1);
     }
     else if (   messageLen > 1 
 	     && m->msgType == RH_MESH_MESSAGE_TYPE_ROUTE_FAILURE)
@@ -116,24 +388,25 @@ void RHMesh::peekAtMessage(RoutedMessage* message, uint8_t messageLen)
 
 ////////////////////////////////////////////////////////////////////
 // This is called when a message is to be delivered to the next hop
-uint8_t RHMesh::route(RoutedMessage* message, uint8_t messageLen)
+uint8_t RHMesh::route(RoutedMessageHeader* header, const RHGenericDriver::Fragment* fragments, uint8_t count)
 {
     uint8_t from = headerFrom(); // Might get clobbered during call to superclass route()
-    uint8_t ret = RHRouter::route(message, messageLen);
+    uint8_t ret = RHRouter::route(header, fragments, count);
     if (   ret == RH_ROUTER_ERROR_NO_ROUTE
 	|| ret == RH_ROUTER_ERROR_UNABLE_TO_DELIVER)
     {
 	// Cant deliver to the next hop. Delete the route
-	deleteRouteTo(message->header.dest);
-	if (message->header.source != _thisAddress)
+	deleteRouteTo(header->dest);
+	if (header->source != _thisAddress)
 	{
-	    // This is being proxied, so tell the originator about it
-	    MeshRouteFailureMessage* p = (MeshRouteFailureMessage*)&_tmpMessage;
-	    p->header.msgType = RH_MESH_MESSAGE_TYPE_ROUTE_FAILURE;
-	    p->dest = message->header.dest; // Who you were trying to deliver to
+	    // This is being proxied, so tell the originator about it with a MeshRouteFailureMessage
+	    MeshMessageHeader failure;
+	    failure.msgType = RH_MESH_MESSAGE_TYPE_ROUTE_FAILURE;
+	    RHGenericDriver::Fragment p[] = { { (uint8_t*)&failure, sizeof(failure) }, 
+					      { &header->dest, 1 } }; // Who you were trying to deliver to
 	    // Make sure there is a route back towards whoever sent the original message
-	    addRouteTo(message->header.source, from);
-	    ret = RHRouter::sendtoWait((uint8_t*)p, sizeof(RHMesh::MeshMessageHeader) + 1, message->header.source);
+	    addRouteTo(header->source, from);
+	    ret = RHRouter::sendtoWaitFragments(p, 2, header->source);
 	}
     }
     return ret;
@@ -150,14 +423,46 @@ bool RHMesh::isPhysicalAddress(uint8_t* address, uint8_t addresslen)
 ////////////////////////////////////////////////////////////////////
 bool RHMesh::recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* source, uint8_t* dest, uint8_t* id, uint8_t* flags)
 {     
-    uint8_t tmpMessageLen = sizeof(_tmpMessage);
+    uint8_t* data;
+    uint8_t dataLen;
+    if (_heldValid)
+    {
+	// Received while doArp() was waiting
+	if (source) *source = _heldSource;
+	if (dest)   *dest   = _heldDest;
+	if (id)     *id     = _heldId;
+	if (flags)  *flags  = _heldFlags;
+	if (*len > _heldLen)
+	    *len = _heldLen;
+	memcpy(buf, ((MeshApplicationMessage*)_spare.data)->data, *len);
+	_heldValid = false;
+	return true;
+    }
+    flushRebroadcast(false);
+    if (recvfromAckApplication(&data, &dataLen, source, dest, id, flags))
+    {
+	if (*len > dataLen)
+	    *len = dataLen;
+	// Straight from the driver to the caller
+	memcpy(buf, data, *len);
+	recvRelease();
+	return true;
+    }
+    return false;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHMesh::recvfromAckApplication(uint8_t** buf, uint8_t* len, uint8_t* source, uint8_t* dest, uint8_t* id, uint8_t* flags)
+{     
+    uint8_t* message;
+    uint8_t tmpMessageLen;
     uint8_t _source;
     uint8_t _dest;
     uint8_t _id;
     uint8_t _flags;
-    if (RHRouter::recvfromAck(_tmpMessage, &tmpMessageLen, &_source, &_dest, &_id, &_flags))
+    if (recvfromAckInto(&message, &tmpMessageLen, &_source, &_dest, &_id, &_flags))
     {
-	MeshMessageHeader* p = (MeshMessageHeader*)&_tmpMessage;
+	MeshMessageHeader* p = (MeshMessageHeader*)message;
 
 	if (   tmpMessageLen >= 1 
 	    && p->msgType == RH_MESH_MESSAGE_TYPE_APPLICATION)
@@ -168,18 +473,21 @@ bool RHMesh::recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* source, uint8_t* d
 	    if (dest)   *dest   = _dest;
 	    if (id)     *id     = _id;
 	    if (flags)  *flags  = _flags;
-	    uint8_t msgLen = tmpMessageLen - sizeof(MeshMessageHeader);
-	    if (*len > msgLen)
-		*len = msgLen;
-	    memcpy(buf, a->data, *len);
-	    
+	    *buf = a->data;
+	    *len = tmpMessageLen - sizeof(MeshMessageHeader);
 	    return true;
 	}
 	else if (   _dest == RH_BROADCAST_ADDRESS 
 		 && tmpMessageLen > 1 
 		 && p->msgType == RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_REQUEST)
 	{
-	    MeshRouteDiscoveryMessage* d = (MeshRouteDiscoveryMessage*)p;
+	    // This may be sent on, so the driver has to be free to receive acknowledgements
+	    if (message != _spare.data)
+	    {
+		memcpy(_spare.data, message, tmpMessageLen);
+		recvRelease();
+	    }
+	    MeshRouteDiscoveryMessage* d = (MeshRouteDiscoveryMessage*)_spare.data;
 	    // Handle Route discovery requests
 	    // Message is an array of node addresses the route request has already passed through
 	    // If it originally came from us, ignore it
@@ -193,10 +501,23 @@ bool RHMesh::recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* source, uint8_t* d
 		if (d->route[i] == _thisAddress)
 		    return false; // Already been through us. Discard
 	    
-	    // Hasnt been past us yet, record routes back to the earlier nodes
-	    addRouteTo(_source, headerFrom()); // The originator
+	    // Hasnt been past us yet, record routes back to the earlier nodes, 
+	    // unless we know better ones. The last in the list is 1 hop away.
+	    // Copies that came by other paths may have shorter routes, so this is done for all of them
+	    offerRouteTo(_source, headerFrom(), numRoutes + 1); // The originator
 	    for (i = 0; i < numRoutes; i++)
-		addRouteTo(d->route[i], headerFrom());
+		offerRouteTo(d->route[i], headerFrom(), numRoutes - i);
+
+	    // Only answer or pass on the first copy of each request
+	    if (seenRequest(_source, _id))
+	    {
+		if (   _rebroadcastLen 
+		    && _rebroadcastHeader.source == _source 
+		    && _rebroadcastHeader.id == _id
+		    && ++_rebroadcastCopies >= RH_MESH_REBROADCAST_SUPPRESS)
+		    _rebroadcastLen = 0; // Enough neighbours have passed it on already
+		return false;
+	    }
 	    if (isPhysicalAddress(&d->dest, d->destlen))
 	    {
 		// This route discovery is for us. Unicast the whole route back to the originator
@@ -207,29 +528,64 @@ bool RHMesh::recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* source, uint8_t* d
 	    }
 	    else if (i < _max_hops)
 	    {
-		// Its for someone else, rebroadcast it, after adding ourselves to the list
+		// Its for someone else, rebroadcast it after a random delay, after adding ourselves to the list.
+		// Only one can wait at a time
+		flushRebroadcast(true);
 		d->route[numRoutes] = _thisAddress;
 		tmpMessageLen++;
-		// Have to impersonate the source
-		// REVISIT: if this fails what can we do?
-		RHRouter::sendtoFromSourceWait(_tmpMessage, tmpMessageLen, RH_BROADCAST_ADDRESS, _source);
+		// Have to impersonate the source, and keep its ID so other nodes recognise the copies
+		_rebroadcastHeader.dest = RH_BROADCAST_ADDRESS;
+		_rebroadcastHeader.source = _source;
+		_rebroadcastHeader.hops = numRoutes + 1;
+		_rebroadcastHeader.id = _id;
+		_rebroadcastHeader.flags = _flags;
+		if (tmpMessageLen <= sizeof(_rebroadcast))
+		{
+		    memcpy(_rebroadcast, d, tmpMessageLen);
+		    _rebroadcastLen = tmpMessageLen;
+		    _rebroadcastCopies = 0;
+		    _rebroadcastAt = millis() + (_rebroadcastJitter ? random(0, _rebroadcastJitter) : 0);
+		}
+		else
+		{
+		    // Too long to wait
+		    RHGenericDriver::Fragment data = { _spare.data, tmpMessageLen };
+		    route(&_rebroadcastHeader, &data, 1);
+		}
 	    }
 	}
+	else
+	    recvRelease();
     }
     return false;
 }
 
+////////////////////////////////////////////////////////////////////
+bool RHMesh::available()
+{
+    return _heldValid || RHRouter::available();
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHMesh::waitAvailableTimeout(uint16_t timeout)
+{
+    return _heldValid || RHRouter::waitAvailableTimeout(timeout);
+}
+
 ////////////////////////////////////////////////////////////////////
 bool RHMesh::recvfromAckTimeout(uint8_t* buf, uint8_t* len, uint16_t timeout, uint8_t* from, uint8_t* to, uint8_t* id, uint8_t* flags)
 {  
     unsigned long starttime = millis();
-    while ((millis() - starttime) < timeout)
+    while (true)
     {
 	if (recvfromAck(buf, len, from, to, id, flags))
 	    return true;
-	YIELD;
+	unsigned long elapsed = millis() - starttime;
+	if (elapsed >= timeout)
+	    return false;
+	// Sleep until something arrives, but not past a pending rebroadcast or discovery
+	waitAvailableTimeout(waitLimit(timeout - elapsed));
     }
-    return false;
 }
 
 
@@ -15,6 +15,54 @@
 #define RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_RESPONSE       2
 #define RH_MESH_MESSAGE_TYPE_ROUTE_FAILURE                  3
 
+// The maximum number of route discoveries that can be in progress at once
+#ifndef RH_MESH_MAX_DISCOVERIES
+ #define RH_MESH_MAX_DISCOVERIES 4
+#endif
+
+// The maximum number of sends started by startSendto() that can be waiting for a route or for the next hop at once
+#ifndef RH_MESH_MAX_PENDING
+ #define RH_MESH_MAX_PENDING 4
+#endif
+
+// Default time to wait for a reply to the first route discovery request, in milliseconds.
+// Each retry waits twice as long as the one before
+#ifndef RH_MESH_DEFAULT_ARP_TIMEOUT
+ #define RH_MESH_DEFAULT_ARP_TIMEOUT 2000
+#endif
+
+// Default number of times a route discovery request is repeated if there is no reply
+#ifndef RH_MESH_DEFAULT_ARP_RETRIES
+ #define RH_MESH_DEFAULT_ARP_RETRIES 1
+#endif
+
+// The number of recently seen route discovery requests remembered, so that copies of the same
+// request arriving by other paths are not broadcast again
+#ifndef RH_MESH_SEEN_CACHE_SIZE
+ #define RH_MESH_SEEN_CACHE_SIZE 8
+#endif
+
+// How long a route discovery request is remembered, in milliseconds. Must be longer than it takes
+// a request to flood the network, and shorter than it takes the originator to send 256 more messages
+#ifndef RH_MESH_SEEN_TIMEOUT
+ #define RH_MESH_SEEN_TIMEOUT 10000
+#endif
+
+// Default maximum random delay before rebroadcasting a route discovery request, in milliseconds
+#ifndef RH_MESH_DEFAULT_REBROADCAST_JITTER
+ #define RH_MESH_DEFAULT_REBROADCAST_JITTER 50
+#endif
+
+// A route discovery request waiting to be broadcast again is not sent after all if this many
+// other copies of it are heard during the delay, since the neighbours have then probably heard it already
+#ifndef RH_MESH_REBROADCAST_SUPPRESS
+ #define RH_MESH_REBROADCAST_SUPPRESS 3
+#endif
+
+// Results of sendtoResult() other than the RH_ROUTER_ERROR_* codes
+#define RH_MESH_SEND_PENDING 0xfe
+#define RH_MESH_SEND_FREE    0xff
+
 /////////////////////////////////////////////////////////////////////
 /// \class RHMesh RHMesh.h <RHMesh.h>
 /// \brief RHRouter subclass for sending addressed, optionally acknowledged datagrams
@@ -62,9 +110,10 @@
 /// RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_RESPONSE together ensure the original requester and all 
 /// the intermediate nodes know how to route to the source and destination nodes and every node along the path.
 ///
-/// Note that there is a race condition here that can effect routing on multipath routes. For example, 
-/// if the route to the destination can traverse several paths, last reply from the destination 
-/// will be the one used.
+/// Where there are several paths, each route learned this way carries its number of hops and a cost 
+/// (see RHRouter::offerRouteTo()), which also takes into account the signal strength of the next hop,
+/// and retransmissions needed when it is used. A route is only replaced by a cheaper route through a different
+/// next hop, so the best path found is kept, rather than whichever was heard last.
 ///
 /// \par Route Failure
 ///
@@ -142,6 +191,15 @@ public:
     /// Then sends the message to the next hop
     /// Then waits for an acknowledgement from the next hop 
     /// (but not from the destination node (if that is different).
+    /// While waiting for a route, other nodes' messages are relayed as usual, and the first application
+    /// message for this node is kept for the next recvfromAck(). There is room to keep only one, and
+    /// the driver delivers messages in the order they arrived, so the route reply cannot be seen until
+    /// that message has been collected. The wait then ends early, and sendtoWait() returns 
+    /// RH_ROUTER_ERROR_NO_ROUTE although the discovery is still going on. It carries on in recvfromAck()
+    /// and poll(), so collect the message with recvfromAck() and call sendtoWait() again: it will use the 
+    /// discovery in progress or the route it found, without starting another. The longest sendtoWait() 
+    /// otherwise blocks for discovery is the sum of the timeouts set by setArpTimeout(), doubling 
+    /// with each retry. startSendto() does not block, and is not cut short like this.
     /// \param [in] buf The application message data
     /// \param [in] len Number of octets in the application message data. 0 is permitted
     /// \param [in] dest The destination node address. If the address is RH_BROADCAST_ADDRESS (255)
@@ -151,7 +209,9 @@ public:
     /// \return The result code:
     ///         - RH_ROUTER_ERROR_NONE Message was routed and delivered to the next hop 
     ///           (not necessarily to the final dest address)
-    ///         - RH_ROUTER_ERROR_NO_ROUTE There was no route for dest in the local routing table
+    ///         - RH_ROUTER_ERROR_NO_ROUTE There was no route for dest in the local routing table,
+    ///           and discovery did not find one, or was cut short by an application message for this node
+    ///           (see above). available() is true in the second case.
     ///         - RH_ROUTER_ERROR_UNABLE_TO_DELIVER Not able to deliver to the next hop 
     ///           (usually because it dod not acknowledge due to being off the air or out of range
     uint8_t sendtoWait(uint8_t* buf, uint8_t len, uint8_t dest, uint8_t flags = 0);
@@ -193,6 +253,71 @@ public:
     /// \return true if a valid message was copied to buf
     bool recvfromAckTimeout(uint8_t* buf, uint8_t* len,  uint16_t timeout, uint8_t* source = NULL, uint8_t* dest = NULL, uint8_t* id = NULL, uint8_t* flags = NULL);
 
+    /// Tests whether a new message is available, including one kept by doArp() for recvfromAck()
+    /// \return true if recvfromAck() may have a message to return
+    bool available();
+
+    /// Like RHDatagram::waitAvailableTimeout(), but returns at once if doArp() has kept 
+    /// a message for recvfromAck()
+    /// \param[in] timeout Maximum time to wait in milliseconds.
+    /// \return true if a message is available
+    bool waitAvailableTimeout(uint16_t timeout);
+
+    /// Sets how long to wait for a reply to a route discovery request, and how many times to repeat it.
+    /// Each retry waits twice as long as the one before.
+    /// \param[in] timeout Time to wait for a reply to the first request in milliseconds.
+    /// Defaults to RH_MESH_DEFAULT_ARP_TIMEOUT
+    /// \param[in] retries Number of times to repeat the request. Defaults to RH_MESH_DEFAULT_ARP_RETRIES
+    void setArpTimeout(uint16_t timeout, uint8_t retries = RH_MESH_DEFAULT_ARP_RETRIES);
+
+    /// Sets the maximum random delay before broadcasting a route discovery request from another node again.
+    /// Use a larger value for slow radios or dense networks. 
+    /// \param[in] jitter Maximum delay in milliseconds. 0 means no delay. 
+    /// Defaults to RH_MESH_DEFAULT_REBROADCAST_JITTER
+    void setRebroadcastJitter(uint16_t jitter);
+
+    /// Function called by poll() when a send started by startSendto() finishes
+    /// \param[in] handle The handle returned by startSendto()
+    /// \param[in] error One of the RH_ROUTER_ERROR_* codes, as returned by sendtoWait()
+    typedef void (*SendtoCallback)(uint8_t handle, uint8_t error);
+
+    /// Starts sending a message to the destination node without waiting for route discovery.
+    /// Once there is a route to dest, poll() starts sending the message to the next hop with
+    /// RHReliableDatagram::startSendFragments(), and later calls to poll() retransmit it and finish the send
+    /// when it is acknowledged or the retries run out, without blocking.
+    /// If there is no route, discovery is started by poll(), and the send fails if it does not find one.
+    /// Do not set a callback with RHReliableDatagram::setSendCallback(): it would collect the results
+    /// poll() needs.
+    /// \param [in] buf The application message data. Must remain unchanged until the send is finished
+    /// \param [in] len Number of octets in the application message data. 0 is permitted
+    /// \param [in] dest The destination node address, or RH_BROADCAST_ADDRESS
+    /// \param [in] flags Optional flags delivered end-to-end to the dest address
+    /// \return A handle for the send, for sendtoResult(), or 0 if len is too long or there are already
+    /// RH_MESH_MAX_PENDING sends in progress
+    uint8_t startSendto(uint8_t* buf, uint8_t len, uint8_t dest, uint8_t flags = 0);
+
+    /// Advances the sends started by startSendto() and the RHReliableDatagram::startSend() sends. 
+    /// Broadcasts a route discovery request again if its random delay has expired. Repeats or gives up on route discoveries that have not had a reply in time, 
+    /// starts discoveries for queued messages with no route, 
+    /// and starts sending the queued messages whose route is known. Never waits for an acknowledgement.
+    /// Route discovery responses are received by recvfromAck(), not here.
+    /// \return The number of sends still pending
+    uint8_t poll();
+
+    /// Returns the result of a send started by startSendto(). Once a result other than RH_MESH_SEND_PENDING
+    /// has been returned, the handle is freed for reuse, and RH_MESH_SEND_FREE is returned after that.
+    /// If there is no send callback, you must collect the result of every send like this, 
+    /// or startSendto() will run out of handles.
+    /// \param[in] handle The handle returned by startSendto()
+    /// \return RH_MESH_SEND_PENDING if the send has not finished yet, else one of the RH_ROUTER_ERROR_* 
+    /// codes, as returned by sendtoWait()
+    uint8_t sendtoResult(uint8_t handle);
+
+    /// Sets a function to be called when each send started by startSendto() finishes. 
+    /// The handle is freed for reuse when the callback returns, and sendtoResult() is not needed.
+    /// \param[in] callback The function to call, or NULL for none
+    void setSendtoCallback(SendtoCallback callback);
+
 protected:
 
     /// Internal function that inspects messages being received and adjusts the routing table if necessary.
@@ -204,12 +329,16 @@ protected:
     /// Internal function that inspects messages being received and adjusts the routing table if necessary.
     /// This is virtual, which lets subclasses override or intercept the route() function.
     /// Called by sendtoWait after the message header has been filled in.
-    /// \param [in] message Pointer to the RHRouter message to be sent.
-    /// \param [in] messageLen Length of message in octets
-    virtual uint8_t route(RoutedMessage* message, uint8_t messageLen);
+    /// \param [in] header Pointer to the RHRouter header of the message to be sent.
+    /// \param [in] fragments The pieces of the application message that follow the header
+    /// \param [in] count Number of fragments, no more than RH_ROUTER_MAX_FRAGMENTS
+    virtual uint8_t route(RoutedMessageHeader* header, const RHGenericDriver::Fragment* fragments, uint8_t count);
 
-    /// Try to resolve a route for the given address. Blocks while discovering the route
-    /// which may take up to 4000 msec.
+    /// Try to resolve a route for the given address. Blocks while discovering the route,
+    /// which may take up to the timeout set by setArpTimeout() for each try, 
+    /// but goes on handling other nodes' messages meanwhile. If an application message for this node
+    /// arrives while waiting, it is kept for the next recvfromAck() and the wait ends early, 
+    /// leaving the discovery to carry on in the background.
     /// Virtual so subclasses can override.
     /// \param [in] address The physical addres to resolve
     /// \return true if the address was resolved and added to the local routing table
@@ -228,8 +357,126 @@ protected:
     virtual bool isPhysicalAddress(uint8_t* address, uint8_t addresslen);
 
 private:
-    /// Temporary mesage buffer
-    static uint8_t _tmpMessage[RH_ROUTER_MAX_MESSAGE_LEN];
+    /// Starts discovering a route to the address, unless a discovery is already in progress
+    /// \return false if RH_MESH_MAX_DISCOVERIES other discoveries are already in progress
+    bool startArp(uint8_t address);
+
+    /// Returns true if a route discovery for the address is in progress
+    bool isArping(uint8_t address);
+
+    /// Broadcasts a route discovery request for the address
+    bool sendArpRequest(uint8_t address);
+
+    /// Finishes route discoveries that have found a route, and repeats or gives up on 
+    /// those that have timed out
+    void pollArps();
+
+    /// Returns how long a blocking function can sleep waiting for a message before a pending
+    /// rebroadcast or route discovery timeout needs attention
+    /// \param[in] limit The most it is prepared to sleep in milliseconds
+    /// \return Milliseconds to sleep, no more than limit
+    uint16_t waitLimit(uint16_t limit);
+
+    /// Finishes a send started by startSendto(), and calls the callback if there is one
+    void finishSendto(uint8_t index, uint8_t error);
+
+    /// Returns true if the route discovery request has been seen recently, and remembers it if not
+    bool seenRequest(uint8_t source, uint8_t id);
+
+    /// Receives the next application message for this node, handling any route discovery requests
+    /// that come first. The payload is left where recvfromAckInto() put it, in the driver or in _spare, 
+    /// so call recvRelease() when finished with it.
+    /// \param[out] buf Set to point at the application message payload
+    /// \param[out] len Set to the length of the payload
+    /// \param[in] source If not NULL, the referenced uint8_t will be set to the SOURCE address
+    /// \param[in] dest If not NULL, the referenced uint8_t will be set to the DEST address
+    /// \param[in] id If not NULL, the referenced uint8_t will be set to the ID
+    /// \param[in] flags If not NULL, the referenced uint8_t will be set to the FLAGS
+    /// \return true if an application message was received
+    bool recvfromAckApplication(uint8_t** buf, uint8_t* len, uint8_t* source, uint8_t* dest, uint8_t* id, uint8_t* flags);
+
+    /// Broadcasts the route discovery request waiting in _rebroadcast, if there is one.
+    /// \param[in] force Broadcast it even if its delay has not expired yet
+    void flushRebroadcast(bool force);
+
+    /// Time to wait for the first reply to a route discovery request
+    uint16_t       _arpTimeout;
+
+    /// Number of times to repeat a route discovery request
+    uint8_t        _arpRetries;
+
+    /// Route discoveries in progress
+    struct
+    {
+	uint8_t       address;  // Who we are looking for
+	uint8_t       tries;    // Requests sent so far. 0 if this entry is free
+	unsigned long timeout;  // Time to wait for a reply to the last request
+	unsigned long sentAt;   // millis() when the last request was sent
+    }              _arps[RH_MESH_MAX_DISCOVERIES];
+
+    /// Sends started by startSendto(), indexed by handle - 1
+    struct
+    {
+	uint8_t*      buf;      // The message to send
+	uint8_t       len;
+	uint8_t       address;
+	uint8_t       flags;
+	bool          arped;    // A route discovery has been started for it
+	uint8_t       result;   // RH_MESH_SEND_FREE, RH_MESH_SEND_PENDING or an RH_ROUTER_ERROR_* code
+	uint8_t       handle;   // RHReliableDatagram handle of the send to the next hop, 0 until it starts
+	struct
+	{
+	    RoutedMessageHeader routed;
+	    MeshMessageHeader   mesh;
+	}             headers;  // Sent in front of buf
+	RHGenericDriver::Fragment fragments[2]; // The headers, then buf
+    }              _sendtos[RH_MESH_MAX_PENDING];
+
+    /// Called when a send started by startSendto() finishes
+    SendtoCallback _sendtoCallback;
+
+    /// Recently seen route discovery requests. source is RH_BROADCAST_ADDRESS if the entry is unused
+    struct
+    {
+	uint8_t       source;
+	uint8_t       id;
+	unsigned long seenAt;   // millis() when it was first seen
+    }              _seen[RH_MESH_SEEN_CACHE_SIZE];
+
+    /// The next entry in _seen to reuse
+    uint8_t        _seenNext;
+
+    /// Maximum random delay before a rebroadcast
+    uint16_t       _rebroadcastJitter;
+
+    /// A route discovery request waiting for its random delay to expire before it is broadcast again.
+    /// Only as big as a request that has been through RH_DEFAULT_MAX_HOPS nodes: longer ones are sent at once
+    uint8_t        _rebroadcast[sizeof(MeshMessageHeader) + 2 + RH_DEFAULT_MAX_HOPS];
+
+    /// Length of the message in _rebroadcast. 0 if there is none
+    uint8_t        _rebroadcastLen;
+
+    /// Header to send the message in _rebroadcast with, keeping the originator's SOURCE and ID
+    RoutedMessageHeader _rebroadcastHeader;
+
+    /// millis() when the message in _rebroadcast is to be sent
+    unsigned long  _rebroadcastAt;
+
+    /// Number of other copies of the message in _rebroadcast heard while it waits
+    uint8_t        _rebroadcastCopies;
+
+    /// Length of an application message received by doArp() and kept for the next recvfromAck().
+    /// It is kept in _spare, which nothing else receives into until recvfromAck() has returned it
+    uint8_t        _heldLen;
+
+    /// SOURCE, DEST, ID and FLAGS of the kept message
+    uint8_t        _heldSource;
+    uint8_t        _heldDest;
+    uint8_t        _heldId;
+    uint8_t        _heldFlags;
+
+    /// True if there is a kept message in _spare
+    bool           _heldValid;
 
 };
 
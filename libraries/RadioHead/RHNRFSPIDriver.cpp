@@ -89,5 +89,26 @@ uint8_t RHNRFSPIDriver::spiBurstWrite(uint8_t reg, const uint8_t* src, uint8_t l
     return status;
 }
 
+uint8_t RHNRFSPIDriver::spiBurstWriteFragments(uint8_t reg, const uint8_t* header, uint8_t headerLen, 
+					       const Fragment* fragments, uint8_t count)
+{
+    uint8_t status = 0;
+    ATOMIC_BLOCK_START;
+    digitalWrite(_slaveSelectPin, LOW);
+    status = _spi.transfer(reg); // Send the start address
+    while (headerLen--)
+	_spi.transfer(*header++);
+    for (uint8_t i = 0; i < count; i++)
+    {
+	const uint8_t* src = fragments[i].data;
+	uint8_t len = fragments[i].len;
+	while (len--)
+	    _spi.transfer(*src++);
+    }
+    digitalWrite(_slaveSelectPin, HIGH);
+    ATOMIC_BLOCK_END;
+    return status;
+}
+
 
 
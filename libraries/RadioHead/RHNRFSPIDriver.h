@@ -78,6 +78,17 @@ public:
     ///  it may or may not be meaningfule depending on the the type of device being accessed.
     uint8_t           spiBurstWrite(uint8_t reg, const uint8_t* src, uint8_t len);
 
+    /// Like spiBurstWrite(), but the data comes from a header followed by several fragments, 
+    /// all written in one burst
+    /// \param[in] reg Register number of the first register, or the command
+    /// \param[in] header The first octets to write
+    /// \param[in] headerLen Number of octets in header
+    /// \param[in] fragments The rest of the octets to write
+    /// \param[in] count Number of fragments
+    /// \return Some devices return a status byte during the first data transfer. This byte is returned.
+    uint8_t           spiBurstWriteFragments(uint8_t reg, const uint8_t* header, uint8_t headerLen, 
+					     const Fragment* fragments, uint8_t count);
+
 protected:
     /// Reference to the RHGenericSPI instance to use to trasnfer data with teh SPI device
     RHGenericSPI&       _spi;
@@ -13,19 +13,56 @@
 
 #include <RHReliableDatagram.h>
 
+// The ID of a received ACK. Only the bottom 8 bits are sent, unless RH_RELIABLE_DATAGRAM_16BIT_IDS is defined
+static uint16_t receivedAckId(uint8_t id, uint8_t high)
+{
+#ifdef RH_RELIABLE_DATAGRAM_16BIT_IDS
+    return ((uint16_t)high << 8) | id;
+#else
+    (void)high;
+    return id;
+#endif
+}
+
+// Whether the ID of an ACK matches the ID a message was sent with
+static bool sameId(uint16_t a, uint16_t b)
+{
+#ifdef RH_RELIABLE_DATAGRAM_16BIT_IDS
+    return a == b;
+#else
+    return (uint8_t)a == (uint8_t)b;
+#endif
+}
+
 ////////////////////////////////////////////////////////////////////
 // Constructors
 RHReliableDatagram::RHReliableDatagram(RHGenericDriver& driver, uint8_t thisAddress) 
     : RHDatagram(driver, thisAddress)
 {
     _retransmissions = 0;
-    _lastSequenceNumber = 0;
     _timeout = 200;
     _retries = 3;
+    _window = 4;
+    _adaptiveTimeout = false;
+    memset(_rtt, 0, sizeof(_rtt));
+    memset(_pending, 0, sizeof(_pending));
+    _sendCallback = NULL;
+    _peerClock = 0;
+    _nextStart = 0;
+    memset(_txIds, 0, sizeof(_txIds));
+    memset(_rxIds, 0, sizeof(_rxIds));
 }
 
 ////////////////////////////////////////////////////////////////////
 // Public methods
+bool RHReliableDatagram::init()
+{
+    // Nodes that restart do not all start their sequences in the same place
+    _nextStart = random(0, 0x100);
+    return RHDatagram::init();
+}
+
+////////////////////////////////////////////////////////////////////
 void RHReliableDatagram::setTimeout(uint16_t timeout)
 {
     _timeout = timeout;
@@ -37,18 +74,39 @@ void RHReliableDatagram::setRetries(uint8_t retries)
     _retries = retries;
 }
 
+////////////////////////////////////////////////////////////////////
+void RHReliableDatagram::setAdaptiveTimeout(bool enable)
+{
+    _adaptiveTimeout = enable;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHReliableDatagram::setWindow(uint8_t window)
+{
+    if (window < 1)
+	window = 1;
+    if (window > RH_RELIABLE_DATAGRAM_MAX_WINDOW)
+	window = RH_RELIABLE_DATAGRAM_MAX_WINDOW;
+    _window = window;
+}
+
 ////////////////////////////////////////////////////////////////////
 bool RHReliableDatagram::sendtoWait(uint8_t* buf, uint8_t len, uint8_t address)
+{
+    RHGenericDriver::Fragment fragment = { buf, len };
+    return sendtoWaitFragments(&fragment, 1, address);
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHReliableDatagram::sendtoWaitFragments(const RHGenericDriver::Fragment* fragments, uint8_t count, uint8_t address)
 {
     // Assemble the message
-    uint8_t thisSequenceNumber = ++_lastSequenceNumber;
+    uint16_t thisSequenceNumber = nextId(address);
     uint8_t retries = 0;
     while (retries++ <= _retries)
     {
-	setHeaderId(thisSequenceNumber);
-	setHeaderFlags(RH_FLAGS_NONE, RH_FLAGS_ACK); // Clear the ACK flag
-	sendto(buf, len, address);
-	waitPacketSent();
+	sendtoId(fragments, count, address, thisSequenceNumber);
+	bool sent = waitPacketSent();
 
 	// Never wait for ACKS to broadcasts:
 	if (address == RH_BROADCAST_ADDRESS)
@@ -56,39 +114,57 @@ bool RHReliableDatagram::sendtoWait(uint8_t* buf, uint8_t len, uint8_t address)
 
 	if (retries > 1)
 	    _retransmissions++;
+	if (_driver.hasHardwareAck())
+	{
+	    // The radio has already waited for the ACK
+	    if (sent)
+		return true;
+	    continue;
+	}
 	unsigned long thisSendTime = millis(); // Timeout does not include original transmit time
 
-	// Compute a new timeout, random between _timeout and _timeout*2
+	// Compute a new timeout, random between timeout and timeout*2
 	// This is to prevent collisions on every retransmit
 	// if 2 nodes try to transmit at the same time
-	uint16_t timeout = _timeout + (_timeout * random(0, 256) / 256);
-        while ((millis() - thisSendTime) < timeout)
+	uint16_t timeout = ackTimeout(address, retries);
+	unsigned long elapsed;
+        while ((elapsed = millis() - thisSendTime) < timeout)
 	{
-	    if (available())
+	    // Sleep until something arrives, if the driver can
+	    if (waitAvailableTimeout(timeout - elapsed))
 	    {
 		uint8_t from, to, id, flags;
-		if (recvfrom(0, 0, &from, &to, &id, &flags)) // Discards the message
+		uint8_t high = 0;
+		uint8_t highLen = sizeof(high);
+		if (recvfrom(&high, &highLen, &from, &to, &id, &flags)) // Discards the rest of the message
 		{
 		    // Now have a message: is it our ACK?
 		    if (   from == address 
 			   && to == _thisAddress 
 			   && (flags & RH_FLAGS_ACK) 
-			   && (id == thisSequenceNumber))
+			   && sameId(receivedAckId(id, high), thisSequenceNumber))
 		    {
-			// Its the ACK we are waiting for
+			// Its the ACK we are waiting for. 
+			// If this was a retry, we cant tell which transmission it is for, so dont measure it
+			if (retries == 1)
+			    updateRoundTripTime(address, millis() - thisSendTime);
 			return true;
 		    }
 		    else if (   !(flags & RH_FLAGS_ACK)
-				&& (id == _seenIds[from]))
+				&& isDuplicate(from, to, receivedId(from, to, id, high, flags)))
 		    {
 			// This is a request we have already received. ACK it again
-			acknowledge(id, from);
+			acknowledge(receivedId(from, to, id, high, flags), from);
+		    }
+		    else if (flags & RH_FLAGS_ACK)
+		    {
+			// Maybe for one of our non-blocking sends
+			ackReceived(from, receivedAckId(id, high));
 		    }
 		    // Else discard it
 		}
 	    }
 	    // Not the one we are waiting for, maybe keep waiting until timeout exhausted
-	    YIELD;
 	}
 	// Timeout exhausted, maybe retry
 	YIELD;
@@ -96,6 +172,284 @@ bool RHReliableDatagram::sendtoWait(uint8_t* buf, uint8_t len, uint8_t address)
     return false;
 }
 
+////////////////////////////////////////////////////////////////////
+uint8_t RHReliableDatagram::sendtoWaitMany(uint8_t** bufs, const uint8_t* lens, uint8_t count, uint8_t address)
+{
+    // Never wait for ACKS to broadcasts:
+    if (address == RH_BROADCAST_ADDRESS)
+    {
+	for (uint8_t i = 0; i < count; i++)
+	{
+	    // send() waits for the previous one, or queues it behind if the driver can
+	    RHGenericDriver::Fragment fragment = { bufs[i], lens[i] };
+	    sendtoId(&fragment, 1, address, nextId(address));
+	}
+	waitPacketSent();
+	return count;
+    }
+
+    // The radio waits for each ACK, so they can only be sent one at a time
+    if (_driver.hasHardwareAck())
+    {
+	uint8_t acked = 0;
+	for (uint8_t i = 0; i < count; i++)
+	    if (sendtoWait(bufs[i], lens[i], address))
+		acked++;
+	return acked;
+    }
+
+    // The messages in flight
+    struct
+    {
+	uint8_t       index;    // Index into bufs
+	uint16_t      id;       // Sequence number it was sent with
+	uint8_t       tries;    // Times sent so far, 0 if the slot is free
+	uint16_t      timeout;  // Randomised retransmit timeout for this try
+	unsigned long sentAt;   // millis() when last sent
+    } slots[RH_RELIABLE_DATAGRAM_MAX_WINDOW];
+    uint8_t i;
+    for (i = 0; i < _window; i++)
+	slots[i].tries = 0;
+
+    uint8_t next = 0;     // Next message to send for the first time
+    uint8_t inFlight = 0;
+    uint8_t acked = 0;
+    while (next < count || inFlight)
+    {
+	// Send one new message to fill the window, or retransmit one that has timed out.
+	// Only one at a time, so ACKs are collected between transmissions
+	bool sent = false;
+	for (i = 0; i < _window; i++)
+	{
+	    if (!slots[i].tries)
+	    {
+		if (next >= count)
+		    continue;
+		slots[i].index = next++;
+		slots[i].id = nextId(address);
+		inFlight++;
+	    }
+	    else if ((millis() - slots[i].sentAt) < slots[i].timeout)
+		continue; // Still waiting for the ACK
+	    else if (slots[i].tries > _retries)
+	    {
+		// Retries exhausted, give up on this one
+		slots[i].tries = 0;
+		inFlight--;
+		continue;
+	    }
+	    else
+		_retransmissions++;
+
+	    RHGenericDriver::Fragment fragment = { bufs[slots[i].index], lens[slots[i].index] };
+	    sendtoId(&fragment, 1, address, slots[i].id);
+	    waitPacketSent();
+	    slots[i].tries++;
+	    // Timeout does not include transmit time. Randomised as for sendtoWait()
+	    slots[i].sentAt = millis();
+	    slots[i].timeout = ackTimeout(address, slots[i].tries);
+	    sent = true;
+	    break;
+	}
+
+	if (!sent && inFlight)
+	{
+	    // Nothing to send until an ACK arrives or the first retransmit timeout expires.
+	    // Sleep until then, if the driver can
+	    unsigned long now = millis();
+	    uint16_t wait = 0xffff;
+	    for (i = 0; i < _window; i++)
+	    {
+		if (!slots[i].tries)
+		    continue;
+		unsigned long waited = now - slots[i].sentAt;
+		uint16_t left = waited < slots[i].timeout ? slots[i].timeout - waited : 0;
+		if (left < wait)
+		    wait = left;
+	    }
+	    if (wait)
+		waitAvailableTimeout(wait);
+	}
+
+	// Collect any ACKs
+	if (available())
+	{
+	    uint8_t from, to, id, flags;
+	    uint8_t high = 0;
+	    uint8_t highLen = sizeof(high);
+	    if (recvfrom(&high, &highLen, &from, &to, &id, &flags)) // Discards the rest of the message
+	    {
+		if (   from == address 
+		    && to == _thisAddress 
+		    && (flags & RH_FLAGS_ACK))
+		{
+		    // Selective ACK: it frees only the slot for that id
+		    for (i = 0; i < _window; i++)
+		    {
+			if (slots[i].tries && sameId(slots[i].id, receivedAckId(id, high)))
+			{
+			    if (slots[i].tries == 1)
+				updateRoundTripTime(address, millis() - slots[i].sentAt);
+			    slots[i].tries = 0;
+			    inFlight--;
+			    acked++;
+			    break;
+			}
+		    }
+		}
+		else if (   !(flags & RH_FLAGS_ACK)
+			 && isDuplicate(from, to, receivedId(from, to, id, high, flags)))
+		{
+		    // This is a request we have already received. ACK it again
+		    acknowledge(receivedId(from, to, id, high, flags), from);
+		}
+		else if (flags & RH_FLAGS_ACK)
+		{
+		    // Maybe for one of our non-blocking sends
+		    ackReceived(from, receivedAckId(id, high));
+		}
+		// Else discard it
+	    }
+	}
+    }
+    return acked;
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHReliableDatagram::startSend(uint8_t* buf, uint8_t len, uint8_t address)
+{
+    RHGenericDriver::Fragment fragment = { buf, len };
+    uint8_t handle = startSendFragments(&fragment, 1, address);
+    if (handle)
+    {
+	// The message is its only fragment, kept with the send
+	_pending[handle - 1].fragment = fragment;
+	_pending[handle - 1].fragments = &_pending[handle - 1].fragment;
+    }
+    return handle;
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHReliableDatagram::startSendFragments(const RHGenericDriver::Fragment* fragments, uint8_t count, uint8_t address)
+{
+    // Refuse now what sendtoId() would refuse on every try
+#ifdef RH_RELIABLE_DATAGRAM_16BIT_IDS
+    if (count > RH_RELIABLE_DATAGRAM_MAX_FRAGMENTS)
+	return 0;
+#endif
+    if (RHGenericDriver::fragmentsLen(fragments, count) + RH_RELIABLE_DATAGRAM_ID_OVERHEAD > _driver.maxMessageLength())
+	return 0;
+    for (uint8_t i = 0; i < RH_RELIABLE_DATAGRAM_MAX_PENDING; i++)
+    {
+	if (_pending[i].status == SendFree)
+	{
+	    _pending[i].fragments = fragments;
+	    _pending[i].count = count;
+	    _pending[i].address = address;
+	    _pending[i].id = nextId(address);
+	    _pending[i].tries = 0;
+	    _pending[i].status = SendPending;
+	    return i + 1;
+	}
+    }
+    return 0; // All in use
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHReliableDatagram::poll()
+{
+    // Collect ACKs. Anything else is left for recvfromAck()
+    while (available() && (headerFlags() & RH_FLAGS_ACK))
+    {
+	uint8_t from, to, id;
+	uint8_t high = 0;
+	uint8_t highLen = sizeof(high);
+	if (recvfrom(&high, &highLen, &from, &to, &id) && to == _thisAddress)
+	    ackReceived(from, receivedAckId(id, high));
+    }
+
+    // Send one message that is new or has timed out.
+    // Only one at a time, so ACKs are collected between transmissions
+    bool sent = false;
+    uint8_t pending = 0;
+    for (uint8_t i = 0; i < RH_RELIABLE_DATAGRAM_MAX_PENDING; i++)
+    {
+	if (_pending[i].status != SendPending)
+	    continue;
+	if (_pending[i].tries && (millis() - _pending[i].sentAt) < _pending[i].timeout)
+	{
+	    pending++; // Still waiting for the ACK
+	    continue;
+	}
+	if (_pending[i].tries > _retries)
+	{
+	    // Retries exhausted
+	    finishSend(i, SendFailed);
+	    continue;
+	}
+	if (sent)
+	{
+	    pending++; // Next time
+	    continue;
+	}
+
+	if (!sendtoId(_pending[i].fragments, _pending[i].count, _pending[i].address, _pending[i].id))
+	{
+	    // The driver would not take it
+	    finishSend(i, SendFailed);
+	    continue;
+	}
+	if (_pending[i].tries)
+	    _retransmissions++;
+	bool acked = waitPacketSent();
+	sent = true;
+	_pending[i].tries++;
+	// Never wait for ACKS to broadcasts
+	if (_pending[i].address == RH_BROADCAST_ADDRESS || (_driver.hasHardwareAck() && acked))
+	{
+	    finishSend(i, SendAcked);
+	    continue;
+	}
+	if (_driver.hasHardwareAck())
+	{
+	    // Not acknowledged by the radio. Try again next time, if there are retries left
+	    _pending[i].timeout = 0;
+	    pending++;
+	    continue;
+	}
+	// Timeout does not include transmit time. Randomised as for sendtoWait()
+	_pending[i].sentAt = millis();
+	_pending[i].timeout = ackTimeout(_pending[i].address, _pending[i].tries);
+	pending++;
+    }
+    return pending;
+}
+
+////////////////////////////////////////////////////////////////////
+RHReliableDatagram::SendStatus RHReliableDatagram::sendStatus(uint8_t handle)
+{
+    if (handle < 1 || handle > RH_RELIABLE_DATAGRAM_MAX_PENDING)
+	return SendFree;
+    SendStatus status = _pending[handle - 1].status;
+    if (status != SendPending)
+	_pending[handle - 1].status = SendFree; // Collected, so free it
+    return status;
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHReliableDatagram::sendTries(uint8_t handle)
+{
+    if (handle < 1 || handle > RH_RELIABLE_DATAGRAM_MAX_PENDING)
+	return 0;
+    return _pending[handle - 1].tries;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHReliableDatagram::setSendCallback(SendCallback callback)
+{
+    _sendCallback = callback;
+}
+
 ////////////////////////////////////////////////////////////////////
 bool RHReliableDatagram::recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* from, uint8_t* to, uint8_t* id, uint8_t* flags)
 {  
@@ -104,43 +458,95 @@ bool RHReliableDatagram::recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* from,
     uint8_t _id;
     uint8_t _flags;
     // Get the message before its clobbered by the ACK (shared rx and tx buffer in RH
-    if (available() && recvfrom(buf, len, &_from, &_to, &_id, &_flags))
+    if (!available() || !recvfrom(buf, len, &_from, &_to, &_id, &_flags))
+	return false;
+    uint8_t high = *len ? buf[0] : 0;
+#ifdef RH_RELIABLE_DATAGRAM_16BIT_IDS
+    // The top of the ID comes first
+    if (*len < 1)
+	return false;
+    memmove(buf, buf + 1, --(*len));
+#endif
+    if (acceptReceived(_from, _to, _id, _flags, high))
     {
-	// Never ACK an ACK
-	if (!(_flags & RH_FLAGS_ACK))
+	if (from)  *from =  _from;
+	if (to)    *to =    _to;
+	if (id)    *id =    _id;
+	if (flags) *flags = _flags & ~(RH_FLAGS_RESTART | RH_FLAGS_RESTART_OFFSET);
+	return true;
+    }
+    // No message for us available
+    return false;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHReliableDatagram::recvfromAckBorrow(uint8_t** buf, uint8_t* len, uint8_t* from, uint8_t* to, uint8_t* id, uint8_t* flags)
+{  
+    uint8_t _from;
+    uint8_t _to;
+    uint8_t _id;
+    uint8_t _flags;
+    // The driver does not reuse the borrowed message for anything it sends, so it can be ACKed in place
+    if (recvfromBorrow(buf, len, &_from, &_to, &_id, &_flags))
+    {
+	uint8_t high = *len ? (*buf)[0] : 0;
+#ifdef RH_RELIABLE_DATAGRAM_16BIT_IDS
+	// The top of the ID comes first
+	if (*len >= 1)
 	{
-	    // Its a normal message for this node, not an ACK
-	    if (_to != RH_BROADCAST_ADDRESS)
-	    {
-		// Its not a broadcast, so ACK it
-		// Acknowledge message with ACK set in flags and ID set to received ID
-		acknowledge(_id, _from);
-	    }
-	    // If we have not seen this message before, then we are interested in it
-	    if (_id != _seenIds[_from])
-	    {
-		if (from)  *from =  _from;
-		if (to)    *to =    _to;
-		if (id)    *id =    _id;
-		if (flags) *flags = _flags;
-		_seenIds[_from] = _id;
-		return true;
-	    }
-	    // Else just re-ack it and wait for a new one
+	    (*buf)++;
+	    (*len)--;
+	}
+	else
+	    _flags |= RH_FLAGS_ACK; // Malformed. Treat it like an ACK, which is ignored here
+#endif
+	if (acceptReceived(_from, _to, _id, _flags, high))
+	{
+	    if (from)  *from =  _from;
+	    if (to)    *to =    _to;
+	    if (id)    *id =    _id;
+	    if (flags) *flags = _flags & ~(RH_FLAGS_RESTART | RH_FLAGS_RESTART_OFFSET);
+	    return true;
 	}
+	recvRelease();
     }
-    // No message for us available
     return false;
 }
 
+////////////////////////////////////////////////////////////////////
+bool RHReliableDatagram::acceptReceived(uint8_t from, uint8_t to, uint8_t id, uint8_t flags, uint8_t high)
+{
+    // Never ACK an ACK
+    if (flags & RH_FLAGS_ACK)
+    {
+	// Maybe for one of our non-blocking sends
+	ackReceived(from, receivedAckId(id, high));
+	return false;
+    }
+    // Its a normal message for this node, not an ACK
+    uint16_t fullId = receivedId(from, to, id, high, flags);
+    if (to != RH_BROADCAST_ADDRESS)
+    {
+	// Its not a broadcast, so ACK it
+	// Acknowledge message with ACK set in flags and ID set to received ID
+	acknowledge(fullId, from);
+    }
+    // If we have not seen this message before, then we are interested in it
+    if (isDuplicate(from, to, fullId))
+	return false; // Else just re-ack it and wait for a new one
+    markSeen(from, to, fullId);
+    return true;
+}
+
 bool RHReliableDatagram::recvfromAckTimeout(uint8_t* buf, uint8_t* len, uint16_t timeout, uint8_t* from, uint8_t* to, uint8_t* id, uint8_t* flags)
 {
     unsigned long starttime = millis();
-    while ((millis() - starttime) < timeout)
+    unsigned long elapsed;
+    while ((elapsed = millis() - starttime) < timeout)
     {
-	if (recvfromAck(buf, len, from, to, id, flags))
+	// Sleep until something arrives, if the driver can
+	if (waitAvailableTimeout(timeout - elapsed) && recvfromAck(buf, len, from, to, id, flags))
 	    return true;
-	YIELD;
     }
     return false;
 }
@@ -155,16 +561,319 @@ void RHReliableDatagram::resetRetransmissions()
     _retransmissions = 0;
 }
  
-void RHReliableDatagram::acknowledge(uint8_t id, uint8_t from)
+uint8_t RHReliableDatagram::findReceived(uint8_t from, uint8_t to)
+{
+    bool broadcast = (to == RH_BROADCAST_ADDRESS);
+    for (uint8_t i = 0; i < RH_RELIABLE_DATAGRAM_PEERS; i++)
+	if (_rxIds[i].valid && _rxIds[i].address == from && _rxIds[i].broadcast == broadcast)
+	    return i;
+    return RH_RELIABLE_DATAGRAM_PEERS;
+}
+
+uint16_t RHReliableDatagram::receivedId(uint8_t from, uint8_t to, uint8_t id, uint8_t high, uint8_t flags)
+{
+    uint8_t i = findReceived(from, to);
+    uint8_t offset = (flags & RH_FLAGS_RESTART_OFFSET) >> RH_FLAGS_RESTART_SHIFT;
+#ifdef RH_RELIABLE_DATAGRAM_16BIT_IDS
+    uint16_t fullId = ((uint16_t)high << 8) | id;
+    bool sameStart =    (flags & RH_FLAGS_RESTART)
+	             && i < RH_RELIABLE_DATAGRAM_PEERS
+	             && _rxIds[i].restarting 
+	             && _rxIds[i].restartId == (uint16_t)(fullId - offset);
+#else
+    (void)high;
+    bool sameStart =    (flags & RH_FLAGS_RESTART)
+	             && i < RH_RELIABLE_DATAGRAM_PEERS
+	             && _rxIds[i].restarting 
+	             && (uint8_t)_rxIds[i].restartId == (uint8_t)(id - offset);
+    // Extend it to 16 bits, as close as possible to the highest seen from that sender,
+    // or from the start of the sequence
+    uint16_t fullId = id;
+    if (sameStart)
+	fullId = _rxIds[i].restartId + offset;
+    else if (i < RH_RELIABLE_DATAGRAM_PEERS)
+	fullId = _rxIds[i].highest + (int8_t)(id - (uint8_t)_rxIds[i].highest);
+#endif
+    if (!(flags & RH_FLAGS_RESTART))
+    {
+	if (i < RH_RELIABLE_DATAGRAM_PEERS)
+	    _rxIds[i].restarting = false; // Past the start of the sequence
+    }
+    else if (!sameStart)
+    {
+	// The sender has started a new sequence. Forget the IDs of the old one
+	i = resetReceived(from, to, fullId);
+	_rxIds[i].restarting = true;
+	_rxIds[i].restartId = fullId - offset;
+    }
+    return fullId;
+}
+
+bool RHReliableDatagram::isDuplicate(uint8_t from, uint8_t to, uint16_t id)
+{
+    uint8_t i = findReceived(from, to);
+    if (i >= RH_RELIABLE_DATAGRAM_PEERS)
+	return false; // Never heard of them
+    _rxIds[i].lastUse = ++_peerClock;
+    int16_t behind = _rxIds[i].highest - id;
+    if (behind < 0)
+	return false; // New
+    if (behind >= RH_RELIABLE_DATAGRAM_SEEN_WINDOW)
+	return true; // Stale. A sender that restarts says so with RH_FLAGS_RESTART
+    return _rxIds[i].seen & (1U << behind);
+}
+
+uint8_t RHReliableDatagram::resetReceived(uint8_t from, uint8_t to, uint16_t id)
+{
+    uint8_t i = findReceived(from, to);
+    if (i >= RH_RELIABLE_DATAGRAM_PEERS)
+    {
+	// New sender. Take over a free entry, or the least recently used
+	i = 0;
+	for (uint8_t j = 0; j < RH_RELIABLE_DATAGRAM_PEERS; j++)
+	{
+	    if (!_rxIds[j].valid)
+	    {
+		i = j;
+		break;
+	    }
+	    if (_peerClock - _rxIds[j].lastUse > _peerClock - _rxIds[i].lastUse)
+		i = j;
+	}
+	_rxIds[i].address = from;
+	_rxIds[i].valid = true;
+	_rxIds[i].broadcast = (to == RH_BROADCAST_ADDRESS);
+    }
+    _rxIds[i].restarting = false;
+    _rxIds[i].highest = id;
+    _rxIds[i].seen = 0;
+    _rxIds[i].lastUse = ++_peerClock;
+    return i;
+}
+
+void RHReliableDatagram::markSeen(uint8_t from, uint8_t to, uint16_t id)
 {
+    uint8_t i = findReceived(from, to);
+    if (i >= RH_RELIABLE_DATAGRAM_PEERS)
+	i = resetReceived(from, to, id); // New sender
+    _rxIds[i].lastUse = ++_peerClock;
+    int16_t ahead = id - _rxIds[i].highest;
+    if (ahead > 0)
+    {
+	// Slide the window up
+	_rxIds[i].seen = (ahead < RH_RELIABLE_DATAGRAM_SEEN_WINDOW) ? (_rxIds[i].seen << ahead) : 0;
+	_rxIds[i].highest = id;
+	ahead = 0;
+    }
+    else if (-ahead >= RH_RELIABLE_DATAGRAM_SEEN_WINDOW)
+	return; // Stale, and isDuplicate() would have said so
+    _rxIds[i].seen |= (1U << -ahead);
+}
+
+uint16_t RHReliableDatagram::nextId(uint8_t address)
+{
+    uint8_t i;
+    for (i = 0; i < RH_RELIABLE_DATAGRAM_PEERS; i++)
+	if (_txIds[i].valid && _txIds[i].address == address)
+	    break;
+    if (i >= RH_RELIABLE_DATAGRAM_PEERS)
+    {
+	// New destination. Take over a free entry, or the least recently used
+	i = 0;
+	for (uint8_t j = 0; j < RH_RELIABLE_DATAGRAM_PEERS; j++)
+	{
+	    if (!_txIds[j].valid)
+	    {
+		i = j;
+		break;
+	    }
+	    if (_peerClock - _txIds[j].lastUse > _peerClock - _txIds[i].lastUse)
+		i = j;
+	}
+	// Start a new sequence, somewhere other than where the last few started. The first messages
+	// are sent with RH_FLAGS_RESTART, so a receiver that remembers our IDs from before does not
+	// mistake the new ones for duplicates
+	_txIds[i].address = address;
+	_txIds[i].valid = true;
+	_txIds[i].start = ((uint16_t)random(0, 0x100) << 8) | _nextStart++;
+	_txIds[i].id = _txIds[i].start - 1;
+    }
+    _txIds[i].lastUse = ++_peerClock;
+    return ++_txIds[i].id;
+}
+
+uint8_t RHReliableDatagram::restartFlags(uint8_t address, uint16_t id)
+{
+    for (uint8_t i = 0; i < RH_RELIABLE_DATAGRAM_PEERS; i++)
+    {
+	if (_txIds[i].valid && _txIds[i].address == address)
+	{
+	    uint16_t offset = id - _txIds[i].start;
+	    if (offset < RH_RELIABLE_DATAGRAM_RESTART_IDS)
+		return RH_FLAGS_RESTART | (offset << RH_FLAGS_RESTART_SHIFT);
+	    break;
+	}
+    }
+    return RH_FLAGS_NONE;
+}
+
+bool RHReliableDatagram::sendtoId(const RHGenericDriver::Fragment* fragments, uint8_t count, uint8_t address, uint16_t id)
+{
+    setHeaderId(id);
+    // Clear the ACK flag, and set the restart flag only at the start of a new sequence
+    setHeaderFlags(restartFlags(address, id), RH_FLAGS_ACK | RH_FLAGS_RESTART | RH_FLAGS_RESTART_OFFSET);
+#ifdef RH_RELIABLE_DATAGRAM_16BIT_IDS
+    // The top of the ID goes in front of the message
+    uint8_t high = id >> 8;
+    RHGenericDriver::Fragment message[RH_RELIABLE_DATAGRAM_MAX_FRAGMENTS + 1];
+    if (count > RH_RELIABLE_DATAGRAM_MAX_FRAGMENTS)
+	return false;
+    message[0].data = &high;
+    message[0].len = sizeof(high);
+    memcpy(message + 1, fragments, count * sizeof(RHGenericDriver::Fragment));
+    return sendtoFragments(message, count + 1, address);
+#else
+    return sendtoFragments(fragments, count, address);
+#endif
+}
+
+bool RHReliableDatagram::roundTripTime(uint8_t address, uint16_t* srtt, uint16_t* rttvar)
+{
+    for (uint8_t i = 0; i < RH_RELIABLE_DATAGRAM_RTT_PEERS; i++)
+    {
+	if (_rtt[i].srtt8 && _rtt[i].address == address)
+	{
+	    if (srtt)   *srtt = _rtt[i].srtt8 >> 3;
+	    if (rttvar) *rttvar = _rtt[i].rttvar4 >> 2;
+	    return true;
+	}
+    }
+    return false;
+}
+
+uint16_t RHReliableDatagram::retransmitTimeout(uint8_t address)
+{
+    if (!_adaptiveTimeout)
+	return _timeout;
+    for (uint8_t i = 0; i < RH_RELIABLE_DATAGRAM_RTT_PEERS; i++)
+    {
+	if (_rtt[i].srtt8 && _rtt[i].address == address)
+	{
+	    // RTO = SRTT + 4 * RTTVAR
+	    uint32_t rto = (_rtt[i].srtt8 >> 3) + _rtt[i].rttvar4;
+	    if (rto < RH_RELIABLE_DATAGRAM_MIN_TIMEOUT)
+		rto = RH_RELIABLE_DATAGRAM_MIN_TIMEOUT;
+	    if (rto > RH_RELIABLE_DATAGRAM_MAX_TIMEOUT)
+		rto = RH_RELIABLE_DATAGRAM_MAX_TIMEOUT;
+	    return rto;
+	}
+    }
+    return _timeout; // Not measured yet
+}
+
+void RHReliableDatagram::updateRoundTripTime(uint8_t address, uint16_t rtt)
+{
+    uint8_t i;
+    for (i = 0; i < RH_RELIABLE_DATAGRAM_RTT_PEERS; i++)
+	if (_rtt[i].srtt8 && _rtt[i].address == address)
+	    break;
+    if (rtt == 0)
+	rtt = 1; // Faster than millis() can tell, but srtt8 of 0 means unused
+    if (rtt > 8000)
+	rtt = 8000; // Keep srtt8 in range
+    if (i >= RH_RELIABLE_DATAGRAM_RTT_PEERS)
+    {
+	// First measurement for this peer. Take over a free entry, or the least recently updated
+	i = 0;
+	for (uint8_t j = 0; j < RH_RELIABLE_DATAGRAM_RTT_PEERS; j++)
+	{
+	    if (!_rtt[j].srtt8)
+	    {
+		i = j;
+		break;
+	    }
+	    if (_peerClock - _rtt[j].lastUse > _peerClock - _rtt[i].lastUse)
+		i = j;
+	}
+	_rtt[i].address = address;
+	_rtt[i].lastUse = ++_peerClock;
+	_rtt[i].srtt8 = rtt << 3;
+	_rtt[i].rttvar4 = rtt << 1; // RTTVAR = RTT/2
+	return;
+    }
+    _rtt[i].lastUse = ++_peerClock;
+    // Jacobson/Karels, with gains of 1/8 and 1/4, in scaled integers
+    int16_t delta = rtt - (_rtt[i].srtt8 >> 3);
+    _rtt[i].srtt8 += delta;
+    if (delta < 0)
+	delta = -delta;
+    delta -= (_rtt[i].rttvar4 >> 2);
+    _rtt[i].rttvar4 += delta;
+    if (!_rtt[i].srtt8)
+	_rtt[i].srtt8 = 1;
+}
+
+uint16_t RHReliableDatagram::ackTimeout(uint8_t address, uint8_t tries)
+{
+    uint32_t timeout = retransmitTimeout(address);
+    // Exponential backoff on each retry
+    if (_adaptiveTimeout)
+    {
+	while (--tries && timeout < RH_RELIABLE_DATAGRAM_MAX_TIMEOUT)
+	    timeout <<= 1;
+	if (timeout > RH_RELIABLE_DATAGRAM_MAX_TIMEOUT)
+	    timeout = RH_RELIABLE_DATAGRAM_MAX_TIMEOUT;
+    }
+    // Random between timeout and timeout*2
+    return timeout + (timeout * random(0, 256) / 256);
+}
+
+void RHReliableDatagram::ackReceived(uint8_t from, uint16_t id)
+{
+    for (uint8_t i = 0; i < RH_RELIABLE_DATAGRAM_MAX_PENDING; i++)
+    {
+	if (   _pending[i].status == SendPending
+	    && _pending[i].tries
+	    && _pending[i].address == from
+	    && sameId(_pending[i].id, id))
+	{
+	    // If this was a retry, we cant tell which transmission it is for, so dont measure it
+	    if (_pending[i].tries == 1)
+		updateRoundTripTime(from, millis() - _pending[i].sentAt);
+	    finishSend(i, SendAcked);
+	    return;
+	}
+    }
+}
+
+void RHReliableDatagram::finishSend(uint8_t i, SendStatus status)
+{
+    _pending[i].status = status;
+    if (_sendCallback)
+    {
+	// Free the handle first, so the callback can reuse it
+	_pending[i].status = SendFree;
+	_sendCallback(i + 1, status);
+    }
+}
+
+void RHReliableDatagram::acknowledge(uint16_t id, uint8_t from)
+{
+    if (_driver.hasHardwareAck())
+	return; // The radio has already acknowledged it
+
     setHeaderId(id);
-    setHeaderFlags(RH_FLAGS_ACK);
+    setHeaderFlags(RH_FLAGS_ACK, RH_FLAGS_RESTART | RH_FLAGS_RESTART_OFFSET);
     // We would prefer to send a zero length ACK,
     // but if an RH_RF22 receives a 0 length message with a CRC error, it will never receive
     // a 0 length message again, until its reset, which makes everything hang :-(
     // So we send an ACK of 1 octet
     // REVISIT: should we send the RSSI for the information of the sender?
+#ifdef RH_RELIABLE_DATAGRAM_16BIT_IDS
+    uint8_t ack = id >> 8; // The top of the ID
+#else
     uint8_t ack = '!';
+#endif
     sendto(&ack, sizeof(ack), from); 
     waitPacketSent();
 }
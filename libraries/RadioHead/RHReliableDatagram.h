@@ -14,6 +14,70 @@
 // for application layer use.
 #define RH_FLAGS_ACK 0x80
 
+// The restart bit in the FLAGS. Set on the first RH_RELIABLE_DATAGRAM_RESTART_IDS messages of each
+// new sequence of message IDs, so the receiver forgets the IDs of the previous sequence.
+// The bits under RH_FLAGS_RESTART_OFFSET then give how far the message is from the start of the sequence
+#define RH_FLAGS_RESTART 0x40
+#define RH_FLAGS_RESTART_OFFSET 0x30
+#define RH_FLAGS_RESTART_SHIFT 4
+
+// The largest number of unacknowledged messages sendtoWaitMany() will keep in flight at once
+#ifndef RH_RELIABLE_DATAGRAM_MAX_WINDOW
+ #define RH_RELIABLE_DATAGRAM_MAX_WINDOW 8
+#endif
+
+// The number of peers whose message IDs are tracked, separately for sending and for duplicate detection
+// when receiving. When there are more peers than this, the one used least recently is forgotten.
+// A node that hears from more peers than this in turn, such as a server with many clients, 
+// can deliver a message twice: see "Message IDs" below
+#ifndef RH_RELIABLE_DATAGRAM_PEERS
+ #define RH_RELIABLE_DATAGRAM_PEERS 8
+#endif
+
+// The number of IDs below the highest one received from each peer that are remembered for duplicate detection.
+// The size of the bitmap that records them, so at least RH_RELIABLE_DATAGRAM_MAX_WINDOW
+#define RH_RELIABLE_DATAGRAM_SEEN_WINDOW 16
+
+// The number of messages at the start of each new sequence of IDs that are sent with RH_FLAGS_RESTART.
+// As many as RH_FLAGS_RESTART_OFFSET can count, which covers the default window of sendtoWaitMany()
+#define RH_RELIABLE_DATAGRAM_RESTART_IDS 4
+
+// Define this to use 16 bit message IDs instead of 8 bit ones. The top 8 bits are sent in an extra 
+// octet in front of each message and in each ACK, so all nodes must be built with the same setting,
+// and the longest message is 1 octet shorter
+//#define RH_RELIABLE_DATAGRAM_16BIT_IDS
+
+// The most fragments that can be passed to sendtoWaitFragments() if RH_RELIABLE_DATAGRAM_16BIT_IDS is defined
+#ifndef RH_RELIABLE_DATAGRAM_MAX_FRAGMENTS
+ #define RH_RELIABLE_DATAGRAM_MAX_FRAGMENTS 4
+#endif
+
+// The number of octets of each message used to carry the top of the message ID
+#ifdef RH_RELIABLE_DATAGRAM_16BIT_IDS
+ #define RH_RELIABLE_DATAGRAM_ID_OVERHEAD 1
+#else
+ #define RH_RELIABLE_DATAGRAM_ID_OVERHEAD 0
+#endif
+
+// The maximum number of sends started by startSend() that can be in progress at once
+#ifndef RH_RELIABLE_DATAGRAM_MAX_PENDING
+ #define RH_RELIABLE_DATAGRAM_MAX_PENDING 4
+#endif
+
+// The number of peers whose round trip times are tracked for the adaptive retransmit timeout.
+// When there are more peers than this, the one updated longest ago is forgotten
+#ifndef RH_RELIABLE_DATAGRAM_RTT_PEERS
+ #define RH_RELIABLE_DATAGRAM_RTT_PEERS 8
+#endif
+
+// Limits of the adaptive retransmit timeout in milliseconds, including backoff
+#ifndef RH_RELIABLE_DATAGRAM_MIN_TIMEOUT
+ #define RH_RELIABLE_DATAGRAM_MIN_TIMEOUT 10
+#endif
+#ifndef RH_RELIABLE_DATAGRAM_MAX_TIMEOUT
+ #define RH_RELIABLE_DATAGRAM_MAX_TIMEOUT 4000
+#endif
+
 /////////////////////////////////////////////////////////////////////
 /// \class RHReliableDatagram RHReliableDatagram.h <RHReliableDatagram.h>
 /// \brief RHDatagram subclass for sending addressed, acknowledged, retransmitted datagrams.
@@ -33,7 +97,49 @@
 /// The retransmit timeout is randomly varied between timeout and timeout*2 to prevent collisions on all
 /// retries when 2 nodes happen to start sending at the same time .
 ///
-/// Each new message sent by sendtoWait() has its ID incremented.
+/// \par Adaptive retransmit timeout
+///
+/// The round trip time to each peer (from the end of transmission of a message to receipt of its ACK) 
+/// is measured for every message that is acknowledged without being retransmitted, and the smoothed 
+/// round trip time and its variance are tracked as in TCP (Jacobson/Karels). The measurements are 
+/// available from roundTripTime().
+///
+/// The retransmit timeout can adapt to each peer, if enabled with setAdaptiveTimeout(true). 
+/// It is disabled by default, when the timeout set by setTimeout() is always used, as in earlier versions.
+/// When enabled, the timeout for a peer is the smoothed 
+/// round trip time plus 4 times its variance, between RH_RELIABLE_DATAGRAM_MIN_TIMEOUT and 
+/// RH_RELIABLE_DATAGRAM_MAX_TIMEOUT, so fast links retry promptly and slow ones do not retry too early.
+/// The timeout set by setTimeout() is used for peers that have not been measured yet.
+/// Each retry doubles the timeout (exponential backoff), still randomly varied as above.
+///
+/// Backoff makes sendtoWait() block much longer when a peer does not answer. With the default 
+/// timeout of 200ms and 3 retries it gives up after 3 to 6 seconds, instead of 0.8 to 1.6 seconds 
+/// without adaption. For a slow peer, whose timeout has grown to RH_RELIABLE_DATAGRAM_MAX_TIMEOUT, 
+/// it can block for up to (retries + 1) * 2 * RH_RELIABLE_DATAGRAM_MAX_TIMEOUT milliseconds.
+///
+/// \par Message IDs
+///
+/// Each destination address (including RH_BROADCAST_ADDRESS) has its own sequence of message IDs, 
+/// starting at a random value, and each new message to it has the ID incremented. 
+/// Receivers track the highest ID received from each sender (broadcasts separately), and a bitmap 
+/// of which of the RH_RELIABLE_DATAGRAM_SEEN_WINDOW IDs below it have been received. A message is a duplicate
+/// if its ID is in the window and has been received already. Messages with IDs further below the window 
+/// are too old to tell, and are acknowledged and dropped as if they were duplicates.
+/// A sender that restarts, or has forgotten a destination and so starts a new sequence for it, 
+/// sets RH_FLAGS_RESTART on the first RH_RELIABLE_DATAGRAM_RESTART_IDS messages of the new sequence, 
+/// with their distance from the start of it. When the receiver sees a new start, it forgets the IDs 
+/// it has seen from that sender, which might otherwise be taken for duplicates of the new ones. 
+/// Both sending and receiving state are kept for the 
+/// RH_RELIABLE_DATAGRAM_PEERS most recently used peers, instead of a 256 octet table indexed by address.
+/// A sender that has been forgotten is treated as new, so if its message was received but the ACK lost,
+/// and more than RH_RELIABLE_DATAGRAM_PEERS other senders are heard from before it retransmits, 
+/// the retransmission is delivered again. A node that receives from many peers in turn, such as a 
+/// server with many clients, should define RH_RELIABLE_DATAGRAM_PEERS as at least the number of peers
+/// it expects to hear from within a few retransmit timeouts.
+/// IDs are sent as 8 bits, and receivers extend them to 16 bits relative to the highest seen, which
+/// is correct as long as messages are not delayed by more than 127 others from the same sender.
+/// If RH_RELIABLE_DATAGRAM_16BIT_IDS is defined, all 16 bits are sent instead, at the cost of an octet per message.
+///
 ///
 /// An ack consists of a message with:
 /// - TO set to the from address of the original message
@@ -62,6 +168,37 @@
 /// Central server-type sketches should be very cautious about their
 /// retransmit strategy and configuration lest they hang for a long time
 /// trying to reply to clients that are unreachable.
+///
+/// \par Pipelined sends
+///
+/// Stop-and-wait limits throughput to one message per round trip, however fast the radio.
+/// For bulk transfers, sendtoWaitMany() keeps up to setWindow() messages to the same 
+/// address in flight at once. Each one is acknowledged individually (with the usual ACK,
+/// so receivers need no changes), and each has its own retransmission timer, so only messages that
+/// are actually lost are sent again (selective repeat). Messages may therefore be received out of order.
+/// Receivers remember which of the last RH_RELIABLE_DATAGRAM_SEEN_WINDOW IDs from each sender they have 
+/// received, so retransmissions are still recognised as duplicates.
+///
+/// \par Non-blocking sends
+///
+/// sendtoWait() blocks until the ACK arrives or the retries are exhausted, so a node serving several
+/// others can do nothing else meanwhile. startSend() instead transmits the message on the next call to poll() 
+/// and returns a handle immediately. Call poll() frequently (typically every time round loop()): 
+/// it collects ACKs and retransmits or gives up on messages whose timeouts have expired, 
+/// exactly as sendtoWait() would. Up to RH_RELIABLE_DATAGRAM_MAX_PENDING sends, to the same or different
+/// addresses, can be in progress at once. Find out how each one ended with sendStatus(), or
+/// register a callback with setSendCallback(). ACKs for pending sends are also collected by recvfromAck(), 
+/// sendtoWait() and sendtoWaitMany(), so they can be freely mixed with poll().
+/// The message is not copied: buf must not be changed until the send is finished. startSendFragments() 
+/// sends a message made of several fragments in the same way.
+///
+/// \par Hardware acknowledgement
+///
+/// Some radios can acknowledge and retransmit messages by themselves (see RHGenericDriver::hasHardwareAck()
+/// and RH_NRF24::setHardwareAck()). With such a driver, no ACK messages are sent or waited for: a message
+/// is acknowledged when the driver says it was, and the retries set by setRetries() are in addition to
+/// the retransmissions by the radio. All nodes must then use the same kind of driver. Round trip times are
+/// not measured, and sendtoWaitMany() sends one message at a time.
 class RHReliableDatagram : public RHDatagram
 {
 public:
@@ -70,9 +207,17 @@ public:
     /// \param[in] thisAddress The address to assign to this node. Defaults to 0
     RHReliableDatagram(RHGenericDriver& driver, uint8_t thisAddress = 0);
 
+    /// Initialise this instance and the driver connected to it.
+    /// Overrides the init() function in RHDatagram.
+    /// Picks where the sequences of message IDs start, so call randomSeed() first if you can
+    bool init();
+
     /// Sets the minimum retransmit timeout. If sendtoWait is waiting for an ack 
     /// longer than this time (in milliseconds), 
-    /// it will retransmit the message. Defaults to 200ms. The timeout is measured from the end of
+    /// it will retransmit the message. Defaults to 200ms. If the adaptive timeout is enabled 
+    /// (see setAdaptiveTimeout()), this is only used for peers whose round trip time has not been 
+    /// measured yet, and is doubled on each retry.
+    /// The timeout is measured from the end of
     /// transmission of the message. It must be at least longer than the the transmit 
     /// time of the acknowledgement (preamble+6 octets) plus the latency/poll time of the receiver. 
     /// For fast modulation schemes you can considerably shorten this time.
@@ -82,9 +227,32 @@ public:
 
     /// Sets the max number of retries. Defaults to 3. If set to 0, the message will only be sent once.
     /// sendtoWait will give up and return false if there is no ack received after all transmissions time out.
+    /// Without the adaptive timeout that takes between (retries + 1) * timeout and twice that.
+    /// With it, the backoff roughly doubles the time for each retry: see setAdaptiveTimeout().
     /// param[in] retries The maximum number a retries.
     void setRetries(uint8_t retries);
 
+    /// Enables or disables the adaptive retransmit timeout. Disabled by default.
+    /// When disabled, the timeout set by setTimeout() is always used, and retries do not back off.
+    /// Round trip times are still measured.
+    /// When enabled, a send to a peer that does not answer blocks much longer, because of the backoff:
+    /// see "Adaptive retransmit timeout" above.
+    /// \param[in] enable true to adapt the timeout to the measured round trip time of each peer
+    void setAdaptiveTimeout(bool enable);
+
+    /// Returns the round trip time measurements for a peer
+    /// \param[in] address The address of the peer
+    /// \param[out] srtt If not NULL, set to the smoothed round trip time in milliseconds
+    /// \param[out] rttvar If not NULL, set to the smoothed mean deviation of the round trip time in milliseconds
+    /// \return true if the round trip time to the peer has been measured
+    bool roundTripTime(uint8_t address, uint16_t* srtt = NULL, uint16_t* rttvar = NULL);
+
+    /// Returns the retransmit timeout that will be used for the next message sent to the peer,
+    /// before backoff and random variation.
+    /// \param[in] address The address of the peer
+    /// \return The timeout in milliseconds
+    uint16_t retransmitTimeout(uint8_t address);
+
     /// Send the message (with retries) and waits for an ack. Returns true if an acknowledgement is received.
     /// Synchronous: any message other than the desired ACK received while waiting is discarded.
     /// Blocks until an ACK is received or all retries are exhausted (ie up to retries*timeout milliseconds).
@@ -97,6 +265,104 @@ public:
     /// \return true if the message was transmitted and an acknowledgement was received.
     bool sendtoWait(uint8_t* buf, uint8_t len, uint8_t address);
 
+    /// Like sendtoWait(), but the message is made of several fragments, eg the headers of higher protocol 
+    /// layers followed by the application payload, which are passed to the driver without being copied 
+    /// together. See RHGenericDriver::sendFragments()
+    /// \param[in] fragments The pieces of the message, in order. They must be left alone until this returns
+    /// \param[in] count Number of fragments
+    /// \param[in] address The address to send the message to.
+    /// \return true if the message was transmitted and an acknowledgement was received.
+    bool sendtoWaitFragments(const RHGenericDriver::Fragment* fragments, uint8_t count, uint8_t address);
+
+    /// Sets the maximum number of unacknowledged messages sendtoWaitMany() will have in flight at once.
+    /// Defaults to 4. 1 makes sendtoWaitMany() equivalent to calling sendtoWait() for each message.
+    /// \param[in] window The new window size, from 1 to RH_RELIABLE_DATAGRAM_MAX_WINDOW
+    void setWindow(uint8_t window);
+
+    /// Sends several messages to the same address, pipelined. Up to the window size (see setWindow())
+    /// of messages are sent before waiting for their acknowledgements, and a new message is sent as
+    /// soon as any of them is acknowledged. Unacknowledged messages are retransmitted individually
+    /// after the timeout, up to the number of retries, just like sendtoWait(). 
+    /// Blocks until all the messages have been acknowledged or their retries are exhausted.
+    /// Any received message other than the expected acknowledgements is discarded, as with sendtoWait().
+    /// Each message gets its own ID, incrementing in the order of bufs, but they may be received 
+    /// in any order.
+    /// If the address is RH_BROADCAST_ADDRESS, the messages are all sent without waiting for acknowledgements.
+    /// \param[in] bufs Array of count pointers to the messages to send
+    /// \param[in] lens Array of count lengths of the messages
+    /// \param[in] count Number of messages to send
+    /// \param[in] address The address to send the messages to.
+    /// \return The number of messages that were transmitted and acknowledged
+    uint8_t sendtoWaitMany(uint8_t** bufs, const uint8_t* lens, uint8_t count, uint8_t address);
+
+    /// The state of a send started by startSend()
+    typedef enum
+    {
+	SendFree = 0,  ///< There is no send with this handle (or its status has already been collected)
+	SendPending,   ///< Waiting to be sent, or for an ACK
+	SendAcked,     ///< Finished: the message was acknowledged (or was broadcast)
+	SendFailed     ///< Finished: no ACK was received after all the retries
+    } SendStatus;
+
+    /// Function called by poll() (or whichever function received the ACK) when a send started by startSend() finishes
+    /// \param[in] handle The handle returned by startSend()
+    /// \param[in] status SendAcked or SendFailed
+    typedef void (*SendCallback)(uint8_t handle, SendStatus status);
+
+    /// Starts sending a message without waiting for it to be transmitted or acknowledged.
+    /// The message is transmitted, and if necessary retransmitted, by later calls to poll(),
+    /// with the same timeouts and retries as sendtoWait().
+    /// \param[in] buf Pointer to the binary message to send. Must remain unchanged until the send is finished
+    /// \param[in] len Number of octets to send
+    /// \param[in] address The address to send the message to. 
+    /// If RH_BROADCAST_ADDRESS, the send finishes as soon as it is transmitted.
+    /// \return A handle for the send, for sendStatus(), or 0 if there are already
+    /// RH_RELIABLE_DATAGRAM_MAX_PENDING sends in progress, or the message is too long for the driver
+    uint8_t startSend(uint8_t* buf, uint8_t len, uint8_t address);
+
+    /// Like startSend(), but the message is made of several fragments, as for sendtoWaitFragments()
+    /// \param[in] fragments The pieces of the message, in order. Neither the array nor the pieces
+    /// may be changed until the send is finished
+    /// \param[in] count Number of fragments
+    /// \param[in] address The address to send the message to. 
+    /// \return A handle for the send, for sendStatus(), or 0 if there are already
+    /// RH_RELIABLE_DATAGRAM_MAX_PENDING sends in progress, or the message could never be sent: 
+    /// it is too long for the driver, or has more than RH_RELIABLE_DATAGRAM_MAX_FRAGMENTS fragments
+    /// and RH_RELIABLE_DATAGRAM_16BIT_IDS is defined
+    uint8_t startSendFragments(const RHGenericDriver::Fragment* fragments, uint8_t count, uint8_t address);
+
+    /// Advances the sends started by startSend(): collects any ACKs, then transmits one message 
+    /// that is waiting to be sent or whose ACK timeout has expired. Sends that have exhausted their retries fail.
+    /// Does not wait for ACKs, but does wait for the transmission to complete.
+    /// Messages other than ACKs are left for recvfromAck(). The driver delivers messages in the order
+    /// they arrived, so poll() only collects the ACKs in front of the first other message. Any behind it
+    /// wait until the application has collected that message with recvfromAck(), which passes on the ACKs 
+    /// it meets as well, so call recvfromAck() before poll() each time round loop(), or the sends may 
+    /// time out and be retransmitted although their ACKs have arrived.
+    /// A send that the driver refuses to transmit fails.
+    /// \return The number of sends still pending
+    uint8_t poll();
+
+    /// Returns the status of a send started by startSend(). Once a finished status (SendAcked or
+    /// SendFailed) has been returned, the handle is freed for reuse, and SendFree is returned after that.
+    /// If there is no send callback, you must collect the status of every send like this, 
+    /// or startSend() will run out of handles.
+    /// \param[in] handle The handle returned by startSend()
+    /// \return The status of the send
+    SendStatus sendStatus(uint8_t handle);
+
+    /// Returns how many times the message of a send started by startSend() has been transmitted so far.
+    /// Still valid once its status has been collected, until the handle is reused by another send.
+    /// \param[in] handle The handle returned by startSend()
+    /// \return The number of transmissions, including retransmissions
+    uint8_t sendTries(uint8_t handle);
+
+    /// Sets a function to be called when each send started by startSend() finishes. 
+    /// The handle is freed for reuse when the callback returns, and sendStatus() is not needed.
+    /// The callback may start new sends.
+    /// \param[in] callback The function to call, or NULL for none
+    void setSendCallback(SendCallback callback);
+
     /// If there is a valid message available for this node, send an acknowledgement to the SRC
     /// address (blocking until this is complete), then copy the message to buf and return true
     /// else return false. 
@@ -107,16 +373,31 @@ public:
     /// If the message is not a broadcast, acknowledge to the sender before returning.
     /// You should be sure to call this function frequently enough to not miss any messages
     /// It is recommended that you call it in your main loop.
+    /// If RH_RELIABLE_DATAGRAM_16BIT_IDS is defined, the top of the ID is received into buf and then
+    /// removed, so buf needs room for 1 more octet than the longest message expected.
     /// \param[in] buf Location to copy the received message
     /// \param[in,out] len Available space in buf. Set to the actual number of octets copied.
     /// \param[in] from If present and not NULL, the referenced uint8_t will be set to the SRC address
     /// \param[in] to If present and not NULL, the referenced uint8_t will be set to the DEST address
-    /// \param[in] id If present and not NULL, the referenced uint8_t will be set to the ID
+    /// \param[in] id If present and not NULL, the referenced uint8_t will be set to the bottom 8 bits of the ID
     /// \param[in] flags If present and not NULL, the referenced uint8_t will be set to the FLAGS
     /// (not just those addressed to this node).
     /// \return true if a valid message was copied to buf
     bool recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* from = NULL, uint8_t* to = NULL, uint8_t* id = NULL, uint8_t* flags = NULL);
 
+    /// Like recvfromAck(), but lends the message in place in the driver instead of copying it.
+    /// ACKs and duplicates are dealt with and given back to the driver as usual. A message that is
+    /// returned must be given back with recvRelease() before anything else can be received.
+    /// See RHGenericDriver::recvBorrow().
+    /// \param[out] buf Set to point at the message
+    /// \param[out] len Set to the length of the message
+    /// \param[in] from If present and not NULL, the referenced uint8_t will be set to the SRC address
+    /// \param[in] to If present and not NULL, the referenced uint8_t will be set to the DEST address
+    /// \param[in] id If present and not NULL, the referenced uint8_t will be set to the ID
+    /// \param[in] flags If present and not NULL, the referenced uint8_t will be set to the FLAGS
+    /// \return true if a message was lent. Always false if the driver cannot lend messages
+    bool recvfromAckBorrow(uint8_t** buf, uint8_t* len, uint8_t* from = NULL, uint8_t* to = NULL, uint8_t* id = NULL, uint8_t* flags = NULL);
+
     /// Similar to recvfromAck(), this will block until either a valid message available for this node
     /// or the timeout expires. Starts the receiver automatically.
     /// You should be sure to call this function frequently enough to not miss any messages
@@ -144,21 +425,74 @@ public:
 protected:
     /// Send an ACK for the message id to the given from address
     /// Blocks until the ACK has been sent
-    void acknowledge(uint8_t id, uint8_t from);
+    void acknowledge(uint16_t id, uint8_t from);
 
     /// Checks whether the message currently in the Rx buffer is a new message, not previously received
     /// based on the from address and the sequence.  If it is new, it is acknowledged and returns true
     /// \return true if there is a message received and it is a new message
     bool haveNewMessage();
 
+    /// Checks whether a message with this id from this address has been received recently
+    /// \param[in] from The address the message came from
+    /// \param[in] to The address the message was sent to, to tell broadcasts apart
+    /// \param[in] id The full ID of the message, from receivedId()
+    /// \return true if it is a duplicate of a message already received, or too old to tell
+    bool isDuplicate(uint8_t from, uint8_t to, uint16_t id);
+
+    /// Remembers the id of a new message received from the address
+    void markSeen(uint8_t from, uint8_t to, uint16_t id);
+
+    /// Returns the full ID of a received message
+    /// \param[in] from The address the message came from
+    /// \param[in] to The address the message was sent to
+    /// \param[in] id The ID from the message header
+    /// \param[in] high The first octet of the message, which is the top of the ID 
+    /// if RH_RELIABLE_DATAGRAM_16BIT_IDS is defined
+    /// \param[in] flags The FLAGS from the message header. If RH_FLAGS_RESTART is set and the message
+    /// starts a new sequence, the IDs received from the sender are forgotten
+    uint16_t receivedId(uint8_t from, uint8_t to, uint8_t id, uint8_t high, uint8_t flags);
+
+    /// Returns the ID for the next new message to the address
+    uint16_t nextId(uint8_t address);
+
+    /// Returns the RH_FLAGS_RESTART flags for the message to the address with the given ID:
+    /// RH_FLAGS_NONE unless it is at the start of a new sequence
+    uint8_t restartFlags(uint8_t address, uint16_t id);
+
+    /// Sends a message with the given ID, and the ACK flag cleared. Does not wait for it to be transmitted
+    /// \return true if the message was accepted for transmission
+    bool sendtoId(const RHGenericDriver::Fragment* fragments, uint8_t count, uint8_t address, uint16_t id);
+
+    /// Updates the round trip time estimate for the peer with a new measurement.
+    /// Only messages that were acknowledged without being retransmitted should be measured (Karn's algorithm)
+    /// \param[in] address The address of the peer
+    /// \param[in] rtt Time from the end of transmission to receipt of the ACK in milliseconds
+    void updateRoundTripTime(uint8_t address, uint16_t rtt);
+
+    /// Returns the timeout to wait for an ACK from the peer after a transmission, including backoff and
+    /// random variation
+    /// \param[in] address The address of the peer
+    /// \param[in] tries The number of times the message has been sent, including this one
+    uint16_t ackTimeout(uint8_t address, uint8_t tries);
+
+    /// An ACK has been received: finishes the send started by startSend() that it is for, if any
+    /// \param[in] from The address the ACK came from
+    /// \param[in] id The ID of the ACK, with the top from the ACK message if RH_RELIABLE_DATAGRAM_16BIT_IDS is defined
+    void ackReceived(uint8_t from, uint16_t id);
+
+    /// Finishes a send started by startSend(), and calls the callback if there is one
+    void finishSend(uint8_t i, SendStatus status);
+
+    /// Deals with a message just received by recvfromAck() or recvfromAckBorrow(): acknowledges it
+    /// if necessary, passes ACKs to ackReceived() and checks for duplicates
+    /// \param[in] high The first octet of the message, for receivedId()
+    /// \return true if the message is new and should be passed on to the caller
+    bool acceptReceived(uint8_t from, uint8_t to, uint8_t id, uint8_t flags, uint8_t high);
+
 private:
     /// Count of retransmissions we have had to send
     uint32_t _retransmissions;
 
-    /// The last sequence number to be used
-    /// Defaults to 0
-    uint8_t _lastSequenceNumber;
-
     // Retransmit timeout (milliseconds)
     /// Defaults to 200
     uint16_t _timeout;
@@ -167,11 +501,81 @@ private:
     /// Defaults to 3
     uint8_t _retries;
 
-    /// Array of the last seen sequence number indexed by node address that sent it
-    /// It is used for duplicate detection. Duplicated messages are re-acknowledged when received 
-    /// (this is generally due to lost ACKs, causing the sender to retransmit, even though we have already
-    /// received that message)
-    uint8_t _seenIds[256];
+    /// Returns the index in _rxIds of the sender, or RH_RELIABLE_DATAGRAM_PEERS if it is not there
+    uint8_t findReceived(uint8_t from, uint8_t to);
+
+    /// Starts tracking the IDs from the sender afresh, with id as the highest received, 
+    /// taking over the least recently used entry if it is new. Returns the index in _rxIds
+    uint8_t resetReceived(uint8_t from, uint8_t to, uint16_t id);
+
+    /// Incremented each time a peer table entry is used, to find the least recently used.
+    /// Wide enough that it does not wrap while an idle peer is still in the tables
+    uint32_t _peerClock;
+
+    /// The bottom octet of the first ID of the next new sequence. Incremented for each, so a new
+    /// sequence does not start where the receiver remembers the one before it starting
+    uint8_t _nextStart;
+
+    /// The last ID sent to each of the most recently used destinations. 
+    struct
+    {
+	uint8_t  address;
+	bool     valid;
+	uint32_t lastUse;   // _peerClock when last used
+	uint16_t id;
+	uint16_t start;     // The first ID of the sequence
+    }       _txIds[RH_RELIABLE_DATAGRAM_PEERS];
+
+    /// The IDs received from each of the most recently heard senders, for duplicate detection.
+    /// Duplicated messages are re-acknowledged when received (this is generally due to lost ACKs, 
+    /// causing the sender to retransmit, even though we have already received that message)
+    struct
+    {
+	uint8_t  address;
+	bool     valid;
+	bool     broadcast; // Tracks broadcasts from the address, which have their own IDs
+	uint32_t lastUse;   // _peerClock when last used
+	bool     restarting; // Only messages with RH_FLAGS_RESTART have been received since restartId
+	uint16_t restartId; // The first ID of the sender's latest new sequence
+	uint16_t highest;   // The highest ID received
+	uint16_t seen;      // Bit n is set if highest - n has been received
+    }       _rxIds[RH_RELIABLE_DATAGRAM_PEERS];
+
+    /// Maximum number of messages in flight in sendtoWaitMany()
+    /// Defaults to 4
+    uint8_t _window;
+
+    /// true if the retransmit timeout adapts to the round trip time
+    /// Defaults to true
+    bool    _adaptiveTimeout;
+
+    /// Round trip time estimates, as in TCP. srtt8 is 8 times the smoothed round trip time, and
+    /// rttvar4 is 4 times its smoothed mean deviation, both in milliseconds. 
+    /// Entries with srtt8 of 0 are unused
+    struct
+    {
+	uint8_t  address;
+	uint32_t lastUse;   // _peerClock when last updated
+	uint16_t srtt8;
+	uint16_t rttvar4;
+    }       _rtt[RH_RELIABLE_DATAGRAM_RTT_PEERS];
+
+    /// Sends started by startSend(), indexed by handle - 1
+    struct
+    {
+	const RHGenericDriver::Fragment* fragments; // The message to send
+	uint8_t       count;    // Number of fragments
+	RHGenericDriver::Fragment fragment; // The whole message, for startSend()
+	uint8_t       address;
+	uint16_t      id;       // Sequence number it is sent with
+	uint8_t       tries;    // Times sent so far
+	SendStatus    status;
+	uint16_t      timeout;  // Randomised retransmit timeout for this try
+	unsigned long sentAt;   // millis() when last sent
+    }       _pending[RH_RELIABLE_DATAGRAM_MAX_PENDING];
+
+    /// Called when a send started by startSend() finishes
+    SendCallback _sendCallback;
 };
 
 /// @example rf22_reliable_datagram_client.pde
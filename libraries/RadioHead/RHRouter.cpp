@@ -13,12 +13,11 @@
 
 #include <RHRouter.h>
 
-RHRouter::RoutedMessage RHRouter::_tmpMessage;
-
 ////////////////////////////////////////////////////////////////////
 // Constructors
 RHRouter::RHRouter(RHGenericDriver& driver, uint8_t thisAddress) 
-    : RHReliableDatagram(driver, thisAddress)
+    : RHReliableDatagram(driver, thisAddress),
+      _routeTimeout(0)
 {
     _max_hops = RH_DEFAULT_MAX_HOPS;
     clearRoutingTable();
@@ -41,65 +40,144 @@ void RHRouter::setMaxHops(uint8_t max_hops)
 }
 
 ////////////////////////////////////////////////////////////////////
-void RHRouter::addRouteTo(uint8_t dest, uint8_t next_hop, uint8_t state)
+void RHRouter::setRouteTimeout(unsigned long timeout)
 {
-    uint8_t i;
+    _routeTimeout = timeout;
+}
 
-    // First look for an existing entry we can update
-    for (i = 0; i < RH_ROUTING_TABLE_SIZE; i++)
-    {
-	if (_routes[i].dest == dest)
-	{
-	    _routes[i].dest = dest;
-	    _routes[i].next_hop = next_hop;
-	    _routes[i].state = state;
-	    return;
-	}
-    }
+////////////////////////////////////////////////////////////////////
+// Hashing is just the low bits, since node addresses are usually allocated in sequence
+#define RH_ROUTE_HASH(dest) ((dest) & (RH_ROUTING_HASH_SIZE - 1))
 
-    // Look for an invalid entry we can use
-    for (i = 0; i < RH_ROUTING_TABLE_SIZE; i++)
+////////////////////////////////////////////////////////////////////
+uint8_t RHRouter::findRoute(uint8_t dest)
+{
+    uint8_t i = _routeHash[RH_ROUTE_HASH(dest)];
+    while (i != RH_ROUTE_NONE && _routes[i].dest != dest)
+	i = _routes[i].hashNext;
+    return i;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHRouter::touchRoute(uint8_t index)
+{
+    if (index == _routeMru)
+	return; // Already there
+    // Unlink it
+    RoutingTableEntry* e = &_routes[index];
+    _routes[e->lruPrev].lruNext = e->lruNext;
+    if (e->lruNext != RH_ROUTE_NONE)
+	_routes[e->lruNext].lruPrev = e->lruPrev;
+    else
+	_routeLru = e->lruPrev;
+    // And put it at the front
+    e->lruPrev = RH_ROUTE_NONE;
+    e->lruNext = _routeMru;
+    _routes[_routeMru].lruPrev = index;
+    _routeMru = index;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHRouter::addRouteTo(uint8_t dest, uint8_t next_hop, uint8_t state, uint8_t hops, uint8_t cost)
+{
+    if (state == Invalid)
     {
-	if (_routes[i].state == Invalid)
-	{
-	    _routes[i].dest = dest;
-	    _routes[i].next_hop = next_hop;
-	    _routes[i].state = state;
-	    return;
-	}
+	// Same as not having a route
+	deleteRouteTo(dest);
+	return;
     }
 
-    // Need to make room for a new one
-    retireOldestRoute();
-    // Should be an invalid slot now
-    for (i = 0; i < RH_ROUTING_TABLE_SIZE; i++)
+    // First look for an existing entry we can update
+    uint8_t i = findRoute(dest);
+    if (i != RH_ROUTE_NONE)
+	touchRoute(i);
+    else
     {
-	if (_routes[i].state == Invalid)
-	{
-	    _routes[i].dest = dest;
-	    _routes[i].next_hop = next_hop;
-	    _routes[i].state = state;
-	}
+	// Need a new one. Make room if necessary
+	if (_routeFree == RH_ROUTE_NONE)
+	    retireOldestRoute();
+	i = _routeFree;
+	_routeFree = _routes[i].hashNext;
+	// Link it into its hash bucket and at the front of the LRU list
+	uint8_t bucket = RH_ROUTE_HASH(dest);
+	_routes[i].hashNext = _routeHash[bucket];
+	_routeHash[bucket] = i;
+	_routes[i].lruPrev = RH_ROUTE_NONE;
+	_routes[i].lruNext = _routeMru;
+	if (_routeMru != RH_ROUTE_NONE)
+	    _routes[_routeMru].lruPrev = i;
+	else
+	    _routeLru = i;
+	_routeMru = i;
     }
+    _routes[i].dest = dest;
+    _routes[i].next_hop = next_hop;
+    _routes[i].state = state;
+    _routes[i].hops = hops;
+    _routes[i].cost = cost;
+    _routes[i].updated = millis();
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHRouter::offerRouteTo(uint8_t dest, uint8_t next_hop, uint8_t hops)
+{
+    uint16_t cost = (uint16_t)hops * RH_ROUTE_HOP_COST;
+    int8_t rssi = _driver.lastRssi();
+    if (rssi < RH_ROUTE_GOOD_RSSI)
+	cost += (RH_ROUTE_GOOD_RSSI - rssi) / RH_ROUTE_RSSI_STEP;
+    if (cost > 255)
+	cost = 255;
+
+    // getRouteTo() gets rid of expired routes
+    RoutingTableEntry* route = getRouteTo(dest);
+    if (route && route->next_hop != next_hop && route->cost <= cost)
+	return false; // Keep the one we have
+    addRouteTo(dest, next_hop, Valid, hops, cost);
+    return true;
 }
 
 ////////////////////////////////////////////////////////////////////
 RHRouter::RoutingTableEntry* RHRouter::getRouteTo(uint8_t dest)
 {
-    uint8_t i;
-    for (i = 0; i < RH_ROUTING_TABLE_SIZE; i++)
-	if (_routes[i].dest == dest && _routes[i].state != Invalid)
-	    return &_routes[i];
-    return NULL;
+    uint8_t i = findRoute(dest);
+    if (i == RH_ROUTE_NONE)
+	return NULL;
+    if (_routeTimeout && (millis() - _routes[i].updated) > _routeTimeout)
+    {
+	// Stale
+	deleteRoute(i);
+	return NULL;
+    }
+    touchRoute(i);
+    return &_routes[i];
 }
 
 ////////////////////////////////////////////////////////////////////
 void RHRouter::deleteRoute(uint8_t index)
 {
-    // Delete a route by copying following routes on top of it
-    memcpy(&_routes[index], &_routes[index+1], 
-	   sizeof(RoutingTableEntry) * (RH_ROUTING_TABLE_SIZE - index - 1));
-    _routes[RH_ROUTING_TABLE_SIZE - 1].state = Invalid;
+    RoutingTableEntry* e = &_routes[index];
+    if (e->state == Invalid)
+	return; // Not in use
+
+    // Unlink it from its hash bucket
+    uint8_t* p = &_routeHash[RH_ROUTE_HASH(e->dest)];
+    while (*p != index)
+	p = &_routes[*p].hashNext;
+    *p = e->hashNext;
+
+    // And from the LRU list
+    if (e->lruPrev != RH_ROUTE_NONE)
+	_routes[e->lruPrev].lruNext = e->lruNext;
+    else
+	_routeMru = e->lruNext;
+    if (e->lruNext != RH_ROUTE_NONE)
+	_routes[e->lruNext].lruPrev = e->lruPrev;
+    else
+	_routeLru = e->lruPrev;
+
+    e->state = Invalid;
+    e->hashNext = _routeFree;
+    _routeFree = index;
 }
 
 ////////////////////////////////////////////////////////////////////
@@ -115,7 +193,11 @@ void RHRouter::printRoutingTable()
 	Serial.print(" Next Hop: ");
 	Serial.print(_routes[i].next_hop, DEC);
 	Serial.print(" State: ");
-	Serial.println(_routes[i].state, DEC);
+	Serial.print(_routes[i].state, DEC);
+	Serial.print(" Hops: ");
+	Serial.print(_routes[i].hops, DEC);
+	Serial.print(" Cost: ");
+	Serial.println(_routes[i].cost, DEC);
     }
 #endif
 }
@@ -123,31 +205,36 @@ void RHRouter::printRoutingTable()
 ////////////////////////////////////////////////////////////////////
 bool RHRouter::deleteRouteTo(uint8_t dest)
 {
-    uint8_t i;
-    for (i = 0; i < RH_ROUTING_TABLE_SIZE; i++)
-    {
-	if (_routes[i].dest == dest)
-	{
-	    deleteRoute(i);
-	    return true;
-	}
-    }
-    return false;
+    uint8_t i = findRoute(dest);
+    if (i == RH_ROUTE_NONE)
+	return false;
+    deleteRoute(i);
+    return true;
 }
 
 ////////////////////////////////////////////////////////////////////
 void RHRouter::retireOldestRoute()
 {
-    // We just obliterate the first in the table and clear the last
-    deleteRoute(0);
+    // The least recently used
+    if (_routeLru != RH_ROUTE_NONE)
+	deleteRoute(_routeLru);
 }
 
 ////////////////////////////////////////////////////////////////////
 void RHRouter::clearRoutingTable()
 {
     uint8_t i;
+    for (i = 0; i < RH_ROUTING_HASH_SIZE; i++)
+	_routeHash[i] = RH_ROUTE_NONE;
+    // All the entries go on the free list
     for (i = 0; i < RH_ROUTING_TABLE_SIZE; i++)
+    {
 	_routes[i].state = Invalid;
+	_routes[i].hashNext = i + 1;
+    }
+    _routes[RH_ROUTING_TABLE_SIZE - 1].hashNext = RH_ROUTE_NONE;
+    _routeFree = 0;
+    _routeMru = _routeLru = RH_ROUTE_NONE;
 }
 
 
@@ -157,42 +244,78 @@ uint8_t RHRouter::sendtoWait(uint8_t* buf, uint8_t len, uint8_t dest, uint8_t fl
 }
 
 ////////////////////////////////////////////////////////////////////
-// Waits for delivery to the next hop (but not for delivery to the final destination)
+uint8_t RHRouter::sendtoWaitFragments(const RHGenericDriver::Fragment* fragments, uint8_t count, uint8_t dest, uint8_t flags)
+{
+    return sendtoFromSourceWaitFragments(fragments, count, dest, _thisAddress, flags);
+}
+
+////////////////////////////////////////////////////////////////////
 uint8_t RHRouter::sendtoFromSourceWait(uint8_t* buf, uint8_t len, uint8_t dest, uint8_t source, uint8_t flags)
 {
-    if (((uint16_t)len + sizeof(RoutedMessageHeader)) > _driver.maxMessageLength())
+    RHGenericDriver::Fragment fragment = { buf, len };
+    return sendtoFromSourceWaitFragments(&fragment, 1, dest, source, flags);
+}
+
+////////////////////////////////////////////////////////////////////
+// Waits for delivery to the next hop (but not for delivery to the final destination)
+uint8_t RHRouter::sendtoFromSourceWaitFragments(const RHGenericDriver::Fragment* fragments, uint8_t count, uint8_t dest, uint8_t source, uint8_t flags)
+{
+    if (   count > RH_ROUTER_MAX_FRAGMENTS
+	|| (RHGenericDriver::fragmentsLen(fragments, count) + sizeof(RoutedMessageHeader) + RH_RELIABLE_DATAGRAM_ID_OVERHEAD) > _driver.maxMessageLength())
 	return RH_ROUTER_ERROR_INVALID_LENGTH;
 
-    // Construct a RH RouterMessage message
-    _tmpMessage.header.source = source;
-    _tmpMessage.header.dest = dest;
-    _tmpMessage.header.hops = 0;
-    _tmpMessage.header.id = _lastE2ESequenceNumber++;
-    _tmpMessage.header.flags = flags;
-    memcpy(_tmpMessage.data, buf, len);
+    // Construct a RH RouterMessage header. The application message stays where it is
+    RoutedMessageHeader header;
+    header.source = source;
+    header.dest = dest;
+    header.hops = 0;
+    header.id = _lastE2ESequenceNumber++;
+    header.flags = flags;
 
-    return route(&_tmpMessage, sizeof(RoutedMessageHeader)+len);
+    return route(&header, fragments, count);
 }
 
 ////////////////////////////////////////////////////////////////////
-uint8_t RHRouter::route(RoutedMessage* message, uint8_t messageLen)
+uint8_t RHRouter::route(RoutedMessageHeader* header, const RHGenericDriver::Fragment* fragments, uint8_t count)
 {
     // Reliably deliver it if possible. See if we have a route:
     uint8_t next_hop = RH_BROADCAST_ADDRESS;
-    if (message->header.dest != RH_BROADCAST_ADDRESS)
+    if (header->dest != RH_BROADCAST_ADDRESS)
     {
-	RoutingTableEntry* route = getRouteTo(message->header.dest);
+	RoutingTableEntry* route = getRouteTo(header->dest);
 	if (!route)
 	    return RH_ROUTER_ERROR_NO_ROUTE;
 	next_hop = route->next_hop;
     }
 
-    if (!RHReliableDatagram::sendtoWait((uint8_t*)message, messageLen, next_hop))
+    // The header goes in front of the application message
+    RHGenericDriver::Fragment message[RH_ROUTER_MAX_FRAGMENTS + 1];
+    message[0].data = (uint8_t*)header;
+    message[0].len = sizeof(RoutedMessageHeader);
+    memcpy(message + 1, fragments, count * sizeof(RHGenericDriver::Fragment));
+    uint32_t retransmitted = retransmissions();
+    if (!RHReliableDatagram::sendtoWaitFragments(message, count + 1, next_hop))
 	return RH_ROUTER_ERROR_UNABLE_TO_DELIVER;
 
+    addRetransmissionCost(header->dest, retransmissions() - retransmitted);
     return RH_ROUTER_ERROR_NONE;
 }
 
+////////////////////////////////////////////////////////////////////
+void RHRouter::addRetransmissionCost(uint8_t dest, uint32_t retransmitted)
+{
+    // A link that needs retransmissions costs more, so a better route can replace it
+    if (retransmitted && dest != RH_BROADCAST_ADDRESS)
+    {
+	RoutingTableEntry* route = getRouteTo(dest);
+	if (route && route->cost)
+	{
+	    uint32_t cost = route->cost + retransmitted * RH_ROUTE_RETRY_COST;
+	    route->cost = cost > 255 ? 255 : cost;
+	}
+    }
+}
+
 ////////////////////////////////////////////////////////////////////
 // Subclasses may want to override this to peek at messages going past
 void RHRouter::peekAtMessage(RoutedMessage* message, uint8_t messageLen)
@@ -203,12 +326,40 @@ void RHRouter::peekAtMessage(RoutedMessage* message, uint8_t messageLen)
 ////////////////////////////////////////////////////////////////////
 bool RHRouter::recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* source, uint8_t* dest, uint8_t* id, uint8_t* flags)
 {  
-    uint8_t tmpMessageLen = sizeof(_tmpMessage);
+    uint8_t* data;
+    uint8_t dataLen;
+    if (recvfromAckInto(&data, &dataLen, source, dest, id, flags))
+    {
+	if (*len > dataLen)
+	    *len = dataLen;
+	memcpy(buf, data, *len);
+	recvRelease();
+	return true; // Its for you!
+    }
+    return false;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHRouter::recvfromAckBorrow(uint8_t** buf, uint8_t* len, uint8_t* source, uint8_t* dest, uint8_t* id, uint8_t* flags)
+{  
+    if (!_driver.canBorrowRecv())
+	return false; // There would be nowhere to keep it
+    return recvfromAckInto(buf, len, source, dest, id, flags);
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHRouter::recvfromAckInto(uint8_t** buf, uint8_t* len, uint8_t* source, uint8_t* dest, uint8_t* id, uint8_t* flags)
+{  
+    // Parse the message in place in the driver if it can lend it to us, else get a copy
+    RoutedMessage* message = &_spare;
+    uint8_t messageLen = sizeof(RoutedMessage);
     uint8_t _from;
     uint8_t _to;
     uint8_t _id;
     uint8_t _flags;
-    if (RHReliableDatagram::recvfromAck((uint8_t*)&_tmpMessage, &tmpMessageLen, &_from, &_to, &_id, &_flags))
+    if (   RHReliableDatagram::recvfromAckBorrow((uint8_t**)&message, &messageLen, &_from, &_to, &_id, &_flags)
+	|| (   !_driver.canBorrowRecv()
+	    && RHReliableDatagram::recvfromAck((uint8_t*)&_spare, &messageLen, &_from, &_to, &_id, &_flags)))
     {
 	// Here we simulate networks with limited visibility between nodes
 	// so we can test routing
@@ -255,33 +406,47 @@ bool RHRouter::recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* source, uint8_t*
 	}
 	else
 	{
+	    recvRelease();
 	    return false; // Pretend we got nothing
 	}
 #endif
 
-	peekAtMessage(&_tmpMessage, tmpMessageLen);
+	if (messageLen < sizeof(RoutedMessageHeader))
+	{
+	    recvRelease();
+	    return false; // Too short to be routed
+	}
+	peekAtMessage(message, messageLen);
 	// See if its for us or has to be routed
-	if (_tmpMessage.header.dest == _thisAddress || _tmpMessage.header.dest == RH_BROADCAST_ADDRESS)
+	if (message->header.dest == _thisAddress || message->header.dest == RH_BROADCAST_ADDRESS)
 	{
 	    // Deliver it here
-	    if (source) *source  = _tmpMessage.header.source;
-	    if (dest)   *dest    = _tmpMessage.header.dest;
-	    if (id)     *id      = _tmpMessage.header.id;
-	    if (flags)  *flags   = _tmpMessage.header.flags;
-	    uint8_t msgLen = tmpMessageLen - sizeof(RoutedMessageHeader);
-	    if (*len > msgLen)
-		*len = msgLen;
-	    memcpy(buf, _tmpMessage.data, *len);
+	    if (source) *source  = message->header.source;
+	    if (dest)   *dest    = message->header.dest;
+	    if (id)     *id      = message->header.id;
+	    if (flags)  *flags   = message->header.flags;
+	    *buf = message->data;
+	    *len = messageLen - sizeof(RoutedMessageHeader);
 	    return true; // Its for you!
 	}
-	else if (   _tmpMessage.header.dest != RH_BROADCAST_ADDRESS
-		 && _tmpMessage.header.hops++ < _max_hops)
+	if (   message->header.dest != RH_BROADCAST_ADDRESS
+	    && message->header.hops < _max_hops)
 	{
+	    // Finished with the driver's copy, if any, so it can receive the acknowledgement
+	    if (message != &_spare)
+	    {
+		memcpy(&_spare, message, messageLen);
+		recvRelease();
+	    }
+	    _spare.header.hops++;
 	    // Maybe it has to be routed to the next hop
 	    // REVISIT: if it fails due to no route or unable to deliver to the next hop, 
 	    // tell the originator. BUT HOW?
-	    route(&_tmpMessage, tmpMessageLen);
+	    RHGenericDriver::Fragment data = { _spare.data, (uint8_t)(messageLen - sizeof(RoutedMessageHeader)) };
+	    route(&_spare.header, &data, 1);
 	}
+	else
+	    recvRelease();
 	// Discard it and maybe wait for another
     }
     return false;
@@ -291,11 +456,12 @@ bool RHRouter::recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* source, uint8_t*
 bool RHRouter::recvfromAckTimeout(uint8_t* buf, uint8_t* len, uint16_t timeout, uint8_t* source, uint8_t* dest, uint8_t* id, uint8_t* flags)
 {  
     unsigned long starttime = millis();
-    while ((millis() - starttime) < timeout)
+    unsigned long elapsed;
+    while ((elapsed = millis() - starttime) < timeout)
     {
-	if (recvfromAck(buf, len, source, dest, id, flags))
+	// Sleep until something arrives, if the driver can
+	if (waitAvailableTimeout(timeout - elapsed) && recvfromAck(buf, len, source, dest, id, flags))
 	    return true;
-	YIELD;
     }
     return false;
 }
@@ -12,8 +12,35 @@
 // Default max number of hops we will route
 #define RH_DEFAULT_MAX_HOPS 30
 
-// The default size of the routing table we keep
-#define RH_ROUTING_TABLE_SIZE 10
+// The default size of the routing table we keep. No more than 255
+#ifndef RH_ROUTING_TABLE_SIZE
+ #define RH_ROUTING_TABLE_SIZE 10
+#endif
+
+// Number of hash buckets for finding routes in the routing table. Must be a power of 2.
+// About the same as RH_ROUTING_TABLE_SIZE keeps lookups short
+#ifndef RH_ROUTING_HASH_SIZE
+ #define RH_ROUTING_HASH_SIZE 16
+#endif
+
+// Marks the end of the lists that link routing table entries
+#define RH_ROUTE_NONE 0xff
+
+// Route cost metric used by offerRouteTo(). Each hop costs RH_ROUTE_HOP_COST, plus 1 for every 
+// RH_ROUTE_RSSI_STEP dB by which the signal from the next hop is weaker than RH_ROUTE_GOOD_RSSI,
+// plus RH_ROUTE_RETRY_COST for each retransmission needed when sending along the route
+#ifndef RH_ROUTE_HOP_COST
+ #define RH_ROUTE_HOP_COST 16
+#endif
+#ifndef RH_ROUTE_GOOD_RSSI
+ #define RH_ROUTE_GOOD_RSSI -70
+#endif
+#ifndef RH_ROUTE_RSSI_STEP
+ #define RH_ROUTE_RSSI_STEP 2
+#endif
+#ifndef RH_ROUTE_RETRY_COST
+ #define RH_ROUTE_RETRY_COST 8
+#endif
 
 // Error codes
 #define RH_ROUTER_ERROR_NONE              0
@@ -28,6 +55,11 @@
 #define RH_ROUTER_MAX_MESSAGE_LEN (RH_MAX_MESSAGE_LEN - sizeof(RHRouter::RoutedMessageHeader))
 //#define RH_ROUTER_MAX_MESSAGE_LEN 50
 
+// The most fragments that can be passed to sendtoWaitFragments() and sendtoFromSourceWaitFragments()
+#ifndef RH_ROUTER_MAX_FRAGMENTS
+ #define RH_ROUTER_MAX_FRAGMENTS 3
+#endif
+
 // These allow us to define a simulated network topology for testing purposes
 // See RHRouter.cpp for details
 //#define RH_TEST_NETWORK 1
@@ -90,9 +122,13 @@
 /// You can also use addRouteTo() to change a route and 
 /// deleteRouteTo() to delete a route at run time. Youcan also clear the entire routing table
 ///
-/// The Routing Table has limited capacity for entries (defined by RH_ROUTING_TABLE_SIZE, which is 10)
-/// if more than RH_ROUTING_TABLE_SIZE are added, the oldest (first) one will be removed by calling 
-/// retireOldestRoute()
+/// The Routing Table has limited capacity for entries (defined by RH_ROUTING_TABLE_SIZE, which is 10 
+/// by default, and may be defined up to 255 for bigger processors). 
+/// If more than RH_ROUTING_TABLE_SIZE are added, the least recently used one will be removed by calling 
+/// retireOldestRoute(). Routes are found by hashing the destination address (see RH_ROUTING_HASH_SIZE), 
+/// so the time to look one up does not depend on the size of the table.
+/// Routes that are learned automatically (eg by RHMesh) can be made to expire if they are not
+/// updated for a while with setRouteTimeout(). By default they never expire.
 ///
 /// \par Message Format
 ///
@@ -165,6 +201,12 @@ public:
 	uint8_t      dest;      ///< Destination node address
 	uint8_t      next_hop;  ///< Send via this next hop address
 	uint8_t      state;     ///< State of this route, one of RouteState
+	uint8_t      hops;      ///< Number of hops to dest, or 0 if not known
+	uint8_t      cost;      ///< Cost of the route, see offerRouteTo(). Lower is better
+	unsigned long updated;  ///< millis() when the route was last added or updated by addRouteTo()
+	uint8_t      hashNext;  ///< Next entry in the same hash bucket, or in the free list
+	uint8_t      lruPrev;   ///< Next more recently used entry
+	uint8_t      lruNext;   ///< Next less recently used entry
     } RoutingTableEntry;
 
     /// Constructor. 
@@ -184,16 +226,37 @@ public:
     /// \param [in] max_hops The new value for max_hops
     void setMaxHops(uint8_t max_hops);
 
+    /// Sets how long a route lasts after it was last added or updated by addRouteTo().
+    /// getRouteTo() deletes routes that have expired.
+    /// \param [in] timeout The lifetime of a route in milliseconds, or 0 (the default) for routes that 
+    /// never expire
+    void setRouteTimeout(unsigned long timeout);
+
     /// Adds a route to the local routing table, or updates it if already present.
-    /// If there is not enough room the oldest (first) route will be deleted by calling retireOldestRoute().
+    /// If there is not enough room the least recently used route will be deleted by calling retireOldestRoute().
     /// \param [in] dest The destination node address. RH_BROADCAST_ADDRESS is permitted.
     /// \param [in] next_hop The address of the next hop to send messages destined for dest
     /// \param [in] state The satte of the route. Defaults to Valid
-    void addRouteTo(uint8_t dest, uint8_t next_hop, uint8_t state = Valid);
+    /// \param [in] hops The number of hops to dest, if known
+    /// \param [in] cost The cost of the route. The default of 0 means offerRouteTo() will not replace it with 
+    /// a route through a different next hop
+    void addRouteTo(uint8_t dest, uint8_t next_hop, uint8_t state = Valid, uint8_t hops = 0, uint8_t cost = 0);
+
+    /// Adds a route that has been learned from a message just received from the next hop, unless there 
+    /// is already a cheaper one through a different next hop. The cost is RH_ROUTE_HOP_COST for each hop, plus
+    /// a penalty if lastRssi() shows the signal from the next hop is weak. Sending along the route 
+    /// adds RH_ROUTE_RETRY_COST for each retransmission that was needed.
+    /// A route through the same next hop is always updated, so its cost can go up as well as down.
+    /// \param [in] dest The destination node address
+    /// \param [in] next_hop The address of the next hop to send messages destined for dest
+    /// \param [in] hops The number of hops to dest
+    /// \return true if the route was added or updated
+    bool offerRouteTo(uint8_t dest, uint8_t next_hop, uint8_t hops);
 
-    /// Finds and returns a RoutingTableEntry for the given destination node
+    /// Finds and returns a RoutingTableEntry for the given destination node, and marks it as the most
+    /// recently used
     /// \param [in] dest The desired destination node address.
-    /// \return pointer to a RoutingTableEntry for dest
+    /// \return pointer to a RoutingTableEntry for dest, or NULL if there is none, or it has expired
     RoutingTableEntry* getRouteTo(uint8_t dest);
 
     /// Deletes from the local routing table any route for the destination node.
@@ -201,7 +264,7 @@ public:
     /// \return true if the route was present
     bool deleteRouteTo(uint8_t dest);
 
-    /// Deletes the oldest (first) route from the 
+    /// Deletes the least recently used route from the 
     /// local routing table
     void retireOldestRoute();
 
@@ -231,6 +294,16 @@ public:
     ///           (usually because it dod not acknowledge due to being off the air or out of range
     uint8_t sendtoWait(uint8_t* buf, uint8_t len, uint8_t dest, uint8_t flags = 0);
 
+    /// Like sendtoWait(), but the application message is made of several fragments, eg the header
+    /// of a higher protocol layer and the payload. The RHRouter header is put in front of them and 
+    /// they are all passed to the driver without being copied together. See RHGenericDriver::sendFragments()
+    /// \param [in] fragments The pieces of the application message, in order
+    /// \param [in] count Number of fragments, no more than RH_ROUTER_MAX_FRAGMENTS
+    /// \param [in] dest The destination node address
+    /// \param [in] flags Optional flags for use by subclasses or application layer
+    /// \return The result code, as for sendtoWait()
+    uint8_t sendtoWaitFragments(const RHGenericDriver::Fragment* fragments, uint8_t count, uint8_t dest, uint8_t flags = 0);
+
     /// Similar to sendtoWait() above, but spoofs the source address.
     /// For internal use only during routing
     /// \param [in] buf The application message data.
@@ -247,6 +320,16 @@ public:
     ///           (usually because it dod not acknowledge due to being off the air or out of range
     uint8_t sendtoFromSourceWait(uint8_t* buf, uint8_t len, uint8_t dest, uint8_t source, uint8_t flags = 0);
 
+    /// Similar to sendtoWaitFragments() above, but spoofs the source address.
+    /// For internal use only during routing
+    /// \param [in] fragments The pieces of the application message, in order
+    /// \param [in] count Number of fragments, no more than RH_ROUTER_MAX_FRAGMENTS
+    /// \param [in] dest The destination node address.
+    /// \param [in] source The (fake) originating node address.
+    /// \param [in] flags Optional flags for use by subclasses or application layer
+    /// \return The result code, as for sendtoFromSourceWait()
+    uint8_t sendtoFromSourceWaitFragments(const RHGenericDriver::Fragment* fragments, uint8_t count, uint8_t dest, uint8_t source, uint8_t flags = 0);
+
     /// Starts the receiver if it is not running already.
     /// If there is a valid message available for this node (or RH_BROADCAST_ADDRESS), 
     /// send an acknowledgement to the last hop
@@ -269,6 +352,21 @@ public:
     /// \return true if a valid message was recvived for this node copied to buf
     bool recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* source = NULL, uint8_t* dest = NULL, uint8_t* id = NULL, uint8_t* flags = NULL);
 
+    /// Like recvfromAck(), but instead of copying the application message payload, points at it 
+    /// in the driver. Only drivers that can lend messages (see RHGenericDriver::recvBorrow()) support this:
+    /// with any other driver it always returns false, so use recvfromAck() instead.
+    /// Call recvRelease() when finished with the payload, before anything else is sent or received 
+    /// through this RHRouter.
+    /// Messages that are routed on to another node are dealt with as by recvfromAck().
+    /// \param[out] buf Set to point at the application message payload
+    /// \param[out] len Set to the length of the payload
+    /// \param[in] source If present and not NULL, the referenced uint8_t will be set to the SOURCE address
+    /// \param[in] dest If present and not NULL, the referenced uint8_t will be set to the DEST address
+    /// \param[in] id If present and not NULL, the referenced uint8_t will be set to the ID
+    /// \param[in] flags If present and not NULL, the referenced uint8_t will be set to the FLAGS
+    /// \return true if a valid message was received for this node
+    bool recvfromAckBorrow(uint8_t** buf, uint8_t* len, uint8_t* source = NULL, uint8_t* dest = NULL, uint8_t* id = NULL, uint8_t* flags = NULL);
+
     /// Starts the receiver if it is not running already.
     /// Similar to recvfromAck(), this will block until either a valid message available for this node
     /// or the timeout expires. 
@@ -292,17 +390,45 @@ protected:
     /// \param [in] messageLen Length of message in octets
     virtual void peekAtMessage(RoutedMessage* message, uint8_t messageLen);
 
+    /// Receives the next message, like recvfromAckBorrow(), but works with any driver.
+    /// If the driver can lend messages, the one returned is still in the driver, else it is received 
+    /// into _spare. Messages routed on to other nodes are copied into _spare first, if need be, 
+    /// so the driver is free to receive the acknowledgement from the next hop.
+    /// \param[out] buf Set to point at the application message payload
+    /// \param[out] len Set to the length of the payload
+    /// \param[in] source If not NULL, the referenced uint8_t will be set to the SOURCE address
+    /// \param[in] dest If not NULL, the referenced uint8_t will be set to the DEST address
+    /// \param[in] id If not NULL, the referenced uint8_t will be set to the ID
+    /// \param[in] flags If not NULL, the referenced uint8_t will be set to the FLAGS
+    /// \return true if a valid message was received for this node
+    bool recvfromAckInto(uint8_t** buf, uint8_t* len, uint8_t* source, uint8_t* dest, uint8_t* id, uint8_t* flags);
+
     /// Finds the next-hop route and sends the message via RHReliableDatagram::sendtoWait().
     /// This is virtual, which lets subclasses override or intercept the route() function.
     /// Called by sendtoWait after the message header has been filled in.
-    /// \param [in] message Pointer to the RHRouter message to be sent.
-    /// \param [in] messageLen Length of message in octets
-    virtual uint8_t route(RoutedMessage* message, uint8_t messageLen);
+    /// \param [in] header Pointer to the RHRouter header of the message to be sent.
+    /// \param [in] fragments The pieces of the application message that follow the header
+    /// \param [in] count Number of fragments, no more than RH_ROUTER_MAX_FRAGMENTS
+    virtual uint8_t route(RoutedMessageHeader* header, const RHGenericDriver::Fragment* fragments, uint8_t count);
+
+    /// Makes the route to a destination more costly after messages to it had to be retransmitted
+    /// \param [in] dest The destination node address
+    /// \param [in] retransmitted The number of retransmissions to the next hop
+    void addRetransmissionCost(uint8_t dest, uint32_t retransmitted);
 
     /// Deletes a specific rout entry from therouting table
     /// \param [in] index The 0 based index of the routing table entry to delete
     void deleteRoute(uint8_t index);
 
+    /// Finds the routing table entry for a destination node
+    /// \param [in] dest The destination node address
+    /// \return The index of the entry, or RH_ROUTE_NONE if there is none
+    uint8_t findRoute(uint8_t dest);
+
+    /// Moves a routing table entry to the most recently used end of the LRU list
+    /// \param [in] index The index of the entry, which must be in the list
+    void touchRoute(uint8_t index);
+
     /// The last end-to-end sequence number to be used
     /// Defaults to 0
     uint8_t _lastE2ESequenceNumber;
@@ -311,13 +437,27 @@ protected:
     /// If a routed message would exceed this number of hops it is dropped and ignored.
     uint8_t              _max_hops;
 
-private:
+    /// The one buffer for messages that cant be left in the driver: those received by a driver 
+    /// that cant lend them, and those being routed on to other nodes. Used by recvfromAckInto()
+    RoutedMessage        _spare;
 
-    /// Temporary mesage buffer
-    static RoutedMessage _tmpMessage;
+private:
 
     /// Local routing table
     RoutingTableEntry    _routes[RH_ROUTING_TABLE_SIZE];
+
+    /// Index of the first entry in each hash bucket
+    uint8_t              _routeHash[RH_ROUTING_HASH_SIZE];
+
+    /// Most and least recently used ends of the list of entries in use
+    uint8_t              _routeMru;
+    uint8_t              _routeLru;
+
+    /// First unused entry. The rest follow through hashNext
+    uint8_t              _routeFree;
+
+    /// Lifetime of routes in milliseconds, 0 for ever. See setRouteTimeout()
+    unsigned long        _routeTimeout;
 };
 
 /// @example rf22_router_client.pde
@@ -77,5 +77,26 @@ uint8_t RHSPIDriver::spiBurstWrite(uint8_t reg, const uint8_t* src, uint8_t len)
     return status;
 }
 
+uint8_t RHSPIDriver::spiBurstWriteFragments(uint8_t reg, const uint8_t* header, uint8_t headerLen, 
+					    const Fragment* fragments, uint8_t count)
+{
+    uint8_t status = 0;
+    ATOMIC_BLOCK_START;
+    digitalWrite(_slaveSelectPin, LOW);
+    status = _spi.transfer(reg | RH_SPI_WRITE_MASK); // Send the start address with the write mask on
+    while (headerLen--)
+	_spi.transfer(*header++);
+    for (uint8_t i = 0; i < count; i++)
+    {
+	const uint8_t* src = fragments[i].data;
+	uint8_t len = fragments[i].len;
+	while (len--)
+	    _spi.transfer(*src++);
+    }
+    digitalWrite(_slaveSelectPin, HIGH);
+    ATOMIC_BLOCK_END;
+    return status;
+}
+
 
 
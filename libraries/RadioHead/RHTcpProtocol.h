@@ -12,6 +12,10 @@
 #define RH_TCP_MESSAGE_TYPE_NOP               0
 #define RH_TCP_MESSAGE_TYPE_THISADDRESS       1
 #define RH_TCP_MESSAGE_TYPE_PACKET            2
+#define RH_TCP_MESSAGE_TYPE_SLEEP             3
+#define RH_TCP_MESSAGE_TYPE_TIME              4
+#define RH_TCP_MESSAGE_TYPE_RADIO             5
+#define RH_TCP_MESSAGE_TYPE_RSSI              6
 
 // Maximum message length (including the headers) we are willing to support
 #define RH_TCP_MAX_PAYLOAD_LEN 255
@@ -61,6 +65,52 @@ typedef struct
     uint8_t         payload[RH_TCP_MAX_MESSAGE_LEN]; ///< 0 or more, length deduced from length above
 }   RHTcpPacket;
 
+/// \brief RH_TCP message tells a virtual time ether simulator that this client has nothing to do
+/// until the given virtual time. The client waits for a RH_TCP_MESSAGE_TYPE_TIME message before continuing
+typedef struct
+{
+    uint32_t        length; ///< Number of octets following, in network byte order
+    uint8_t         type;   ///< == RH_TCP_MESSAGE_TYPE_SLEEP
+    uint64_t        until;  ///< Virtual time in microseconds to sleep until, in network byte order
+    uint8_t         flags;  ///< RH_TCP_SLEEP_FLAG_*. May be left out, and is then 0
+}   RHTcpSleep;
+
+/// RHTcpSleep flag: wake the client as soon as a packet is delivered to it, 
+/// instead of waiting until the time it asked for
+#define RH_TCP_SLEEP_FLAG_WAKE_ON_PACKET 0x01
+
+/// \brief RH_TCP message from a virtual time ether simulator, telling a sleeping client 
+/// the virtual time it has woken at
+typedef struct
+{
+    uint32_t        length; ///< Number of octets following, in network byte order
+    uint8_t         type;   ///< == RH_TCP_MESSAGE_TYPE_TIME
+    uint64_t        now;    ///< Current virtual time in microseconds, in network byte order
+}   RHTcpTime;
+
+/// \brief RH_TCP message tells the ether simulator the radio settings of this client.
+/// Clients only hear packets sent on the same channel at the same data rate,
+/// and overlapping transmissions on nearby channels collide unless one is much stronger.
+/// The ether simulator sends one back with the settings it will use, with its own data rate
+/// in place of 0, so the client knows how long its transmissions take
+typedef struct
+{
+    uint32_t        length;        ///< Number of octets following, in network byte order
+    uint8_t         type;          ///< == RH_TCP_MESSAGE_TYPE_RADIO
+    uint8_t         channel;       ///< Channel number
+    uint32_t        bitsPerSecond; ///< Data rate in network byte order. 0 for the ether simulator's default
+    int8_t          power;         ///< Transmit power in dBm
+}   RHTcpRadio;
+
+/// \brief RH_TCP message from the ether simulator, sent just before each RH_TCP_MESSAGE_TYPE_PACKET
+/// it delivers, with the power the packet was received at. RH_TCP reports it through lastRssi()
+typedef struct
+{
+    uint32_t        length; ///< Number of octets following, in network byte order
+    uint8_t         type;   ///< == RH_TCP_MESSAGE_TYPE_RSSI
+    int8_t          rssi;   ///< Received power in dBm
+}   RHTcpRssi;
+
 #pragma pack(pop)
 
 #endif
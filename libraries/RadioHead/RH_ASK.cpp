@@ -18,15 +18,97 @@ HardwareTimer timer(MAPLE_TIMER);
 // Interrupt handler uses this to find the most recently initialised instance of this driver
 static RH_ASK* thisASKDriver;
 
+// The symbol tables are read from the timer interrupt, so on AVR they live in program memory
+// to save RAM
+#if defined(__AVR__)
+ #include <avr/pgmspace.h>
+ #define RH_ASK_TABLE PROGMEM
+ #define RH_ASK_READ_BYTE(t, i) pgm_read_byte(&(t)[i])
+ #define RH_ASK_READ_WORD(t, i) pgm_read_word(&(t)[i])
+#else
+ #define RH_ASK_TABLE
+ #define RH_ASK_READ_BYTE(t, i) ((t)[i])
+ #define RH_ASK_READ_WORD(t, i) ((t)[i])
+#endif
+
+#ifdef RH_PLATFORM_ATTINY
 // 4 bit to 6 bit symbol converter table
 // Used to convert the high and low nybbles of the transmitted data
 // into 6 bit symbols for transmission. Each 6-bit symbol has 3 1s and 3 0s 
 // with at most 3 consecutive identical bits
-static uint8_t symbols[] =
+static const uint8_t symbols[] RH_ASK_TABLE =
 {
     0xd,  0xe,  0x13, 0x15, 0x16, 0x19, 0x1a, 0x1c, 
     0x23, 0x25, 0x26, 0x29, 0x2a, 0x2c, 0x32, 0x34
 };
+#else
+// Byte to 12 bit symbol pair converter table.
+// Entry n is the 6 bit symbol for the high nybble of n in the 6 lsbits, and the symbol for
+// the low nybble above it, in the order they are sent. Each 6-bit symbol has 3 1s and 3 0s
+// with at most 3 consecutive identical bits:
+// 0xd, 0xe, 0x13, 0x15, 0x16, 0x19, 0x1a, 0x1c, 0x23, 0x25, 0x26, 0x29, 0x2a, 0x2c, 0x32, 0x34
+// Too big for the ATtinys, which use the 16 entry nybble table instead
+static const uint16_t byte_symbols[256] RH_ASK_TABLE =
+{
+    0x34d, 0x38d, 0x4cd, 0x54d, 0x58d, 0x64d, 0x68d, 0x70d,
+    0x8cd, 0x94d, 0x98d, 0xa4d, 0xa8d, 0xb0d, 0xc8d, 0xd0d,
+    0x34e, 0x38e, 0x4ce, 0x54e, 0x58e, 0x64e, 0x68e, 0x70e,
+    0x8ce, 0x94e, 0x98e, 0xa4e, 0xa8e, 0xb0e, 0xc8e, 0xd0e,
+    0x353, 0x393, 0x4d3, 0x553, 0x593, 0x653, 0x693, 0x713,
+    0x8d3, 0x953, 0x993, 0xa53, 0xa93, 0xb13, 0xc93, 0xd13,
+    0x355, 0x395, 0x4d5, 0x555, 0x595, 0x655, 0x695, 0x715,
+    0x8d5, 0x955, 0x995, 0xa55, 0xa95, 0xb15, 0xc95, 0xd15,
+    0x356, 0x396, 0x4d6, 0x556, 0x596, 0x656, 0x696, 0x716,
+    0x8d6, 0x956, 0x996, 0xa56, 0xa96, 0xb16, 0xc96, 0xd16,
+    0x359, 0x399, 0x4d9, 0x559, 0x599, 0x659, 0x699, 0x719,
+    0x8d9, 0x959, 0x999, 0xa59, 0xa99, 0xb19, 0xc99, 0xd19,
+    0x35a, 0x39a, 0x4da, 0x55a, 0x59a, 0x65a, 0x69a, 0x71a,
+    0x8da, 0x95a, 0x99a, 0xa5a, 0xa9a, 0xb1a, 0xc9a, 0xd1a,
+    0x35c, 0x39c, 0x4dc, 0x55c, 0x59c, 0x65c, 0x69c, 0x71c,
+    0x8dc, 0x95c, 0x99c, 0xa5c, 0xa9c, 0xb1c, 0xc9c, 0xd1c,
+    0x363, 0x3a3, 0x4e3, 0x563, 0x5a3, 0x663, 0x6a3, 0x723,
+    0x8e3, 0x963, 0x9a3, 0xa63, 0xaa3, 0xb23, 0xca3, 0xd23,
+    0x365, 0x3a5, 0x4e5, 0x565, 0x5a5, 0x665, 0x6a5, 0x725,
+    0x8e5, 0x965, 0x9a5, 0xa65, 0xaa5, 0xb25, 0xca5, 0xd25,
+    0x366, 0x3a6, 0x4e6, 0x566, 0x5a6, 0x666, 0x6a6, 0x726,
+    0x8e6, 0x966, 0x9a6, 0xa66, 0xaa6, 0xb26, 0xca6, 0xd26,
+    0x369, 0x3a9, 0x4e9, 0x569, 0x5a9, 0x669, 0x6a9, 0x729,
+    0x8e9, 0x969, 0x9a9, 0xa69, 0xaa9, 0xb29, 0xca9, 0xd29,
+    0x36a, 0x3aa, 0x4ea, 0x56a, 0x5aa, 0x66a, 0x6aa, 0x72a,
+    0x8ea, 0x96a, 0x9aa, 0xa6a, 0xaaa, 0xb2a, 0xcaa, 0xd2a,
+    0x36c, 0x3ac, 0x4ec, 0x56c, 0x5ac, 0x66c, 0x6ac, 0x72c,
+    0x8ec, 0x96c, 0x9ac, 0xa6c, 0xaac, 0xb2c, 0xcac, 0xd2c,
+    0x372, 0x3b2, 0x4f2, 0x572, 0x5b2, 0x672, 0x6b2, 0x732,
+    0x8f2, 0x972, 0x9b2, 0xa72, 0xab2, 0xb32, 0xcb2, 0xd32,
+    0x374, 0x3b4, 0x4f4, 0x574, 0x5b4, 0x674, 0x6b4, 0x734,
+    0x8f4, 0x974, 0x9b4, 0xa74, 0xab4, 0xb34, 0xcb4, 0xd34
+};
+#endif
+
+// 6 bit symbol to 4 bit nybble converter table, the reverse of the above.
+// Invalid symbols decode as 0, and the message will fail its FCS check
+static const uint8_t symbol_nybbles[64] RH_ASK_TABLE =
+{
+    0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x1, 0x0,
+    0x0, 0x0, 0x0, 0x2, 0x0, 0x3, 0x4, 0x0, 0x0, 0x5, 0x6, 0x0, 0x7, 0x0, 0x0, 0x0,
+    0x0, 0x0, 0x0, 0x8, 0x0, 0x9, 0xa, 0x0, 0x0, 0xb, 0xc, 0x0, 0xd, 0x0, 0x0, 0x0,
+    0x0, 0x0, 0xe, 0x0, 0xf, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0
+};
+
+// Encode a byte into 2 6-bit symbols, high nybble first, low nybble second.
+// Returns the position after them
+static uint8_t* encodeByte(uint8_t* p, uint8_t b)
+{
+#ifdef RH_PLATFORM_ATTINY
+    *p++ = RH_ASK_READ_BYTE(symbols, b >> 4);
+    *p++ = RH_ASK_READ_BYTE(symbols, b & 0xf);
+#else
+    uint16_t s = RH_ASK_READ_WORD(byte_symbols, b);
+    *p++ = s & 0x3f;
+    *p++ = s >> 6;
+#endif
+    return p;
+}
 
 // This is the value of the start symbol after 6-bit conversion and nybble swapping
 #define RH_ASK_START_SYMBOL 0xb38
@@ -371,12 +453,18 @@ bool RH_ASK::recv(uint8_t* buf, uint8_t* len)
 
 // Caution: this may block
 bool RH_ASK::send(const uint8_t* data, uint8_t len)
+{
+    Fragment fragment = { data, len };
+    return sendFragments(&fragment, 1);
+}
+
+// Caution: this may block
+bool RH_ASK::sendFragments(const Fragment* fragments, uint8_t count)
 {
     uint8_t i;
-    uint16_t index = 0;
     uint16_t crc = 0xffff;
     uint8_t *p = _txBuf + RH_ASK_PREAMBLE_LEN; // start of the message area
-    uint8_t count = len + 3 + RH_ASK_HEADER_LEN; // Added byte count and FCS and headers to get total number of bytes
+    uint16_t len = fragmentsLen(fragments, count);
 
     if (len > RH_ASK_MAX_MESSAGE_LEN)
 	return false;
@@ -384,45 +472,38 @@ bool RH_ASK::send(const uint8_t* data, uint8_t len)
     // Wait for transmitter to become available
     waitPacketSent();
 
-    // Encode the message length
-    crc = RHcrc_ccitt_update(crc, count);
-    p[index++] = symbols[count >> 4];
-    p[index++] = symbols[count & 0xf];
-
-    // Encode the headers
-    crc = RHcrc_ccitt_update(crc, _txHeaderTo);
-    p[index++] = symbols[_txHeaderTo >> 4];
-    p[index++] = symbols[_txHeaderTo & 0xf];
-    crc = RHcrc_ccitt_update(crc, _txHeaderFrom);
-    p[index++] = symbols[_txHeaderFrom >> 4];
-    p[index++] = symbols[_txHeaderFrom & 0xf];
-    crc = RHcrc_ccitt_update(crc, _txHeaderId);
-    p[index++] = symbols[_txHeaderId >> 4];
-    p[index++] = symbols[_txHeaderId & 0xf];
-    crc = RHcrc_ccitt_update(crc, _txHeaderFlags);
-    p[index++] = symbols[_txHeaderFlags >> 4];
-    p[index++] = symbols[_txHeaderFlags & 0xf];
+    // The byte count and headers, in the order they are sent
+    // Added byte count and FCS and headers to get total number of bytes
+    uint8_t header[RH_ASK_HEADER_LEN + 1] = { (uint8_t)(len + 3 + RH_ASK_HEADER_LEN), 
+					      _txHeaderTo, _txHeaderFrom, _txHeaderId, _txHeaderFlags };
+
+    // The CRC covers the byte count, headers and user data
+    crc = RHcrc_ccitt_buf(crc, header, sizeof(header));
+    for (i = 0; i < count; i++)
+	crc = RHcrc_ccitt_buf(crc, fragments[i].data, fragments[i].len);
+
+    // Encode the byte count and headers
+    for (i = 0; i < sizeof(header); i++)
+	p = encodeByte(p, header[i]);
 
     // Encode the message into 6 bit symbols. Each byte is converted into 
     // 2 6-bit symbols, high nybble first, low nybble second
-    for (i = 0; i < len; i++)
+    for (i = 0; i < count; i++)
     {
-	crc = RHcrc_ccitt_update(crc, data[i]);
-	p[index++] = symbols[data[i] >> 4];
-	p[index++] = symbols[data[i] & 0xf];
+	const uint8_t* data = fragments[i].data;
+	for (uint8_t j = 0; j < fragments[i].len; j++)
+	    p = encodeByte(p, data[j]);
     }
 
     // Append the fcs, 16 bits before encoding (4 6-bit symbols after encoding)
     // Caution: VW expects the _ones_complement_ of the CCITT CRC-16 as the FCS
     // VW sends FCS as low byte then hi byte
     crc = ~crc;
-    p[index++] = symbols[(crc >> 4)  & 0xf];
-    p[index++] = symbols[crc & 0xf];
-    p[index++] = symbols[(crc >> 12) & 0xf];
-    p[index++] = symbols[(crc >> 8)  & 0xf];
+    p = encodeByte(p, crc & 0xff);
+    p = encodeByte(p, crc >> 8);
 
     // Total number of 6-bit symbols to send
-    _txBufLen = index + RH_ASK_PREAMBLE_LEN;
+    _txBufLen = p - _txBuf;
 
     // Start the low level interrupt handler sending symbols
     setModeTx();
@@ -541,18 +622,8 @@ void __ISR(_TIMER_1_VECTOR, ipl1) timerInterrupt(void)
 // Convert a 6 bit encoded symbol into its 4 bit decoded equivalent
 uint8_t RH_ASK::symbol_6to4(uint8_t symbol)
 {
-    uint8_t i;
-    uint8_t count;
-    
-    // Linear search :-( Could have a 64 byte reverse lookup table?
-    // There is a little speedup here courtesy Ralph Doncaster:
-    // The shortcut works because bit 5 of the symbol is 1 for the last 8
-    // symbols, and it is 0 for the first 8.
-    // So we only have to search half the table
-    for (i = (symbol>>2) & 8, count=8; count-- ; i++)
-	if (symbol == symbols[i]) return i;
-
-    return 0; // Not found
+    // Direct lookup, so the cost in the timer interrupt is the same for every symbol
+    return RH_ASK_READ_BYTE(symbol_nybbles, symbol);
 }
 
 // Check whether the latest received message is complete and uncorrupted
@@ -560,10 +631,8 @@ uint8_t RH_ASK::symbol_6to4(uint8_t symbol)
 // since it is slow
 void RH_ASK::validateRxBuf()
 {
-    uint16_t crc = 0xffff;
     // The CRC covers the byte count, headers and user data
-    for (uint8_t i = 0; i < _rxBufLen; i++)
-	crc = RHcrc_ccitt_update(crc, _rxBuf[i]);
+    uint16_t crc = RHcrc_ccitt_buf(0xffff, _rxBuf, _rxBufLen);
     if (crc != 0xf0b8) // CRC when buffer and expected CRC are CRC'd
     {
 	// Reject and drop the message
@@ -236,6 +236,13 @@ public:
     /// \return true if the message length was valid and it was correctly queued for transmit
     virtual bool    send(const uint8_t* data, uint8_t len);
 
+    /// Like send(), but the message is in several fragments, which are encoded straight
+    /// from where they are. See RHGenericDriver::sendFragments()
+    /// \param[in] fragments The pieces of the message, in order
+    /// \param[in] count Number of fragments
+    /// \return true if the message length was valid and it was correctly queued for transmit
+    virtual bool    sendFragments(const Fragment* fragments, uint8_t count);
+
     /// Returns the maximum message length 
     /// available in this Driver.
     /// \return The maximum legal message length
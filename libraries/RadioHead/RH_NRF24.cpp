@@ -5,11 +5,26 @@
 
 #include <RH_NRF24.h>
 
-RH_NRF24::RH_NRF24(uint8_t chipEnablePin, uint8_t slaveSelectPin, RHGenericSPI& spi)
+// Interrupt vectors for the 3 Arduino interrupt pins
+// Each interrupt can be handled by a different instance of RH_NRF24, allowing you to have
+// 2 or more NRF24s per Arduino
+RH_NRF24* RH_NRF24::_deviceForInterrupt[RH_NRF24_NUM_INTERRUPTS] = {0, 0, 0};
+uint8_t RH_NRF24::_interruptCount = 0; // Index into _deviceForInterrupt for next device
+
+RH_NRF24::RH_NRF24(uint8_t chipEnablePin, uint8_t slaveSelectPin, RHGenericSPI& spi, uint8_t interruptPin)
     :
     RHNRFSPIDriver(slaveSelectPin, spi),
-    _rxBufValid(0)
+    _interruptPin(interruptPin),
+    _txFailed(false),
+    _rxFifoPending(false),
+    _networkAddressLen(5),
+    _nodeAddressing(false),
+    _hardwareAck(false),
+    _txNode(RH_BROADCAST_ADDRESS),
+    _extraAddressCount(0)
 {
+    memset(_networkAddress, 0xe7, sizeof(_networkAddress)); // Chip default
+    rxQueueInit(&_rxQueueBuf[0][0], RH_NRF24_RX_QUEUE_LEN, sizeof(_rxQueueBuf[0]));
     _configuration = RH_NRF24_EN_CRC | RH_NRF24_CRCO; // Default: 2 byte CRC enabled
     _chipEnablePin = chipEnablePin;
 }
@@ -22,6 +37,16 @@ bool RH_NRF24::init()
     if (!RHNRFSPIDriver::init())
 	return false;
 
+    // Determine the interrupt number that corresponds to the interruptPin
+    int interruptNumber = NOT_AN_INTERRUPT;
+    if (_interruptPin != RH_NRF24_NO_INTERRUPT)
+    {
+	interruptNumber = digitalPinToInterrupt(_interruptPin);
+	if (interruptNumber == NOT_AN_INTERRUPT)
+	    return false;
+	pinMode(_interruptPin, INPUT);
+    }
+
     // Initialise the slave select pin
     pinMode(_chipEnablePin, OUTPUT);
     digitalWrite(_chipEnablePin, LOW);
@@ -53,9 +78,68 @@ bool RH_NRF24::init()
     setChannel(2); // The default, in case it was set by another app without powering down
     setRF(RH_NRF24::DataRate2Mbps, RH_NRF24::TransmitPower0dBm);
 
+    if (interruptNumber != NOT_AN_INTERRUPT)
+    {
+	// Set up interrupt handler. The IRQ output is active low, and _configuration leaves
+	// RX_DR, TX_DS and MAX_RT all unmasked
+	// Since there are a limited number of interrupt glue functions isr*() available,
+	// we can only support a limited number of devices simultaneously
+	_deviceForInterrupt[_interruptCount] = this;
+	if (_interruptCount == 0)
+	    attachInterrupt(interruptNumber, isr0, FALLING);
+	else if (_interruptCount == 1)
+	    attachInterrupt(interruptNumber, isr1, FALLING);
+	else if (_interruptCount == 2)
+	    attachInterrupt(interruptNumber, isr2, FALLING);
+	else
+	    return false; // Too many devices, not enough interrupt vectors
+	_interruptCount++;
+    }
+
     return true;
 }
 
+// These are low level functions that call the interrupt handler for the correct
+// instance of RH_NRF24.
+// 3 interrupts allows us to have 3 different devices
+void RH_NRF24::isr0()
+{
+    if (_deviceForInterrupt[0])
+	_deviceForInterrupt[0]->handleInterrupt();
+}
+void RH_NRF24::isr1()
+{
+    if (_deviceForInterrupt[1])
+	_deviceForInterrupt[1]->handleInterrupt();
+}
+void RH_NRF24::isr2()
+{
+    if (_deviceForInterrupt[2])
+	_deviceForInterrupt[2]->handleInterrupt();
+}
+
+// C++ level interrupt handler for this instance
+// The IRQ pin stays low while any of RX_DR, TX_DS or MAX_RT is set, so keep going until
+// they are all clear, else there will be no falling edge for the next event
+void RH_NRF24::handleInterrupt()
+{
+    uint8_t status;
+    while ((status = statusRead()) & (RH_NRF24_RX_DR | RH_NRF24_TX_DS | RH_NRF24_MAX_RT))
+    {
+	if (status & RH_NRF24_RX_DR)
+	    readRxFifo();
+	if (status & RH_NRF24_MAX_RT)
+	    finishTx(status);
+	else if (status & RH_NRF24_TX_DS)
+	{
+	    // Data Sent is set as each message in the TX FIFO goes
+	    spiWriteRegister(RH_NRF24_REG_07_STATUS, RH_NRF24_TX_DS);
+	    if (spiReadRegister(RH_NRF24_REG_17_FIFO_STATUS) & RH_NRF24_TX_EMPTY)
+		finishTx(status); // That was the last one
+	}
+    }
+}
+
 // Use the register commands to read and write the registers
 uint8_t RH_NRF24::spiReadRegister(uint8_t reg)
 {
@@ -110,13 +194,107 @@ bool RH_NRF24::setNetworkAddress(uint8_t* address, uint8_t len)
     if (len < 3 || len > 5)
 	return false;
 
+    memcpy(_networkAddress, address, len);
+    _networkAddressLen = len;
     // Set both TX_ADDR and RX_ADDR_P0 for auto-ack with Enhanced shockwave
     spiWriteRegister(RH_NRF24_REG_03_SETUP_AW, len-2);	// Mapping [3..5] = [1..3]
+    if (_nodeAddressing)
+    {
+	// The node addresses are derived from the network address
+	writeNodeAddress(RH_NRF24_REG_0B_RX_ADDR_P1, _thisAddress);
+	writeNodeAddress(RH_NRF24_REG_0A_RX_ADDR_P0, _txNode);
+	writeNodeAddress(RH_NRF24_REG_10_TX_ADDR, _txNode);
+	return true;
+    }
     spiBurstWriteRegister(RH_NRF24_REG_0A_RX_ADDR_P0, address, len);
     spiBurstWriteRegister(RH_NRF24_REG_10_TX_ADDR, address, len);
     return true;
 }
 
+bool RH_NRF24::setNodeAddressing(bool enable)
+{
+    // Any messages still being sent were addressed for the old mode
+    waitPacketSent();
+    _nodeAddressing = enable;
+    if (enable)
+    {
+	// Pipe 1 for this node, pipe 2 for broadcasts, pipes 3 to 5 for the extra addresses.
+	// Only the first octet of the pipe 2 to 5 addresses is settable, the rest is shared with pipe 1
+	writeNodeAddress(RH_NRF24_REG_0B_RX_ADDR_P1, _thisAddress);
+	spiWriteRegister(RH_NRF24_REG_0C_RX_ADDR_P2, RH_BROADCAST_ADDRESS);
+	for (uint8_t i = 0; i < _extraAddressCount; i++)
+	    spiWriteRegister(RH_NRF24_REG_0D_RX_ADDR_P3 + i, _extraAddresses[i]);
+	spiWriteRegister(RH_NRF24_REG_02_EN_RXADDR, rxPipes());
+	if (_hardwareAck)
+	    spiWriteRegister(RH_NRF24_REG_01_EN_AA, RH_NRF24_ENAA_P0 | rxPipes());
+	_txNode = RH_BROADCAST_ADDRESS;
+	writeNodeAddress(RH_NRF24_REG_10_TX_ADDR, _txNode);
+    }
+    else
+    {
+	// Back to the network address on pipe 0, as after init()
+	_hardwareAck = false;
+	spiWriteRegister(RH_NRF24_REG_04_SETUP_RETR, 0);
+	spiWriteRegister(RH_NRF24_REG_02_EN_RXADDR, RH_NRF24_ERX_P0 | RH_NRF24_ERX_P1);
+	spiBurstWriteRegister(RH_NRF24_REG_0A_RX_ADDR_P0, _networkAddress, _networkAddressLen);
+	spiBurstWriteRegister(RH_NRF24_REG_10_TX_ADDR, _networkAddress, _networkAddressLen);
+    }
+    return true;
+}
+
+bool RH_NRF24::setExtraAddresses(const uint8_t* addresses, uint8_t count)
+{
+    if (count > RH_NRF24_MAX_EXTRA_ADDRESSES)
+	return false;
+    memcpy(_extraAddresses, addresses, count);
+    _extraAddressCount = count;
+    if (_nodeAddressing)
+	return setNodeAddressing(true);
+    return true;
+}
+
+bool RH_NRF24::setHardwareAck(bool enable, uint8_t retries, uint16_t retryDelay)
+{
+    if (retries > 15 || retryDelay < 250 || retryDelay > 4000)
+	return false;
+    // Only the addressed node may acknowledge, so each needs its own address
+    if (enable && !_nodeAddressing)
+	setNodeAddressing(true);
+    waitPacketSent();
+    _hardwareAck = enable;
+    // Pipe 0 receives the ACKs, and is enabled only while transmitting. The EN_AA bits match EN_RXADDR.
+    // Broadcasts are sent without asking for an ACK, so pipe 2 never acknowledges
+    spiWriteRegister(RH_NRF24_REG_01_EN_AA, enable ? (RH_NRF24_ENAA_P0 | rxPipes()) : 0);
+    spiWriteRegister(RH_NRF24_REG_04_SETUP_RETR, enable ? ((((retryDelay / 250) - 1) << 4) | retries) : 0);
+    return true;
+}
+
+bool RH_NRF24::hasHardwareAck()
+{
+    return _hardwareAck;
+}
+
+void RH_NRF24::setThisAddress(uint8_t address)
+{
+    RHNRFSPIDriver::setThisAddress(address);
+    if (_nodeAddressing)
+	writeNodeAddress(RH_NRF24_REG_0B_RX_ADDR_P1, address);
+}
+
+uint8_t RH_NRF24::rxPipes()
+{
+    // Pipes 3 to 5 follow pipe 2 in EN_RXADDR
+    return RH_NRF24_ERX_P1 | RH_NRF24_ERX_P2 | (((1 << _extraAddressCount) - 1) * RH_NRF24_ERX_P3);
+}
+
+void RH_NRF24::writeNodeAddress(uint8_t reg, uint8_t node)
+{
+    uint8_t address[5];
+    memcpy(address, _networkAddress, _networkAddressLen);
+    address[0] = node;
+    spiBurstWriteRegister(reg, address, _networkAddressLen);
+}
+
 bool RH_NRF24::setRF(DataRate data_rate, TransmitPower power)
 {
     uint8_t value = (power << 1) & RH_NRF24_PWR;
@@ -180,47 +358,132 @@ void RH_NRF24::setModeTx()
 
 bool RH_NRF24::send(const uint8_t* data, uint8_t len)
 {
-    if (len > RH_NRF24_MAX_MESSAGE_LEN)
+    Fragment fragment = { data, len };
+    return sendFragments(&fragment, 1);
+}
+
+bool RH_NRF24::sendFragments(const Fragment* fragments, uint8_t count)
+{
+    if (fragmentsLen(fragments, count) > RH_NRF24_MAX_MESSAGE_LEN)
 	return false;
-    // Set up the headers
-    _buf[0] = _txHeaderTo;
-    _buf[1] = _txHeaderFrom;
-    _buf[2] = _txHeaderId;
-    _buf[3] = _txHeaderFlags;
-    memcpy(_buf+RH_NRF24_HEADER_LEN, data, len);
+    if (_nodeAddressing && _txHeaderTo != _txNode)
+    {
+	// Messages already in the TX FIFO must go to the old address. If they failed, the 
+	// caller's waitPacketSent() after this message still has to say so
+	if (_mode == RHModeTx && !waitPacketSent())
+	    _txFailed = true;
+	_txNode = _txHeaderTo;
+	writeNodeAddress(RH_NRF24_REG_10_TX_ADDR, _txNode);
+	if (_hardwareAck && _txNode != RH_BROADCAST_ADDRESS)
+	    writeNodeAddress(RH_NRF24_REG_0A_RX_ADDR_P0, _txNode); // To receive the ACK
+    }
+    if (_mode == RHModeTx)
+    {
+	// Still sending earlier messages. Queue this one behind them in the TX FIFO, 
+	// which holds 3, so the radio goes straight on to it without a mode change
+	uint8_t status;
+	while ((status = statusRead()) & RH_NRF24_STATUS_TX_FULL)
+	{
+	    // The interrupt handler deals with MAX_RT itself
+	    if (_interruptPin == RH_NRF24_NO_INTERRUPT && (status & RH_NRF24_MAX_RT))
+	    {
+		// Must clear RH_NRF24_MAX_RT, else no further comm
+		spiWriteRegister(RH_NRF24_REG_07_STATUS, RH_NRF24_MAX_RT);
+		// The messages in the TX FIFO are lost, so the burst has failed
+		flushTx();
+		_txFailed = true;
+	    }
+	    YIELD;
+	}
+    }
+    // Don't let the interrupt handler end the burst between our looking at the mode and 
+    // putting the message in the TX FIFO
+    ATOMIC_BLOCK_START;
+    if (_mode != RHModeTx)
+    {
+	// Clear the flags from any previous transmission. _txFailed is left for waitPacketSent() 
+	// to report, in case the interrupt handler ended a burst that nobody waited for
+	spiWriteRegister(RH_NRF24_REG_07_STATUS, RH_NRF24_TX_DS | RH_NRF24_MAX_RT);
+	if (_hardwareAck && _txNode != RH_BROADCAST_ADDRESS)
+	    spiWriteRegister(RH_NRF24_REG_02_EN_RXADDR, rxPipes() | RH_NRF24_ERX_P0);
+    }
+    // Set up the headers. The fragments follow them in the same burst
+    uint8_t headers[RH_NRF24_HEADER_LEN] = { _txHeaderTo, _txHeaderFrom, _txHeaderId, _txHeaderFlags };
     setModeTx();
-    spiBurstWrite(RH_NRF24_COMMAND_W_TX_PAYLOAD_NOACK, _buf, len + RH_NRF24_HEADER_LEN);
+    // Broadcasts are never acknowledged
+    if (_hardwareAck && _txNode != RH_BROADCAST_ADDRESS)
+	spiBurstWriteFragments(RH_NRF24_COMMAND_W_TX_PAYLOAD, headers, RH_NRF24_HEADER_LEN, fragments, count);
+    else
+	spiBurstWriteFragments(RH_NRF24_COMMAND_W_TX_PAYLOAD_NOACK, headers, RH_NRF24_HEADER_LEN, fragments, count);
     // Radio will return to Standby II mode after transmission is complete
     _txGood++;
+    ATOMIC_BLOCK_END;
     return true;
 }
 
 bool RH_NRF24::waitPacketSent()
 {
+    if (_interruptPin != RH_NRF24_NO_INTERRUPT)
+    {
+	// The interrupt handler ends the transmission, and may already have done so
+	while (_mode == RHModeTx)
+	    YIELD;
+	return txResult();
+    }
+
     // If we are not currently in transmit mode, there is no packet to wait for
     if (_mode != RHModeTx)
 	return false;
 
     // Wait for either the Data Sent or Max ReTries flag, signalling the 
-    // end of transmission
-    // We dont actually use auto-ack, so prob dont expect to see RH_NRF24_MAX_RT
+    // end of transmission. Data Sent is set as each message in the TX FIFO goes,
+    // so carry on until the FIFO is empty
+    // In hardware acknowledgement mode, Data Sent means it was acknowledged, and Max ReTries that it was not
     uint8_t status;
-    while (!((status = statusRead()) & (RH_NRF24_TX_DS | RH_NRF24_MAX_RT)))
+    while (!((status = statusRead()) & RH_NRF24_MAX_RT))
+    {
+	if (status & RH_NRF24_TX_DS)
+	{
+	    spiWriteRegister(RH_NRF24_REG_07_STATUS, RH_NRF24_TX_DS);
+	    if (spiReadRegister(RH_NRF24_REG_17_FIFO_STATUS) & RH_NRF24_TX_EMPTY)
+		break; // That was the last one
+	}
 	YIELD;
+    }
+    finishTx(status);
+    // Return true if data sent, false if MAX_RT
+    return txResult();
+}
 
+bool RH_NRF24::txResult()
+{
+    // Reported once, so the next burst starts afresh
+    bool ok = !_txFailed;
+    _txFailed = false;
+    return ok;
+}
+
+void RH_NRF24::finishTx(uint8_t status)
+{
     // Must clear RH_NRF24_MAX_RT if it is set, else no further comm
     spiWriteRegister(RH_NRF24_REG_07_STATUS, RH_NRF24_TX_DS | RH_NRF24_MAX_RT);
     if (status & RH_NRF24_MAX_RT)
+    {
+	// Give up on the rest of the burst
 	flushTx();
+	_txFailed = true;
+    }
+    if (_hardwareAck)
+	// Stop pipe 0 receiving and acknowledging messages to the node we just sent to
+	spiWriteRegister(RH_NRF24_REG_02_EN_RXADDR, rxPipes());
     setModeIdle();
-    // Return true if data sent, false if MAX_RT
-    return status & RH_NRF24_TX_DS;
 }
 
 bool RH_NRF24::isSending()
 {
     return !(spiReadRegister(RH_NRF24_REG_00_CONFIG) & RH_NRF24_PRIM_RX) && 
-	   !(statusRead() & (RH_NRF24_TX_DS | RH_NRF24_MAX_RT));
+	   !(statusRead() & RH_NRF24_MAX_RT) &&
+	   !(spiReadRegister(RH_NRF24_REG_17_FIFO_STATUS) & RH_NRF24_TX_EMPTY);
 }
 
 bool RH_NRF24::printRegisters()
@@ -253,75 +516,82 @@ bool RH_NRF24::printRegisters()
     return true;
 }
 
-// Check whether the latest received message is complete and uncorrupted
-void RH_NRF24::validateRxBuf()
+// Check whether a received message is complete and addressed to us
+bool RH_NRF24::validateRxBuf(const uint8_t* buf, uint8_t len)
 {
-    if (_bufLen < 4)
-	return; // Too short to be a real message
-    // Extract the 4 headers
-    _rxHeaderTo    = _buf[0];
-    _rxHeaderFrom  = _buf[1];
-    _rxHeaderId    = _buf[2];
-    _rxHeaderFlags = _buf[3];
-    if (_promiscuous ||
-	_rxHeaderTo == _thisAddress ||
-	_rxHeaderTo == RH_BROADCAST_ADDRESS)
+    if (len < RH_NRF24_HEADER_LEN)
+	return false; // Too short to be a real message
+    // With node addressing, the radio has already discarded messages for other nodes.
+    // Otherwise the TO header is first
+    if (_nodeAddressing ||
+	_promiscuous ||
+	buf[0] == _thisAddress ||
+	buf[0] == RH_BROADCAST_ADDRESS)
     {
 	_rxGood++;
-	_rxBufValid = true;
+	return true;
     }
+    return false;
 }
 
-bool RH_NRF24::available()
+// Move everything in the radio's RX FIFO to our receive queue, 
+// so the radio has room for more while the application works on what it has
+void RH_NRF24::readRxFifo()
 {
-    if (!_rxBufValid)
+    // Clear read interrupt. Any message arriving from now on sets it again
+    spiWriteRegister(RH_NRF24_REG_07_STATUS, RH_NRF24_RX_DR);
+    _rxFifoPending = false;
+    while (!(spiReadRegister(RH_NRF24_REG_17_FIFO_STATUS) & RH_NRF24_RX_EMPTY))
     {
-	if (_mode == RHModeTx)
-	    return false;
-	setModeRx();
-	if (spiReadRegister(RH_NRF24_REG_17_FIFO_STATUS) & RH_NRF24_RX_EMPTY)
-	    return false;
+	uint8_t* slot = rxQueueSlot();
+	if (!slot)
+	{
+	    // The radio keeps receiving into its FIFO until that is full too
+	    _rxFifoPending = true;
+	    return;
+	}
 	// Manual says that messages > 32 octets should be discarded
 	uint8_t len = spiRead(RH_NRF24_COMMAND_R_RX_PL_WID);
 	if (len > 32)
 	{
 	    flushRx();
-	    clearRxBuf();
-	    setModeIdle();
-	    return false;
+	    return;
 	}
-	// Clear read interrupt
-	spiWriteRegister(RH_NRF24_REG_07_STATUS, RH_NRF24_RX_DR);
-	// Get the message into the RX buffer, so we can inspect the headers
-	spiBurstRead(RH_NRF24_COMMAND_R_RX_PAYLOAD, _buf, len);
-	_bufLen = len;
+	// Get the message into the queue, so we can inspect the headers
 	// 140 microsecs (32 octet payload)
-	validateRxBuf(); 
-	if (_rxBufValid)
-	    setModeIdle(); // Got one
+	spiBurstRead(RH_NRF24_COMMAND_R_RX_PAYLOAD, slot, len);
+	if (validateRxBuf(slot, len))
+	    rxQueuePush(len);
     }
-    return _rxBufValid;
 }
 
-void RH_NRF24::clearRxBuf()
+bool RH_NRF24::available()
 {
-    _rxBufValid = false;
-    _bufLen = 0;
+    if (_interruptPin != RH_NRF24_NO_INTERRUPT)
+    {
+	// The interrupt handler fills the receive queue, unless it was full
+	if (_rxFifoPending)
+	{
+	    ATOMIC_BLOCK_START;
+	    readRxFifo();
+	    ATOMIC_BLOCK_END;
+	}
+	if (_mode != RHModeTx)
+	    setModeRx(); // No SPI unless the mode changes
+    }
+    else if (_mode != RHModeTx)
+    {
+	setModeRx();
+	readRxFifo();
+    }
+    return rxQueuePeek();
 }
 
 bool RH_NRF24::recv(uint8_t* buf, uint8_t* len)
 {
     if (!available())
 	return false;
-    if (buf && len)
-    {
-	// Skip the 4 headers that are at the beginning of the rxBuf
-	if (*len > _bufLen-RH_NRF24_HEADER_LEN)
-	    *len = _bufLen-RH_NRF24_HEADER_LEN;
-	memcpy(buf, _buf+RH_NRF24_HEADER_LEN, *len);
-    }
-    clearRxBuf(); // This message accepted and cleared
-    return true;
+    return rxQueuePop(buf, len); // This message accepted and removed
 }
 
 uint8_t RH_NRF24::maxMessageLength()
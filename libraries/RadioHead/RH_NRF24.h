@@ -22,6 +22,30 @@
 // the supported message lengths in the nRF24
 #define RH_NRF24_MAX_MESSAGE_LEN (RH_NRF24_MAX_PAYLOAD_LEN-RH_NRF24_HEADER_LEN)
 
+// Default delay between hardware retransmissions in hardware acknowledgement mode, in microseconds.
+// See setHardwareAck()
+#ifndef RH_NRF24_DEFAULT_RETRY_DELAY
+ #define RH_NRF24_DEFAULT_RETRY_DELAY 750
+#endif
+
+// The number of node addresses that can be received with setExtraAddresses(), 
+// in addition to this node's address and broadcasts. One per spare RX pipe
+#define RH_NRF24_MAX_EXTRA_ADDRESSES 3
+
+// The number of received messages that can be held until the application collects them with recv(), 
+// in addition to the 3 in the radio's own FIFO. Must be a power of 2
+#ifndef RH_NRF24_RX_QUEUE_LEN
+ #define RH_NRF24_RX_QUEUE_LEN 4
+#endif
+
+// The interruptPin to pass to the constructor when the IRQ pin is not connected.
+// The driver then polls the radio's status over SPI
+#define RH_NRF24_NO_INTERRUPT 0xff
+
+// This is the maximum number of interrupts the driver can support
+// Most Arduinos can handle 2, Megas can handle more
+#define RH_NRF24_NUM_INTERRUPTS 3
+
 // SPI Command names
 #define RH_NRF24_COMMAND_R_REGISTER                        0x00
 #define RH_NRF24_COMMAND_W_REGISTER                        0x20
@@ -170,10 +194,50 @@
 /// of arbitrary length to 28 octets per packet. Use one of the Manager classes to get addressing and 
 /// acknowledgement reliability, routing, meshes etc.
 ///
+/// \par Burst transmission and reception
+///
+/// The nRF24 has 3 deep TX and RX FIFOs. send() does not wait for the previous message to be transmitted,
+/// but queues the new one in the TX FIFO, so several messages sent in a row go out back to back without
+/// the radio changing mode in between. available() moves everything in the RX FIFO to a receive queue
+/// (see RH_NRF24_RX_QUEUE_LEN) in one go, and leaves the receiver running.
+///
 /// The nRF24 transceiver is configured to use Enhanced Shockburst with no acknowledgement and no retransmits.
 /// TX_ADDR and RX_ADDR_P0 are set to the network address. If you need the low level auto-acknowledgement
-/// feature supported by this chip, you can use our original NRF24 library 
-/// at http://www.airspayce.com/mikem/arduino/NRF24
+/// feature supported by this chip, see setHardwareAck() below.
+///
+/// \par Interrupts
+///
+/// By default the IRQ pin is not used, and the driver polls the radio's STATUS register over SPI 
+/// whenever available(), send() or waitPacketSent() need to know what the radio is doing. If the IRQ pin 
+/// is connected to an interrupt capable Arduino pin and passed to the constructor, the driver works like 
+/// RH_RF22: an interrupt handler reads each message into the receive queue as soon as it arrives, and 
+/// finishes transmissions, so available() only has to look at the receive queue, and the SPI bus is left 
+/// alone while there is nothing to do. The interrupt handler uses SPI, so if you have other SPI devices 
+/// that use interrupts, see the SPI Interface section in RH_RF22.
+/// Up to RH_NRF24_NUM_INTERRUPTS instances can use interrupts.
+///
+/// \par Node addressing
+///
+/// Normally all nodes share the network address, so every node's radio receives every message, and the 
+/// driver discards those not addressed to it after reading them. setNodeAddressing() instead gives each node 
+/// its own radio address, so that the radio discards messages for other nodes itself, without waking the 
+/// processor or using the SPI bus: the network address with its least significant (first) octet replaced
+/// by the RadioHead node address. The nRF24 has 6 receive pipes. Pipe 1 receives messages to this node, 
+/// pipe 2 receives broadcasts, and pipes 3 to 5 can receive messages to up to 3 more node addresses 
+/// (see setExtraAddresses()). send() points TX_ADDR at the TO header of each message.
+/// Promiscuous mode then sees only messages to these addresses. All nodes that talk to each other
+/// must use the same mode.
+///
+/// \par Hardware acknowledgement
+///
+/// setHardwareAck() turns on the Enhanced Shockburst automatic acknowledgement and retransmission, so
+/// the radios exchange ACKs without the processor being involved. RHReliableDatagram detects this 
+/// (see RHGenericDriver::hasHardwareAck()) and does not send or wait for its own ACK messages, which saves 
+/// a whole software transmit turnaround per message. All nodes that talk to each other must use the same mode.
+/// It needs node addressing, so that only the intended recipient acknowledges, and turns it on.
+/// Broadcasts are not acknowledged, and pipe 0 receives the ACKs while transmitting. 
+/// The chip suppresses duplicates caused by lost ACKs by itself. ACK payloads are not
+/// used, since RadioHead messages need their headers.
 ///
 /// Naturally, for any 2 radios to communicate that must be configured to use the same frequency and 
 /// data rate, and with identical network addresses.
@@ -224,7 +288,7 @@
 ///         SCK pin D13----------SCK   (SPI clock in)
 ///        MOSI pin D11----------SDI   (SPI Data in)
 ///        MISO pin D12----------SDO   (SPI data out)
-///                              IRQ   (Interrupt output, not connected)
+///                              IRQ   (Interrupt output, optional, see Interrupts above)
 ///                 GND----------GND   (ground in)
 /// \endcode
 ///
@@ -238,7 +302,7 @@
 ///      SCK ICSP pin 3----------SCK   (SPI clock in)
 ///     MOSI ICSP pin 4----------SDI   (SPI Data in)
 ///     MISO ICSP pin 1----------SDO   (SPI data out)
-///                              IRQ   (Interrupt output, not connected)
+///                              IRQ   (Interrupt output, optional, see Interrupts above)
 ///                 GND----------GND   (ground in)
 /// \endcode
 /// and initialise the NRF24 object like this to explicitly set the SS pin
@@ -253,7 +317,7 @@
 ///         SCK pin D52----------SCK   (SPI clock in)
 ///        MOSI pin D51----------SDI   (SPI Data in)
 ///        MISO pin D50----------SDO   (SPI data out)
-///                              IRQ   (Interrupt output, not connected)
+///                              IRQ   (Interrupt output, optional, see Interrupts above)
 ///                 GND----------GND   (ground in)
 /// \endcode
 /// and you can then use the default constructor RH_NRF24(). 
@@ -268,7 +332,7 @@
 ///         SCK D52  32----------SCK   (SPI clock in)
 ///        MOSI D51  34----------SDI   (SPI Data in)
 ///        MISO D50  30----------SDO   (SPI data out)
-///                              IRQ   (Interrupt output, not connected)
+///                              IRQ   (Interrupt output, optional, see Interrupts above)
 ///        GND       39----------GND   (ground in)
 /// \endcode
 /// And initialise like this:
@@ -287,7 +351,7 @@
 ///         D9       5----------SCK   (SPI clock in)
 ///         D8       6----------SDI   (SPI Data in)
 ///         D7       7----------SDO   (SPI data out)
-///                              IRQ   (Interrupt output, not connected)
+///                              IRQ   (Interrupt output, optional, see Interrupts above)
 ///        GND       1----------GND   (ground in)
 /// \endcode
 /// And initialise like this:
@@ -410,7 +474,10 @@ public:
     /// D10 for Maple)
     /// \param[in] spi Pointer to the SPI interface object to use. 
     ///                Defaults to the standard Arduino hardware SPI interface
-    RH_NRF24(uint8_t chipEnablePin = 8, uint8_t slaveSelectPin = SS, RHGenericSPI& spi = hardware_spi);
+    /// \param[in] interruptPin The interrupt capable Arduino pin connected to the NRF24 IRQ output,
+    ///                or RH_NRF24_NO_INTERRUPT (the default) if it is not connected. See the Interrupts section
+    RH_NRF24(uint8_t chipEnablePin = 8, uint8_t slaveSelectPin = SS, RHGenericSPI& spi = hardware_spi, 
+	     uint8_t interruptPin = RH_NRF24_NO_INTERRUPT);
   
     /// Initialises this instance and the radio module connected to it.
     /// The following steps are taken:g
@@ -478,6 +545,39 @@ public:
     /// \return true on success, false if len is not in the range 3-5 inclusive.
     bool setNetworkAddress(uint8_t* address, uint8_t len);
 
+    /// Enables or disables node addressing, where the radio discards messages to other nodes.
+    /// See "Node addressing" above. Disabled by default. Disabling it also disables hardware acknowledgement.
+    /// Call after init().
+    /// \param[in] enable true to give each node its own radio address
+    /// \return true on success
+    bool setNodeAddressing(bool enable);
+
+    /// Sets the additional node addresses to receive messages for with node addressing, 
+    /// eg for a node that acts for several others. Messages to them are acknowledged in hardware
+    /// acknowledgement mode.
+    /// \param[in] addresses Array of count node addresses
+    /// \param[in] count Number of addresses, up to RH_NRF24_MAX_EXTRA_ADDRESSES. 0 for none (the default)
+    /// \return true on success, false if count is too large
+    bool setExtraAddresses(const uint8_t* addresses, uint8_t count);
+
+    /// Enables or disables hardware acknowledgement and retransmission (Enhanced Shockburst auto-ack).
+    /// See "Hardware acknowledgement" above. Disabled by default. Enabling it also enables node addressing.
+    /// Call after init().
+    /// \param[in] enable true to enable hardware acknowledgement
+    /// \param[in] retries Number of hardware retransmissions if no ACK is received, 0 to 15
+    /// \param[in] retryDelay Delay before each hardware retransmission in microseconds, 250 to 4000.
+    /// Must be at least 500 at 250kbps.
+    /// \return true on success
+    bool setHardwareAck(bool enable, uint8_t retries = 3, uint16_t retryDelay = RH_NRF24_DEFAULT_RETRY_DELAY);
+
+    /// Tells whether hardware acknowledgement is enabled. See setHardwareAck()
+    /// \return true if messages to single nodes are acknowledged and retransmitted by the radio
+    virtual bool hasHardwareAck();
+
+    /// Sets the address of this node. In hardware acknowledgement mode, also sets the radio address of pipe 1.
+    /// \param[in] thisAddress The address of this node.
+    virtual void setThisAddress(uint8_t thisAddress);
+
     /// Sets the data rate and transmitter power to use. Note that the nRF24 and the RFM73 have different
     /// available power levels, and for convenience, 2 different sets of values are available in the 
     /// RH_NRF24::TransmitPower enum. The ones with the RFM73 only have meaning on the RFM73 and compatible
@@ -504,7 +604,9 @@ public:
     void setModeTx();
 
     /// Sends data to the address set by setTransmitAddress()
-    /// Sets the radio to TX mode
+    /// Sets the radio to TX mode. Does not wait for any previous message to be transmitted:
+    /// up to 3 messages are queued in the radio's TX FIFO and sent back to back, and send() only waits 
+    /// if the FIFO is full. Call waitPacketSent() once after the last of them.
     /// \param [in] data Data bytes to send.
     /// \param [in] len Number of data bytes to set in teh TX buffer. The actual size of the 
     /// transmitted data payload is set by setPayloadSize
@@ -512,8 +614,16 @@ public:
     /// successfully transmitted).
     bool send(const uint8_t* data, uint8_t len);
 
-    /// Blocks until the current message (if any) 
-    /// has been transmitted
+    /// Like send(), but the message is in several fragments, which are written straight
+    /// to the TX FIFO behind the headers. See RHGenericDriver::sendFragments()
+    /// \param[in] fragments The pieces of the message, in order
+    /// \param[in] count Number of fragments
+    /// \return true on success
+    virtual bool sendFragments(const Fragment* fragments, uint8_t count);
+
+    /// Blocks until the current message (if any), and any others queued behind it by send(),
+    /// have been transmitted. If the interrupt handler has already ended a burst that failed, 
+    /// that failure is reported here, once, even if another send() has been started since
     /// \return true on success, false if the chip is not in transmit mode or other transmit failure
     virtual bool waitPacketSent();
 
@@ -556,6 +666,37 @@ public:
     virtual bool    sleep();
 
 protected:
+    /// Low level interrupt service routine for NRF24 connected to interrupt 0
+    static void         isr0();
+
+    /// Low level interrupt service routine for NRF24 connected to interrupt 1
+    static void         isr1();
+
+    /// Low level interrupt service routine for NRF24 connected to interrupt 2
+    static void         isr2();
+
+    /// Array of instances connected to interrupts 0, 1 and 2
+    static RH_NRF24*    _deviceForInterrupt[];
+
+    /// Index of next interrupt number to use in _deviceForInterrupt
+    static uint8_t      _interruptCount;
+
+    /// This is a low level function to handle the interrupts for one instance of RH_NRF24.
+    /// Called automatically by isr*()
+    /// Should not need to be called.
+    void handleInterrupt();
+
+    /// Moves messages from the radio's RX FIFO to the receive queue until one or the other runs out
+    void readRxFifo();
+
+    /// Ends a burst of transmissions, leaving the radio idle
+    /// \param[in] status The STATUS register, to tell whether the last transmission failed
+    void finishTx(uint8_t status);
+
+    /// Reports whether the last burst of transmissions succeeded, and clears _txFailed
+    /// \return false if it ended with MAX_RT
+    bool txResult();
+
     /// Flush the TX FIFOs
     /// \return the value of the device status register
     uint8_t flushTx();
@@ -564,11 +705,18 @@ protected:
     /// \return the value of the device status register
     uint8_t flushRx();
 
-    /// Examine the revceive buffer to determine whether the message is for this node
-    void validateRxBuf();
+    /// Examine a received message to determine whether it is for this node
+    /// \param[in] buf The message, starting with the 4 headers
+    /// \param[in] len Length of the message including the headers
+    /// \return true if the message should be received
+    bool validateRxBuf(const uint8_t* buf, uint8_t len);
+
+    /// Writes the radio address of a node to an address register (TX_ADDR or RX_ADDR_P0/1),
+    /// ie the network address with its first octet replaced by the node address
+    void writeNodeAddress(uint8_t reg, uint8_t node);
 
-    /// Clear our local receive buffer
-    void clearRxBuf();
+    /// Returns the value of EN_RXADDR for the node addressing receive pipes: 1, 2 and those in use of 3 to 5
+    uint8_t rxPipes();
 
 private:
     /// This idle mode chip configuration
@@ -577,14 +725,35 @@ private:
     /// the number of the chip enable pin
     uint8_t             _chipEnablePin;
 
-    /// Number of octets in the buffer
-    uint8_t             _bufLen;
-    
-    /// The receiver/transmitter buffer
-    uint8_t             _buf[RH_NRF24_MAX_PAYLOAD_LEN];
+    /// The pin connected to the IRQ output, or RH_NRF24_NO_INTERRUPT
+    uint8_t             _interruptPin;
+
+    /// Set by the interrupt handler when a burst of transmissions ends with MAX_RT.
+    /// Only cleared by waitPacketSent(), when it reports the failure
+    volatile bool       _txFailed;
+
+    /// Set when messages had to be left in the radio's RX FIFO because the receive queue was full
+    volatile bool       _rxFifoPending;
+
+    /// The network address from setNetworkAddress()
+    uint8_t             _networkAddress[5];
+    uint8_t             _networkAddressLen;
+
+    /// True in node addressing mode
+    bool                _nodeAddressing;
+
+    /// True in hardware acknowledgement mode
+    bool                _hardwareAck;
+
+    /// In node addressing mode, the node whose address is in TX_ADDR
+    uint8_t             _txNode;
+
+    /// Additional node addresses for pipes 3 to 5, see setExtraAddresses()
+    uint8_t             _extraAddresses[RH_NRF24_MAX_EXTRA_ADDRESSES];
+    uint8_t             _extraAddressCount;
 
-    /// True when there is a valid message in the buffer
-    bool                _rxBufValid;
+    /// Storage for the receive queue, see RHGenericDriver::rxQueueInit()
+    uint8_t             _rxQueueBuf[RH_NRF24_RX_QUEUE_LEN][RH_NRF24_MAX_MESSAGE_LEN + RH_RX_QUEUE_OVERHEAD];
 };
 
 /// @example nrf24_client.pde
@@ -137,16 +137,18 @@ void RH_NRF905::setModeTx()
 
 bool RH_NRF905::send(const uint8_t* data, uint8_t len)
 {
+    Fragment fragment = { data, len };
+    return sendFragments(&fragment, 1);
+}
+
+bool RH_NRF905::sendFragments(const Fragment* fragments, uint8_t count)
+{
+    uint16_t len = fragmentsLen(fragments, count);
     if (len > RH_NRF905_MAX_MESSAGE_LEN)
 	return false;
-    // Set up the headers
-    _buf[0] = _txHeaderTo;
-    _buf[1] = _txHeaderFrom;
-    _buf[2] = _txHeaderId;
-    _buf[3] = _txHeaderFlags;
-    _buf[4] = len;
-    memcpy(_buf+RH_NRF905_HEADER_LEN, data, len);
-    spiBurstWrite(RH_NRF905_REG_W_TX_PAYLOAD, _buf, len + RH_NRF905_HEADER_LEN);
+    // The headers, then the message, in one burst
+    uint8_t headers[RH_NRF905_HEADER_LEN] = { _txHeaderTo, _txHeaderFrom, _txHeaderId, _txHeaderFlags, (uint8_t)len };
+    spiBurstWriteFragments(RH_NRF905_REG_W_TX_PAYLOAD, headers, sizeof(headers), fragments, count);
     setModeTx();
     // Radio will return to Standby mode after transmission is complete
     _txGood++;
@@ -316,6 +316,13 @@ public:
     /// successfully transmitted).
     bool send(const uint8_t* data, uint8_t len);
 
+    /// Like send(), but the message is in several fragments, which are written straight
+    /// to the TX payload behind the headers. See RHGenericDriver::sendFragments()
+    /// \param[in] fragments The pieces of the message, in order
+    /// \param[in] count Number of fragments
+    /// \return true on success
+    bool sendFragments(const Fragment* fragments, uint8_t count);
+
     /// Blocks until the current message (if any) 
     /// has been transmitted
     /// \return true on success, false if the chip is not in transmit mode
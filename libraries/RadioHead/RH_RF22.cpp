@@ -571,6 +571,12 @@ void RH_RF22::restartTransmit()
 }
 
 bool RH_RF22::send(const uint8_t* data, uint8_t len)
+{
+    Fragment fragment = { data, len };
+    return sendFragments(&fragment, 1);
+}
+
+bool RH_RF22::sendFragments(const Fragment* fragments, uint8_t count)
 {
     bool ret = true;
     waitPacketSent();
@@ -579,12 +585,15 @@ bool RH_RF22::send(const uint8_t* data, uint8_t len)
     spiWrite(RH_RF22_REG_3B_TRANSMIT_HEADER2, _txHeaderFrom);
     spiWrite(RH_RF22_REG_3C_TRANSMIT_HEADER1, _txHeaderId);
     spiWrite(RH_RF22_REG_3D_TRANSMIT_HEADER0, _txHeaderFlags);
-    if (!fillTxBuf(data, len))
+    // Gathered in the transmit buffer, since the FIFO is refilled from it during transmission
+    clearTxBuf();
+    for (uint8_t i = 0; ret && i < count; i++)
+	ret = appendTxBuf(fragments[i].data, fragments[i].len);
+    if (!_bufLen)
 	ret = false;
-    else
+    if (ret)
 	startTransmit();
     ATOMIC_BLOCK_END;
-//    printBuffer("send:", data, len);
     return ret;
 }
 
@@ -328,6 +328,13 @@ bool RH_RF24::recv(uint8_t* buf, uint8_t* len)
 
 bool RH_RF24::send(const uint8_t* data, uint8_t len)
 {
+    Fragment fragment = { data, len };
+    return sendFragments(&fragment, 1);
+}
+
+bool RH_RF24::sendFragments(const Fragment* fragments, uint8_t count)
+{
+    uint16_t len = fragmentsLen(fragments, count);
     if (len > RH_RF24_MAX_MESSAGE_LEN)
 	return false;
 
@@ -344,17 +351,23 @@ bool RH_RF24::send(const uint8_t* data, uint8_t len)
     _buf[2] = _txHeaderFrom;
     _buf[3] = _txHeaderId;
     _buf[4] = _txHeaderFlags;
-    // Then the message
-    memcpy(_buf + 1 + RH_RF24_HEADER_LEN, data, len);
+    // Then the message. It has to be gathered here, since the FIFO is refilled from it during transmission
+    uint8_t* p = _buf + 1 + RH_RF24_HEADER_LEN;
+    for (uint8_t i = 0; i < count; i++)
+    {
+	memcpy(p, fragments[i].data, fragments[i].len);
+	p += fragments[i].len;
+    }
     _bufLen = len + 1 + RH_RF24_HEADER_LEN;
     _txBufSentIndex = 0;
 
     // Set the field 2 length to the variable payload length
-    uint8_t l[] = { len +  RH_RF24_HEADER_LEN};
+    uint8_t l[] = { (uint8_t)(len + RH_RF24_HEADER_LEN) };
     set_properties(RH_RF24_PROPERTY_PKT_FIELD_2_LENGTH_7_0, l, sizeof(l));
 
     sendNextFragment();
     setModeTx();
+    return true;
 }
 
 // This is different to command() since we must not wait for CTS
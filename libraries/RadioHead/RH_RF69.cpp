@@ -482,26 +482,23 @@ bool RH_RF69::recv(uint8_t* buf, uint8_t* len)
 
 bool RH_RF69::send(const uint8_t* data, uint8_t len)
 {
+    Fragment fragment = { data, len };
+    return sendFragments(&fragment, 1);
+}
+
+bool RH_RF69::sendFragments(const Fragment* fragments, uint8_t count)
+{
+    uint16_t len = fragmentsLen(fragments, count);
     if (len > RH_RF69_MAX_MESSAGE_LEN)
 	return false;
 
     waitPacketSent(); // Make sure we dont interrupt an outgoing message
     setModeIdle(); // Prevent RX while filling the fifo
 
-    ATOMIC_BLOCK_START;
-    digitalWrite(_slaveSelectPin, LOW);
-    _spi.transfer(RH_RF69_REG_00_FIFO | RH_RF69_SPI_WRITE_MASK); // Send the start address with the write mask on
-    _spi.transfer(len + RH_RF69_HEADER_LEN); // Include length of headers
-    // First the 4 headers
-    _spi.transfer(_txHeaderTo);
-    _spi.transfer(_txHeaderFrom);
-    _spi.transfer(_txHeaderId);
-    _spi.transfer(_txHeaderFlags);
-    // Now the payload
-    while (len--)
-	_spi.transfer(*data++);
-    digitalWrite(_slaveSelectPin, HIGH);
-    ATOMIC_BLOCK_END;
+    // The length (including the headers), the 4 headers, then the payload, in one burst
+    uint8_t headers[RH_RF69_HEADER_LEN + 1] = { (uint8_t)(len + RH_RF69_HEADER_LEN), 
+						_txHeaderTo, _txHeaderFrom, _txHeaderId, _txHeaderFlags };
+    spiBurstWriteFragments(RH_RF69_REG_00_FIFO, headers, sizeof(headers), fragments, count);
 
     setModeTx(); // Start the transmitter
     return true;
@@ -713,6 +713,13 @@ public:
     /// \return true if the message length was valid and it was correctly queued for transmit
     bool        send(const uint8_t* data, uint8_t len);
 
+    /// Like send(), but the message is in several fragments, which are written straight
+    /// to the FIFO behind the headers. See RHGenericDriver::sendFragments()
+    /// \param[in] fragments The pieces of the message, in order
+    /// \param[in] count Number of fragments
+    /// \return true if the message length was valid and it was correctly queued for transmit
+    bool        sendFragments(const Fragment* fragments, uint8_t count);
+
     /// Sets the length of the preamble
     /// in bytes. 
     /// Caution: this should be set to the same 
@@ -219,6 +219,13 @@ bool RH_RF95::recv(uint8_t* buf, uint8_t* len)
 
 bool RH_RF95::send(const uint8_t* data, uint8_t len)
 {
+    Fragment fragment = { data, len };
+    return sendFragments(&fragment, 1);
+}
+
+bool RH_RF95::sendFragments(const Fragment* fragments, uint8_t count)
+{
+    uint16_t len = fragmentsLen(fragments, count);
     if (len > RH_RF95_MAX_MESSAGE_LEN)
 	return false;
 
@@ -227,13 +234,9 @@ bool RH_RF95::send(const uint8_t* data, uint8_t len)
 
     // Position at the beginning of the FIFO
     spiWrite(RH_RF95_REG_0D_FIFO_ADDR_PTR, 0);
-    // The headers
-    spiWrite(RH_RF95_REG_00_FIFO, _txHeaderTo);
-    spiWrite(RH_RF95_REG_00_FIFO, _txHeaderFrom);
-    spiWrite(RH_RF95_REG_00_FIFO, _txHeaderId);
-    spiWrite(RH_RF95_REG_00_FIFO, _txHeaderFlags);
-    // The message data
-    spiBurstWrite(RH_RF95_REG_00_FIFO, data, len);
+    // The headers, then the message data, in one burst
+    uint8_t headers[RH_RF95_HEADER_LEN] = { _txHeaderTo, _txHeaderFrom, _txHeaderId, _txHeaderFlags };
+    spiBurstWriteFragments(RH_RF95_REG_00_FIFO, headers, sizeof(headers), fragments, count);
     spiWrite(RH_RF95_REG_22_PAYLOAD_LENGTH, len + RH_RF95_HEADER_LEN);
 
     setModeTx(); // Start the transmitter
@@ -67,9 +67,6 @@ void  RH_Serial::handleRx(uint8_t ch)
 	{
 	    if (ch == ETX)
 	    {
-		// add fcs for DLE, ETX
-		_rxFcs = RHcrc_ccitt_update(_rxFcs, DLE);
-		_rxFcs = RHcrc_ccitt_update(_rxFcs, ETX);
 		_rxState = RxStateWaitFCS1; // End frame
 	    }
 	    else if (ch == DLE)
@@ -105,26 +102,30 @@ void  RH_Serial::handleRx(uint8_t ch)
 void RH_Serial::clearRxBuf()
 {
     _rxBufValid = false;
-    _rxFcs = 0xffff;
+    _rxOverflow = false;
     _rxBufLen = 0;
 }
 
 void RH_Serial::appendRxBuf(uint8_t ch)
 {
     if (_rxBufLen < RH_SERIAL_MAX_PAYLOAD_LEN)
-    {
-	// Normal data, save and add to FCS
-	_rxBuf[_rxBufLen++] = ch;
-	_rxFcs = RHcrc_ccitt_update(_rxFcs, ch);
-    }
-    // If the buffer overflows, we dont record the trailing data, and the FCS will be wrong,
-    // causing the message to be dropped when the FCS is received
+	_rxBuf[_rxBufLen++] = ch; // Normal data, save it
+    else
+	_rxOverflow = true;
+    // If the buffer overflows, we dont record the trailing data, and the message
+    // is dropped when the FCS is received
 }
 
 // Check whether the latest received message is complete and uncorrupted
 void RH_Serial::validateRxBuf()
 {
-    if (_rxRecdFcs != _rxFcs)
+    // The FCS is the CCITT CRC-16 of all received data (but not stuffed DLEs), plus trailing DLE, ETX.
+    // Computed over the whole buffer here rather than octet by octet as it arrives,
+    // since the buffer routine is much faster
+    static const uint8_t trailer[] = { DLE, ETX };
+    uint16_t fcs = RHcrc_ccitt_buf(0xffff, _rxBuf, _rxBufLen);
+    fcs = RHcrc_ccitt_buf(fcs, trailer, sizeof(trailer));
+    if (_rxOverflow || _rxRecdFcs != fcs)
     {
 	_rxBad++;
 	return;
@@ -162,26 +163,43 @@ bool RH_Serial::recv(uint8_t* buf, uint8_t* len)
 // Caution: this may block
 bool RH_Serial::send(const uint8_t* data, uint8_t len)
 {
-    _txFcs = 0xffff;    // Initial value
+    Fragment fragment = { data, len };
+    return sendFragments(&fragment, 1);
+}
+
+// Caution: this may block
+bool RH_Serial::sendFragments(const Fragment* fragments, uint8_t count)
+{
+    uint8_t header[RH_SERIAL_HEADER_LEN] = { _txHeaderTo, _txHeaderFrom, _txHeaderId, _txHeaderFlags };
+    static const uint8_t trailer[] = { DLE, ETX };
+    uint8_t i;
+
+    // The FCS covers the headers, payload and trailing DLE, ETX, but not stuffed DLEs
+    uint16_t fcs = RHcrc_ccitt_buf(0xffff, header, sizeof(header));
+    for (i = 0; i < count; i++)
+	fcs = RHcrc_ccitt_buf(fcs, fragments[i].data, fragments[i].len);
+    fcs = RHcrc_ccitt_buf(fcs, trailer, sizeof(trailer));
+
     _serial.write(DLE); // Not in FCS
     _serial.write(STX); // Not in FCS
     // First the 4 headers
-    txData(_txHeaderTo);
-    txData(_txHeaderFrom);
-    txData(_txHeaderId);
-    txData(_txHeaderFlags);
-    // Now the payload
-    while (len--)
-	txData(*data++);
+    for (i = 0; i < sizeof(header); i++)
+	txData(header[i]);
+    // Now the payload, straight from each fragment
+    for (i = 0; i < count; i++)
+    {
+	const uint8_t* data = fragments[i].data;
+	uint8_t len = fragments[i].len;
+	while (len--)
+	    txData(*data++);
+    }
     // End of message
     _serial.write(DLE);
-    _txFcs = RHcrc_ccitt_update(_txFcs, DLE);
     _serial.write(ETX);
-    _txFcs = RHcrc_ccitt_update(_txFcs, ETX);
 
     // Now send the calculated FCS for this message
-    _serial.write((_txFcs >> 8) & 0xff);
-    _serial.write(_txFcs & 0xff);
+    _serial.write((fcs >> 8) & 0xff);
+    _serial.write(fcs & 0xff);
     return true;
 }
 
@@ -190,7 +208,6 @@ void  RH_Serial::txData(uint8_t ch)
     if (ch == DLE)    // DLE stuffing required?
 	_serial.write(DLE); // Not in FCS
     _serial.write(ch);
-    _txFcs = RHcrc_ccitt_update(_txFcs, ch);
 }
 
 uint8_t RH_Serial::maxMessageLength()
@@ -136,6 +136,13 @@ public:
     /// \return true if the message length was valid and it was correctly queued for transmit
     virtual bool send(const uint8_t* data, uint8_t len);
 
+    /// Like send(), but the message is in several fragments, which are encoded straight
+    /// from where they are. See RHGenericDriver::sendFragments()
+    /// \param[in] fragments The pieces of the message, in order
+    /// \param[in] count Number of fragments
+    /// \return true if the message length was valid and it was correctly queued for transmit
+    virtual bool sendFragments(const Fragment* fragments, uint8_t count);
+
     /// Returns the maximum message length 
     /// available in this Driver.
     /// \return The maximum legal message length
@@ -170,7 +177,7 @@ protected:
     void  validateRxBuf();
 
     /// Sends a single data octet to the serial port.
-    /// Implements DLE stuffing and keeps track of the senders FCS
+    /// Implements DLE stuffing
     void  txData(uint8_t ch);
 
     /// Reference to the HardwareSerial port we will use
@@ -179,8 +186,8 @@ protected:
     /// The current state of the Rx state machine
     RxState         _rxState;
 
-    /// Progressive FCS calc (CCITT CRC-16 covering all received data (but not stuffed DLEs), plus trailing DLE, ETX)
-    uint16_t        _rxFcs;
+    /// True if the current message was too long for the Rx buffer, and so must be dropped
+    bool            _rxOverflow;
 
     /// The received FCS at the end of the current message
     uint16_t        _rxRecdFcs; 
@@ -193,9 +200,6 @@ protected:
 
     /// True if the data in the Rx buffer is value and uncorrupted and complete message is available for collection
     bool            _rxBufValid;
-
-    /// FCS for transmitted data
-    uint16_t        _txFcs;
 };
 
 /// @example serial_reliable_datagram_client.pde
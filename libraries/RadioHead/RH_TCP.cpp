@@ -13,29 +13,68 @@
 #include <errno.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <stddef.h>
 #include <netdb.h>
+#include <poll.h>
+#include <endian.h>
 #include <string>
 
+// The driver that coordinates virtual time with the ether simulator, if any
+static RH_TCP* virtualTimeDriver = NULL;
+
+// Called by the simulator when the sketch is idle in virtual time
+static uint64_t virtualTimeIdleHandler(uint64_t until, bool wakeOnPacket)
+{
+    return virtualTimeDriver->sleepUntil(until, wakeOnPacket);
+}
+
 RH_TCP::RH_TCP(const char* server)
     : _server(server),
-      _rxBufLen(0),
-      _rxBufValid(false),
-      _socket(-1)
+      _socket(-1),
+      _socketBufHead(0),
+      _socketBufLen(0),
+      _timeGranted(false),
+      _virtualNow(0),
+      _channel(0),
+      _bitsPerSecond(0),
+      _power(0),
+      _etherBitsPerSecond(0)
 {
+    rxQueueInit(&_rxQueueBuf[0][0], RH_TCP_RX_QUEUE_LEN, sizeof(_rxQueueBuf[0]));
 }
     
 bool RH_TCP::init()
 {   
-    if (!connectToServer())
+    // May be called again to reinitialise, in which case keep the connection we have
+    if (_socket < 0 && !connectToServer())
 	return false;
-    return sendThisAddress(_thisAddress);
+    if (!sendThisAddress(_thisAddress) || !sendRadio())
+	return false;
+    if (_simulator_virtual_time)
+    {
+	if (!virtualTimeDriver)
+	{
+	    virtualTimeDriver = this;
+	    simulator_set_idle_handler(virtualTimeIdleHandler);
+	}
+	// Wait for the ether simulator to start the clock, and synchronise with it
+	delay(0);
+    }
+    return true;
 }
     
 bool RH_TCP::connectToServer()
 {
+#ifdef RH_SIMULATOR_HOSTED
+    // The ether is in the same process
+    _socket = simhost_connect();
+    return _socket >= 0;
+#else
     struct addrinfo hints;
     struct addrinfo *result, *rp;
     int sfd, s;
@@ -102,126 +141,223 @@ bool RH_TCP::connectToServer()
 	_socket = -1;
 	return false;
     }
+    // Messages are small and latency sensitive
+    setsockopt(_socket, IPPROTO_TCP, TCP_NODELAY, (char *)&on, sizeof(on));
     return true;
+#endif
 }
 
-void RH_TCP::clearRxBuf()
+void RH_TCP::checkForEvents()
 {
-    _rxBufValid = false;
-    _rxBufLen = 0;
+    // Keep reading until the server has nothing more for us, handling the complete messages
+    // after each read, so every packet in a burst gets to the rx queue
+    while (true)
+    {
+	// Read into all the free space in the ring buffer at once: from the end of the unhandled 
+	// octets to the end of the buffer, and then any that wraps round to the start
+	uint16_t tail = (_socketBufHead + _socketBufLen) & (RH_TCP_SOCKETBUF_LEN - 1);
+	uint16_t space = RH_TCP_SOCKETBUF_LEN - _socketBufLen;
+	struct iovec iov[2];
+	iov[0].iov_base = _socketBuf + tail;
+	iov[0].iov_len = space < RH_TCP_SOCKETBUF_LEN - tail ? space : RH_TCP_SOCKETBUF_LEN - tail;
+	iov[1].iov_base = _socketBuf;
+	iov[1].iov_len = space - iov[0].iov_len;
+#ifdef RH_SIMULATOR_HOSTED
+	// No system calls to save, so just read each piece in turn
+	ssize_t count = simhost_read(_socket, iov[0].iov_base, iov[0].iov_len);
+	if (count == (ssize_t)iov[0].iov_len && iov[1].iov_len)
+	{
+	    ssize_t more = simhost_read(_socket, iov[1].iov_base, iov[1].iov_len);
+	    if (more > 0)
+		count += more;
+	}
+#else
+	ssize_t count = readv(_socket, iov, iov[1].iov_len ? 2 : 1);
+#endif
+	if (count < 0)
+	{
+	    if (errno != EAGAIN)
+	    {
+		fprintf(stderr,"RH_TCP::checkForEvents read error: %s\n", strerror(errno));
+		exit(1);
+	    }
+	    return;
+	}
+	else if (count == 0)
+	{
+	    // End of file
+	    fprintf(stderr,"RH_TCP::checkForEvents unexpected end of file on read\n");
+	    exit(1);
+	}
+	_socketBufLen += count;
+	handleMessages();
+	if ((size_t)count < space)
+	    return; // Got everything there was
+    }
 }
 
-void RH_TCP::checkForEvents()
+void RH_TCP::socketBufCopy(uint16_t offset, void* dest, uint16_t len)
 {
-    #define RH_TCP_SOCKETBUF_LEN 500
-    static uint8_t socketBuf[RH_TCP_SOCKETBUF_LEN]; // Room for several messages
-    static uint16_t socketBufLen = 0;
+    uint16_t start = (_socketBufHead + offset) & (RH_TCP_SOCKETBUF_LEN - 1);
+    uint16_t first = RH_TCP_SOCKETBUF_LEN - start;
+    if (first > len)
+	first = len;
+    memcpy(dest, _socketBuf + start, first);
+    memcpy((uint8_t*)dest + first, _socketBuf, len - first); // The part that wrapped, if any
+}
 
-    // Read at most the amount of space we have left in the buffer
-    ssize_t count = read(_socket, socketBuf + socketBufLen, sizeof(socketBuf) - socketBufLen);
-    if (count < 0)
+void RH_TCP::handleMessages()
+{
+    while (_socketBufLen >= sizeof(uint32_t) + 1)
     {
-	if (errno != EAGAIN)
+	uint32_t len;
+	socketBufCopy(0, &len, sizeof(len));
+	len = ntohl(len);
+	uint32_t messageLen = len + sizeof(len);
+	if (len > sizeof(RHTcpTypeMessage) - sizeof(len))
 	{
-	    fprintf(stderr,"RH_TCP::checkForEvents read error: %s\n", strerror(errno));
+	    // Bogus length
+	    fprintf(stderr, "RH_TCP::checkForEvents read ridiculous length: %d. Corrupt message stream? Aborting\n", len);
 	    exit(1);
 	}
-    }
-    else if (count == 0)
-    {
-	// End of file
-	fprintf(stderr,"RH_TCP::checkForEvents unexpected end of file on read\n");
-	exit(1);
-    }
-    else
-    {
-	socketBufLen += count;
-	while (socketBufLen >= 5)
+	if (_socketBufLen < messageLen)
+	    break; // Wait for the rest of the message
+
+	// Got all of this message
+	uint8_t type;
+	socketBufCopy(sizeof(len), &type, sizeof(type));
+	if (type == RH_TCP_MESSAGE_TYPE_PACKET && len >= 5)
 	{
-	    RHTcpTypeMessage* message = ((RHTcpTypeMessage*)socketBuf);
-	    uint32_t len = ntohl(message->length);
-	    uint32_t messageLen = len + sizeof(message->length);
-	    if (len > sizeof(socketBuf) - sizeof(message->length))
-	    {
-		// Bogus length
-		fprintf(stderr, "RH_TCP::checkForEvents read ridiculous length: %d. Corrupt message stream? Aborting\n", len);
-		exit(1);
-	    }
-	    if (socketBufLen >= len + sizeof(message->length))
+	    // REVISIT: need to check if we are actually receiving?
+	    // Its a new packet, queue the headers and payload straight from the ring buffer
+	    uint8_t to;
+	    socketBufCopy(offsetof(RHTcpPacket, to), &to, sizeof(to));
+	    uint32_t payloadLen = len - 5;
+	    if (payloadLen <= RH_TCP_MAX_MESSAGE_LEN && validateRxBuf(to))
 	    {
-		// Got at least all of this message
-		if (message->type == RH_TCP_MESSAGE_TYPE_PACKET && len >= 5)
+		uint8_t* slot = rxQueueSlot();
+		if (slot)
 		{
-		    // REVISIT: need to check if we are actually receiving?
-		    // Its a new packet, extract the headers and payload
-		    RHTcpPacket* packet = ((RHTcpPacket*)socketBuf);
-		    _rxHeaderTo    = packet->to;
-		    _rxHeaderFrom  = packet->from;
-		    _rxHeaderId    = packet->id;
-		    _rxHeaderFlags = packet->flags;
-		    uint32_t payloadLen = len - 5;
-		    if (payloadLen <= sizeof(_rxBuf))
-		    {
-			// Enough room in our receiver buffer
-			memcpy(_rxBuf, packet->payload, payloadLen);
-			_rxBufLen = payloadLen;
-			_rxBufFull = true;
-		    }
+		    socketBufCopy(offsetof(RHTcpPacket, to), slot, len - 1);
+		    rxQueuePush(len - 1);
 		}
-		// check for other message types here
-		// Now remove the used message by copying the trailing bytes (maybe start of a new message?)
-		// to the top of the buffer
-		memcpy(socketBuf, socketBuf + messageLen, sizeof(socketBuf) - messageLen);
-		socketBufLen -= messageLen;
+		else
+		    _rxQueueOverflows++; // Queue full, it is lost
 	    }
 	}
+	else if (type == RH_TCP_MESSAGE_TYPE_TIME && len >= 9)
+	{
+	    // Virtual time ether simulator has woken us up
+	    RHTcpTime time;
+	    socketBufCopy(0, &time, sizeof(time));
+	    _virtualNow = be64toh(time.now);
+	    _timeGranted = true;
+	}
+	else if (type == RH_TCP_MESSAGE_TYPE_RADIO && len >= 7)
+	{
+	    // The settings the ether simulator is using for us, with its default data rate filled in
+	    RHTcpRadio radio;
+	    socketBufCopy(0, &radio, sizeof(radio));
+	    _etherBitsPerSecond = ntohl(radio.bitsPerSecond);
+	}
+	else if (type == RH_TCP_MESSAGE_TYPE_RSSI && len >= 2)
+	{
+	    // How strong the packet that follows was, as a radio would measure it
+	    RHTcpRssi rssi;
+	    socketBufCopy(0, &rssi, sizeof(rssi));
+	    _lastRssi = rssi.rssi;
+	}
+	// check for other message types here
+	// Now drop the used message from the ring buffer
+	_socketBufHead = (_socketBufHead + messageLen) & (RH_TCP_SOCKETBUF_LEN - 1);
+	_socketBufLen -= messageLen;
     }
 }
 
-void RH_TCP::validateRxBuf()
+bool RH_TCP::validateRxBuf(uint8_t to)
 {
-    // The headers have already been extracted
     if (_promiscuous ||
-	_rxHeaderTo == _thisAddress ||
-	_rxHeaderTo == RH_BROADCAST_ADDRESS)
+	to == _thisAddress ||
+	to == RH_BROADCAST_ADDRESS)
     {
 	_rxGood++;
-	_rxBufValid = true;
+	return true;
     }
+    return false;
 }
 
 bool RH_TCP::available()
 {
     if (_socket < 0)
 	return false;
-    checkForEvents();
-    if (_rxBufFull)
-    {
-	validateRxBuf();
-	_rxBufFull= false;
-    }
-    return _rxBufValid;
+    // In virtual time, nothing can arrive except while we sleep, when sleepUntil() reads it
+    if (virtualTimeDriver != this)
+	checkForEvents();
+    return rxQueuePeek();
 }
 
 bool RH_TCP::recv(uint8_t* buf, uint8_t* len)
 {
     if (!available())
 	return false;
+    return rxQueuePop(buf, len);
+}
+
+void RH_TCP::waitAvailable()
+{
+    while (!available())
+	waitForEvents(-1);
+}
 
-    if (buf && len)
+bool RH_TCP::waitAvailableTimeout(uint16_t timeout)
+{
+    unsigned long starttime = millis();
+    while (!available())
     {
-	if (*len > _rxBufLen)
-	    *len = _rxBufLen;
-	memcpy(buf, _rxBuf, *len);
+	unsigned long elapsed = millis() - starttime;
+	if (elapsed >= timeout)
+	    return false;
+	waitForEvents(timeout - elapsed);
     }
-    clearRxBuf();
     return true;
 }
 
+void RH_TCP::waitForEvents(int timeout)
+{
+    // In virtual time nothing arrives unless we let the clock move on.
+    // Always the case in simHost, where _socket is not a file descriptor
+    if (_simulator_virtual_time || _socket < 0)
+    {
+	YIELD;
+	return;
+    }
+    struct pollfd fds;
+    fds.fd = _socket;
+    fds.events = POLLIN;
+    if (poll(&fds, 1, timeout) < 0 && errno != EINTR)
+    {
+	fprintf(stderr,"RH_TCP::waitForEvents poll error: %s\n", strerror(errno));
+	exit(1);
+    }
+}
+
 bool RH_TCP::send(const uint8_t* data, uint8_t len)
 {
-    bool ret = sendPacket(data, len);
-    delay(10); // Wait for transmit to succeed. REVISIT: depends on length and speed
+    Fragment fragment = { data, len };
+    return sendFragments(&fragment, 1);
+}
+
+bool RH_TCP::sendFragments(const Fragment* fragments, uint8_t count)
+{
+    if (fragmentsLen(fragments, count) > RH_TCP_MAX_MESSAGE_LEN)
+	return false;
+    bool ret = sendPacket(fragments, count);
+    if (_simulator_virtual_time && _etherBitsPerSecond)
+	// Wait for the transmission to end, as the ether simulator will time it
+	delayMicroseconds((uint32_t)(fragmentsLen(fragments, count) + RH_TCP_HEADER_LEN) * 8 * 1000000 
+			  / _etherBitsPerSecond);
+    else
+	delay(10); // Wait for transmit to succeed. REVISIT: depends on length and speed
     return ret;
 }
 
@@ -236,6 +372,16 @@ void RH_TCP::setThisAddress(uint8_t address)
     sendThisAddress(_thisAddress);
 }
 
+bool RH_TCP::writeMessage(const void* message, size_t len)
+{
+#ifdef RH_SIMULATOR_HOSTED
+    ssize_t sent = simhost_write(_socket, message, len);
+#else
+    ssize_t sent = write(_socket, message, len);
+#endif
+    return sent > 0;
+}
+
 bool RH_TCP::sendThisAddress(uint8_t thisAddress)
 {
     if (_socket < 0)
@@ -244,24 +390,92 @@ bool RH_TCP::sendThisAddress(uint8_t thisAddress)
     m.length = htonl(2);
     m.type = RH_TCP_MESSAGE_TYPE_THISADDRESS;
     m.thisAddress = thisAddress;
-    ssize_t sent = write(_socket, &m, sizeof(m));
-    return sent > 0;
+    return writeMessage(&m, sizeof(m));
 }
 
-bool RH_TCP::sendPacket(const uint8_t* data, uint8_t len)
+bool RH_TCP::sendSleep(uint64_t until, bool wakeOnPacket)
+{
+    if (_socket < 0)
+	return false;
+    RHTcpSleep m;
+    m.length = htonl(10);
+    m.type = RH_TCP_MESSAGE_TYPE_SLEEP;
+    m.until = htobe64(until);
+    m.flags = wakeOnPacket ? RH_TCP_SLEEP_FLAG_WAKE_ON_PACKET : 0;
+    return writeMessage(&m, sizeof(m));
+}
+
+bool RH_TCP::setChannel(uint8_t channel)
+{
+    _channel = channel;
+    return sendRadio();
+}
+
+bool RH_TCP::setRF(uint32_t bitsPerSecond, int8_t power)
+{
+    _bitsPerSecond = bitsPerSecond;
+    _power = power;
+    return sendRadio();
+}
+
+bool RH_TCP::sendRadio()
+{
+    if (_socket < 0)
+	return false;
+    RHTcpRadio m;
+    m.length = htonl(7);
+    m.type = RH_TCP_MESSAGE_TYPE_RADIO;
+    m.channel = _channel;
+    m.bitsPerSecond = htonl(_bitsPerSecond);
+    m.power = _power;
+    return writeMessage(&m, sizeof(m));
+}
+
+uint64_t RH_TCP::sleepUntil(uint64_t until, bool wakeOnPacket)
+{
+    _timeGranted = false;
+    if (!sendSleep(until, wakeOnPacket))
+	return until;
+    while (!_timeGranted)
+    {
+	// Block until the ether simulator sends us something. 
+	// Any packets delivered while we sleep are received as usual
+#ifdef RH_SIMULATOR_HOSTED
+	simhost_wait(_socket);
+#else
+	struct pollfd fds;
+	fds.fd = _socket;
+	fds.events = POLLIN;
+	if (poll(&fds, 1, -1) < 0 && errno != EINTR)
+	{
+	    fprintf(stderr,"RH_TCP::sleepUntil poll error: %s\n", strerror(errno));
+	    exit(1);
+	}
+#endif
+	checkForEvents();
+    }
+    return _virtualNow;
+}
+
+bool RH_TCP::sendPacket(const Fragment* fragments, uint8_t count)
 {
     if (_socket < 0)
 	return false;
     RHTcpPacket m;
-    m.length = htonl(len + 4);
+    uint8_t len = 0;
+    for (uint8_t i = 0; i < count; i++)
+    {
+	memcpy(m.payload + len, fragments[i].data, fragments[i].len);
+	len += fragments[i].len;
+    }
+    // length counts the type and the 4 headers as well as the payload
+    m.length = htonl(len + 5);
     m.type  = RH_TCP_MESSAGE_TYPE_PACKET;
     m.to    = _txHeaderTo;
     m.from  = _txHeaderFrom;
     m.id    = _txHeaderId;
     m.flags = _txHeaderFlags;
-    memcpy(m.payload, data, len);
-    ssize_t sent = write(_socket, &m, len + 8);
-    return sent > 0;
+    return writeMessage(&m, len + 9);
 }
 
 #endif
@@ -8,6 +8,18 @@
 #include <RHGenericDriver.h>
 #include <RHTcpProtocol.h>
 
+// The number of received packets that can be held until the application collects them with recv().
+// Must be a power of 2
+#ifndef RH_TCP_RX_QUEUE_LEN
+ #define RH_TCP_RX_QUEUE_LEN 8
+#endif
+
+// Size of the ring buffer for octets read from the ether simulator server but not yet handled.
+// Must be a power of 2, and big enough for at least one complete RHTcpTypeMessage
+#ifndef RH_TCP_SOCKETBUF_LEN
+ #define RH_TCP_SOCKETBUF_LEN 2048
+#endif
+
 /////////////////////////////////////////////////////////////////////
 /// \class RH_TCP RH_TCP.h <RH_TCP.h>
 /// \brief Driver to send and receive unaddressed, unreliable datagrams via sockets on a Linux simulator
@@ -31,7 +43,11 @@
 /// tools/simBuild examples/simulator/simulator_reliable_datagram_client/simulator_reliable_datagram_client.pde
 /// # build the server for Linux:
 /// tools/simBuild examples/simulator/simulator_reliable_datagram_server/simulator_reliable_datagram_server.pde
+/// # build the native simulator server for Linux:
+/// g++ -O2 -I . -pthread tools/etherSimulator.cpp tools/ether.cpp -o etherSimulator
 /// # in one window, run the simulator server:
+/// ./etherSimulator
+/// # or the original Perl simulator server:
 /// tools/etherSimulator.pl
 /// # in another window, run the server
 /// ./simulator_reliable_datagram_server 
@@ -48,21 +64,88 @@
 /// \endcode
 ///
 /// You can change the listen port and the simulated baud rate with 
-/// command line arguments passed to etherSimulator.pl
+/// command line arguments passed to etherSimulator or etherSimulator.pl
+///
+/// \par Virtual time
+///
+/// Normally the simulated sketches and the ether simulator run in real time, so a simulation
+/// takes as long as the real thing would, and the results depend on process scheduling.
+/// If etherSimulator is run with -v, and every sketch with --virtual-time, they share a virtual clock instead.
+/// millis(), delay() and YIELD in the sketches use the virtual clock, and the ether simulator only
+/// moves it on when every sketch is idle, straight to the next delivery or wakeup. 
+/// Simulations then run as fast as the processes can go. 
+/// Give the ether simulator the number of sketches to expect with -n, 
+/// so the clock does not start until they are all connected, and give a seed for the random 
+/// number generators to the ether simulator with -s and to each sketch with --seed=N, 
+/// and the simulation will run exactly the same way each time:
+/// \code
+/// ./etherSimulator -v -n 2 -s 1
+/// ./simulator_reliable_datagram_server --virtual-time --seed=1
+/// ./simulator_reliable_datagram_client --virtual-time --seed=1
+/// \endcode
+/// etherSimulator.pl does not support virtual time.
+///
+/// \par Many nodes in one process
+///
+/// Simulating a large network as separate processes means a process and a socket for every node,
+/// and a lot of context switching. Instead, sketches can be built with simBuild --hosted as shared libraries,
+/// and run as nodes within a single tools/simHost process. Each node gets its own copy of the sketch,
+/// the library and their globals, and runs in a coroutine of its own in virtual time. 
+/// RH_TCP then passes its messages to the ether in simHost with function calls instead of a socket.
+/// Sketches need no changes, but must use RH_TCP, and must not read the command line options 
+/// of other nodes, since argv is their own.
+/// \code
+/// tools/simBuild --hosted examples/simulator/simulator_mesh_node/simulator_mesh_node.pde
+/// g++ -O2 -I . -pthread -rdynamic tools/simHost.cpp tools/ether.cpp -o simHost -ldl
+/// # A 20 node mesh for 10 minutes of virtual time:
+/// for i in $(seq 1 20); do echo "simulator_mesh_node.so $i"; done > nodes
+/// ./simHost -t 600 -s 1 -f nodes
+/// \endcode
+///
+/// \par Radio model
+///
+/// etherSimulator.cpp and simHost model each packet as being in the air for its length at the sender's 
+/// data rate. A node hears a packet if it is on the same channel at the same data rate, is not transmitting 
+/// itself, and the delivery probability in the config file allows. Packets that overlap
+/// at a receiver on the same or adjacent channels collide, and are both lost, unless one is received at least 
+/// 6dB stronger than the other, in which case it is captured. Nodes start on channel 0 at the data rate 
+/// given to the ether simulator with -b, transmitting at 0dBm. Use setChannel() and setRF() to change them.
+/// The ether simulator tells each node the power it received each packet at (the transmit power less the 
+/// path loss, when the config file gives node positions), and lastRssi() returns it, as with a real radio.
+/// etherSimulator.pl only models collisions between packets arriving at the same time.
+///
+/// \par Packet capture
+///
+/// etherSimulator.cpp and simHost can capture every packet transmitted, delivered or lost in a collision
+/// to a pcap file with -w, for offline analysis of latency, retransmissions and losses with standard tools,
+/// without adding Serial prints to the sketches, which change their timing. 
+/// Timestamps are simulated time since the simulation started. Each packet is recorded with link type
+/// LINKTYPE_USER0, as an 8 octet header giving the event, the node address, channel, power in dBm
+/// and data rate, followed by the TO, FROM, ID and FLAGS headers and the payload (see EtherPcapHeader in tools/ether.h).
+/// Captured packets are written out by a thread of their own, so capture does not slow delivery.
+/// \code
+/// ./simHost -t 600 -s 1 -f nodes -w mesh.pcap
+/// ./etherSimulator -w - | wireshark -k -i -
+/// \endcode
 ///
 /// \par Implementation
 ///
-/// etherServer.pl is a conventional server written in Perl.
+/// etherSimulator.pl is a conventional server written in Perl.
 /// listens on a TCP socket (defaults to port 4000) for connections from sketch simulators
 /// using RH_TCP as theur driver.
 /// The simulated sketches send messages out to the 'ether' over the TCP connection to the etherServer.
 /// etherServer manages the delivery of each message to any other RH_TCP sketches that are running.
 ///
+/// etherSimulator.cpp is a native equivalent, with the same command line options and config file,
+/// sharing its model of the ether (in ether.cpp) with simHost.cpp,
+/// built on Linux epoll. It schedules each delivery on a timer wheel with 100 microsecond resolution,
+/// instead of polling all the clients every millisecond, so it can serve hundreds of simulated 
+/// nodes with sub-millisecond delivery jitter.
+///
 /// \par Prerequisites
 ///
 /// g++ compiler installed and in your $PATH
-/// Perl
-/// Perl POE library
+/// Perl and the Perl POE library (only if you use etherSimulator.pl)
 ///
 class RH_TCP : public RHGenericDriver
 {
@@ -98,6 +181,19 @@ public:
     /// \return true if a valid message was copied to buf
     virtual bool recv(uint8_t* buf, uint8_t* len);
 
+    /// Blocks until a valid received message is available.
+    /// In real time, sleeps in poll() on the connection to the ether simulator server
+    /// instead of spinning on available(), so an idle simulated node uses no CPU.
+    /// In virtual time, idles with YIELD, which lets the virtual clock move on, and returns
+    /// as soon as a packet is delivered.
+    virtual void waitAvailable();
+
+    /// Blocks until a received message is available or a timeout, sleeping as for waitAvailable().
+    /// The manager classes wait with this, so they sleep too.
+    /// \param[in] timeout Maximum time to wait in milliseconds.
+    /// \return true if a message is available
+    virtual bool waitAvailableTimeout(uint16_t timeout);
+
     /// Waits until any previous transmit packet is finished being transmitted with waitPacketSent().
     /// Then loads a message into the transmitter and starts the transmitter. Note that a message length
     /// of 0 is NOT permitted. If the message is too long for the underlying radio technology, send() will
@@ -107,6 +203,13 @@ public:
     /// \return true if the message length was valid and it was correctly queued for transmit
     virtual bool send(const uint8_t* data, uint8_t len);
 
+    /// Like send(), but the message is in several fragments, which are gathered straight into the 
+    /// message to the ether simulator. See RHGenericDriver::sendFragments()
+    /// \param[in] fragments The pieces of the message, in order
+    /// \param[in] count Number of fragments
+    /// \return true if the message length was valid and it was correctly queued for transmit
+    virtual bool sendFragments(const Fragment* fragments, uint8_t count);
+
     /// Returns the maximum message length 
     /// available in this Driver.
     /// \return The maximum legal message length
@@ -123,6 +226,32 @@ public:
     /// \param[in] address The address of this node.
     void setThisAddress(uint8_t address);
 
+    /// Used when the simulator is running in virtual time (--virtual-time). 
+    /// Tells the ether simulator that this node has nothing to do until the given virtual time, 
+    /// then waits until the ether simulator says the simulation has got there.
+    /// Packets delivered in the meantime are received as usual.
+    /// init() arranges for this to be called by delay() and YIELD, so you would not normally call it yourself.
+    /// \param[in] until The virtual time in microseconds to sleep until
+    /// \param[in] wakeOnPacket If true, wake as soon as a packet is delivered to this node, at the 
+    /// virtual time its transmission ends, instead of waiting until the given time. YIELD does this
+    /// \return The virtual time in microseconds now
+    uint64_t sleepUntil(uint64_t until, bool wakeOnPacket = false);
+
+    /// Sets the simulated radio channel. Only nodes on the same channel and data rate hear each other,
+    /// and transmissions collide with others on the same or adjacent channels.
+    /// Ignored by etherSimulator.pl
+    /// \param[in] channel The channel number. Defaults to 0
+    /// \return true if the ether simulator was told
+    bool setChannel(uint8_t channel);
+
+    /// Sets the simulated data rate and transmit power. The data rate determines how long
+    /// each packet is in the air, and the power which of two colliding packets is received, if either.
+    /// Ignored by etherSimulator.pl
+    /// \param[in] bitsPerSecond Data rate. 0 (the default) for the rate given to the ether simulator with -b
+    /// \param[in] power Transmit power in dBm. Defaults to 0
+    /// \return true if the ether simulator was told
+    bool setRF(uint32_t bitsPerSecond, int8_t power);
+
 protected:
 
 private:
@@ -130,11 +259,28 @@ private:
     /// Prepares the socket for use.
     bool connectToServer();
 
-    /// Check for new messages from the ether simulator server
+    /// Sleeps until the ether simulator server sends something, or a timeout
+    /// \param[in] timeout Maximum time to wait in milliseconds, or -1 to wait for ever
+    void waitForEvents(int timeout);
+
+    /// Check for new messages from the ether simulator server.
+    /// Reads everything available into the ring buffer, and handles every complete message in it
     void checkForEvents();
 
-    /// Clear the receive buffer
-    void clearRxBuf();
+    /// Handle the complete messages in the ring buffer, removing them from it
+    void handleMessages();
+
+    /// Copy octets out of the ring buffer, taking care of wrapping round the end
+    /// \param[in] offset Offset of the first octet to copy from the start of the unhandled octets
+    /// \param[in] dest Where to copy them
+    /// \param[in] len Number of octets to copy
+    void socketBufCopy(uint16_t offset, void* dest, uint16_t len);
+
+    /// Writes a complete RHTcpProtocol message to the ether simulator server
+    /// \param[in] message The message, starting with its length
+    /// \param[in] len Number of octets in the message
+    /// \return true if successful
+    bool writeMessage(const void* message, size_t len);
 
     /// Sends thisAddress to the ether simulator server
     /// in a RHTcpThisAddress message.
@@ -144,10 +290,21 @@ private:
 
     /// Sends a message to the ether simulator server for delivery to
     /// other nodes
-    /// \param[in] data Array of data to be sent
-    /// \param[in] len Number of bytes of data to send (> 0)
+    /// \param[in] fragments The pieces of the message, in order
+    /// \param[in] count Number of fragments
     /// \return true if successful
-    bool sendPacket(const uint8_t* data, uint8_t len);
+    bool sendPacket(const Fragment* fragments, uint8_t count);
+
+    /// Sends a RHTcpSleep message to the ether simulator server
+    /// \param[in] until The virtual time in microseconds to sleep until
+    /// \param[in] wakeOnPacket True to be woken early by a packet
+    /// \return true if successful
+    bool sendSleep(uint64_t until, bool wakeOnPacket);
+
+    /// Sends the radio settings to the ether simulator server
+    /// in a RHTcpRadio message.
+    /// \return true if successful
+    bool sendRadio();
 
     /// Address and port of the server to which messages are sent
     /// and received using the protocol RHTcpPRotocol
@@ -156,21 +313,43 @@ private:
     /// The TCP socket used to communicate with the message server
     int         _socket;
 
-    /// Buffer to receive RHTcpProtocol messages
-    uint8_t     _rxBuf[RH_TCP_MAX_PAYLOAD_LEN + 5];
-    uint16_t    _rxBufLen;
-    bool        _rxBufValid;
+    /// Ring buffer of octets read from the ether simulator server, with room for several messages.
+    /// Each instance has its own, so there can be several connections
+    uint8_t     _socketBuf[RH_TCP_SOCKETBUF_LEN];
+
+    /// Index in _socketBuf of the first octet not yet handled
+    uint16_t    _socketBufHead;
+
+    /// Number of octets in _socketBuf not yet handled
+    uint16_t    _socketBufLen;
+
+    /// Storage for the queue of received packets, see RHGenericDriver::rxQueueInit()
+    uint8_t     _rxQueueBuf[RH_TCP_RX_QUEUE_LEN][RH_TCP_MAX_MESSAGE_LEN + RH_RX_QUEUE_OVERHEAD];
+
+    /// Check whether a received packet is addressed to this node
+    /// \param[in] to The TO header of the packet
+    /// \return true if the packet should be received
+    bool            validateRxBuf(uint8_t to);
+
+    /// Set when the ether simulator sends a RHTcpTime message
+    bool            _timeGranted;
+
+    /// The virtual time in the last RHTcpTime message
+    uint64_t        _virtualNow;
 
-    /// Check whether the latest received message is complete and uncorrupted
-    void            validateRxBuf();
+    /// Radio settings from setChannel() and setRF()
+    uint8_t         _channel;
+    uint32_t        _bitsPerSecond;
+    int8_t          _power;
 
-    // Used in the interrupt handlers
-    /// Buf is filled but not validated
-    volatile bool   _rxBufFull;
+    /// The data rate the ether simulator is actually using for this node, from the RHTcpRadio
+    /// it sends back. 0 until it has said
+    uint32_t        _etherBitsPerSecond;
 
 };
 
 /// @example simulator_reliable_datagram_client.pde
 /// @example simulator_reliable_datagram_server.pde
+/// @example simulator_mesh_node.pde
 
 #endif
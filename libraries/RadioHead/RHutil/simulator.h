@@ -10,6 +10,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <sys/types.h>
 
 // Equivalent types for common Arduino types like uint8_t are in stdint.h
 
@@ -20,10 +21,51 @@ extern char** _simulator_argv;
 
 // Definitions for various Arduino functions
 extern void delay(unsigned long ms);
+extern void delayMicroseconds(unsigned int us);
 extern unsigned long millis();
 extern long random(long to);
 extern long random(long from, long to);
 
+// Virtual time.
+// If the process is run with --virtual-time, millis(), delay() and YIELD use a simulated clock
+// instead of the real one. The clock only moves when the sketch is idle (in delay() or YIELD), 
+// and a driver that talks to an ether simulator (RH_TCP) can register an idle handler so all the 
+// simulated processes sharing that ether move through virtual time together, 
+// as fast as they can run. See simMain.cpp
+extern bool _simulator_virtual_time;
+// The idle handler is called with the virtual time in microseconds that the sketch is idle until,
+// and whether the sketch is only waiting for something to receive, in which case the handler should 
+// return as soon as its driver has a packet delivered, as YIELD would on an interrupt.
+// It must return the virtual time the simulation has reached when the sketch is to resume,
+// which will not be before the time asked for unless woken by a packet.
+typedef uint64_t (*SimulatorIdleHandler)(uint64_t until, bool wakeOnPacket);
+extern void simulator_set_idle_handler(SimulatorIdleHandler handler);
+// Virtual time since the start of the simulation in microseconds
+extern uint64_t simulator_micros();
+// Implements YIELD on the simulator
+extern void simulator_yield();
+
+#ifdef RH_SIMULATOR_HOSTED
+// A sketch built with simBuild --hosted runs as one of many nodes within a single tools/simHost process,
+// always in virtual time. Its driver talks to the host's in-memory ether through these, 
+// instead of a socket to etherSimulator. See simHost.cpp
+extern "C"
+{
+    // Returns a new connection to the ether, or -1
+    int     simhost_connect();
+    // Like write() and read() on a non-blocking socket
+    ssize_t simhost_write(int connection, const void* buf, size_t len);
+    ssize_t simhost_read(int connection, void* buf, size_t len);
+    // Lets the other nodes run until there is something to read from the connection
+    void    simhost_wait(int connection);
+}
+#endif
+
+// Arduino strings in program memory, which are ordinary strings here
+class __FlashStringHelper;
+#define F(string_literal) (reinterpret_cast<const __FlashStringHelper *>(string_literal))
+typedef uint8_t byte;
+
 // Equavalent to HaardwareSerial in Arduino
 class SerialSimulator
 {
@@ -36,32 +78,82 @@ public:
     // TODO: move these from being inlined
     void begin(int baud) {}
 
+    size_t println()
+    {
+	return printf("\n");
+    }
     size_t println(const char* s)
     {
-	print(s);
-	printf("\n");
+	return print(s) + println();
     }
     size_t print(const char* s)
     {
-	printf(s);
+	return fputs(s, stdout) < 0 ? 0 : strlen(s);
     }
-    size_t print(unsigned int n, int base = DEC)
+    size_t print(const __FlashStringHelper* s)
+    {
+	return print(reinterpret_cast<const char*>(s));
+    }
+    size_t println(const __FlashStringHelper* s)
+    {
+	return print(s) + println();
+    }
+    size_t print(unsigned long n, int base = DEC)
     {
 	if (base == DEC)
-	    printf("%d", n);
+	    return printf("%lu", n);
 	else if (base == HEX)
-	    printf("%02x", n);
+	    return printf("%02lx", n);
 	else if (base == OCT)
-	    printf("%o", n);
+	    return printf("%lo", n);
 	// TODO: BIN
+	return 0;
+    }
+    size_t println(unsigned long n, int base = DEC)
+    {
+	return print(n, base) + println();
+    }
+    size_t print(long n, int base = DEC)
+    {
+	if (base == DEC)
+	    return printf("%ld", n);
+	return print((unsigned long)n, base);
+    }
+    size_t println(long n, int base = DEC)
+    {
+	return print(n, base) + println();
+    }
+    size_t print(unsigned int n, int base = DEC)
+    {
+	return print((unsigned long)n, base);
+    }
+    size_t println(unsigned int n, int base = DEC)
+    {
+	return print(n, base) + println();
+    }
+    size_t print(int n, int base = DEC)
+    {
+	return print((long)n, base);
+    }
+    size_t println(int n, int base = DEC)
+    {
+	return print(n, base) + println();
+    }
+    size_t print(double n, int digits = 2)
+    {
+	return printf("%.*f", digits, n);
+    }
+    size_t println(double n, int digits = 2)
+    {
+	return print(n, digits) + println();
     }
     size_t print(char ch)
     {
-        printf("%c", ch);
+        return printf("%c", ch);
     }
     size_t println(char ch)
     {
-        printf("%c\n", ch);
+        return printf("%c\n", ch);
     }
     size_t print(unsigned char ch, int base = DEC)
     {
@@ -69,8 +161,7 @@ public:
     }
     size_t println(unsigned char ch, int base = DEC)
     {
-	print((unsigned int)ch, base);
-	printf("\n");
+	return print(ch, base) + println();
     }
 
 };
@@ -101,7 +101,7 @@
 ///
 /// - RH_TCP
 /// For use with simulated sketches compiled and running on Linux.
-/// Works with tools/etherSimulator.pl to pass messages between simulated sketches, allowing
+/// Works with tools/etherSimulator.pl or tools/etherSimulator.cpp to pass messages between simulated sketches, allowing
 /// testing of Manager classes on Linux and without need for real radios or other transport hardware.
 ///
 /// Drivers can be used on their own to provide unaddressed, unreliable datagrams. 
@@ -575,12 +575,24 @@
  #define ATOMIC_BLOCK_END
 #endif
 
+////////////////////////////////////////////////////
+// Stops the compiler moving memory accesses across this point, 
+// eg so that an interrupt handler finishes writing a message before it publishes it
+#if defined(__GNUC__)
+ #define RH_MEMORY_BARRIER __asm__ __volatile__ ("" ::: "memory");
+#else
+ #define RH_MEMORY_BARRIER
+#endif
+
 ////////////////////////////////////////////////////
 // Try to be compatible with systems that support yield() and multitasking
 // instead of spin-loops
 // Recent Arduino IDE or Teensy 3 has yield()
 #if (RH_PLATFORM == RH_PLATFORM_ARDUINO && ARDUINO >= 155 && !defined(RH_PLATFORM_ATTINY)) || (TEENSYDUINO && defined(__MK20DX128__))
  #define YIELD yield();
+#elif (RH_PLATFORM == RH_PLATFORM_SIMULATOR)
+ // Lets virtual time move on while the sketch spins
+ #define YIELD simulator_yield();
 #else
  #define YIELD
 #endif
@@ -0,0 +1,114 @@
+// simulator_mesh_node.pde
+// -*- mode: C++ -*-
+// Example sketch showing how to simulate a large mesh network with the RHMesh class,
+// using the RH_TCP driver. Every node runs the same sketch, with its address on the command line.
+// Node 1 is the sink, and replies to every message it gets. All the other nodes repeatedly
+// send to the sink, discovering a route first if need be, and print how long it took to get a reply.
+// Sends are started with startSendto(), so every node goes on relaying for the others 
+// while it discovers a route or waits for its reply.
+// Tested on Linux
+// Build with
+// cd whatever/RadioHead 
+// tools/simBuild --hosted examples/simulator/simulator_mesh_node/simulator_mesh_node.pde
+// g++ -O2 -I . -pthread -rdynamic tools/simHost.cpp tools/ether.cpp -o simHost -ldl
+// Run 200 nodes for 10 minutes of virtual time with
+// for i in $(seq 1 200); do echo "simulator_mesh_node.so $i"; done > nodes
+// ./simHost -t 600 -s 1 -f nodes
+// Limit who can hear who with a config file given to simHost -c to make routes of more than one hop.
+// It can also be run as separate processes with tools/simBuild and etherSimulator
+
+#include <RHMesh.h>
+#include <RH_TCP.h>
+
+#define SINK_ADDRESS 1
+
+// Singleton instance of the radio driver
+RH_TCP driver;
+
+// Class to manage message delivery and receipt, using the driver declared above
+RHMesh manager(driver, SINK_ADDRESS);
+
+void setup() 
+{
+  Serial.begin(9600);
+  // Set this address from the command line
+  if (_simulator_argc >= 2)
+     manager.setThisAddress(atoi(_simulator_argv[1]));
+  if (!manager.init())
+    Serial.println("init failed");
+  // Dont all start at once
+  delay(random(10000));
+}
+
+uint8_t data[] = "Hello World!";
+// Dont put this on the stack:
+uint8_t buf[RH_MESH_MAX_MESSAGE_LEN];
+
+// Handle of the send in progress, if any
+uint8_t handle = 0;
+// When the last message was started, and when to start the next one
+unsigned long start = 0;
+unsigned long next = 0;
+// True between delivering a message to the next hop and getting the reply or giving up
+bool waiting = false;
+
+void loop()
+{
+  uint8_t len = sizeof(buf);
+  uint8_t from;    
+  // Relay, and answer route discoveries for, everyone else
+  bool received = manager.recvfromAck(buf, &len, &from);
+  if (manager.thisAddress() == SINK_ADDRESS)
+  {
+    // Reply to anyone who asks
+    if (received)
+      manager.sendtoWait(buf, len, from);
+    YIELD;
+    return;
+  }
+
+  manager.poll();
+  if (received && from == SINK_ADDRESS && waiting)
+  {
+    Serial.print(manager.thisAddress());
+    Serial.print(": reply from sink in ");
+    Serial.print(millis() - start);
+    Serial.println(" ms");
+    waiting = false;
+  }
+  if (handle)
+  {
+    uint8_t error = manager.sendtoResult(handle);
+    if (error != RH_MESH_SEND_PENDING)
+    {
+      handle = 0;
+      if (error == RH_ROUTER_ERROR_NONE)
+      {
+	// It has been reliably delivered to the next node.
+	// Now wait for a reply from the sink
+	waiting = true;
+	next = millis() + 3000;
+      }
+      else
+      {
+	Serial.print(manager.thisAddress());
+	Serial.print(": sendtoWait failed: ");
+	Serial.println(error);
+      }
+    }
+  }
+  else if (waiting && (long)(millis() - next) >= 0)
+  {
+    Serial.print(manager.thisAddress());
+    Serial.println(": no reply");
+    waiting = false;
+  }
+  else if (!waiting && (long)(millis() - next) >= 0)
+  {
+    // A route to the sink will be automatically discovered.
+    start = millis();
+    next = start + 1000 + random(1000);
+    handle = manager.startSendto(data, sizeof(data), SINK_ADDRESS);
+  }
+  YIELD;
+}
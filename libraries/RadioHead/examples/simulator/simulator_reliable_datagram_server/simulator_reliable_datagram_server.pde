@@ -38,7 +38,8 @@ uint8_t buf[RH_TCP_MAX_MESSAGE_LEN];
 
 void loop()
 {
-  if (manager.available())
+  // Sleep until something arrives, rather than spinning on available()
+  manager.waitAvailable();
   {
     // Wait for a message addressed to us from the client
     uint8_t len = sizeof(buf);
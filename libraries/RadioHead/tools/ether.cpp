@@ -0,0 +1,913 @@
+// ether.cpp
+//
+// The simulated luminiferous ether shared by etherSimulator.cpp and simHost.cpp. See ether.h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
+#include <arpa/inet.h>
+#include <endian.h>
+#include <algorithm>
+#include "ether.h"
+
+uint64_t monotonicMicros()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/////////////////////////////////////////////////////////////////////
+TimerWheel::TimerWheel()
+    : _currentTick(0),
+      _count(0)
+{
+    for (uint32_t i = 0; i < ETHER_WHEEL_SLOTS; i++)
+	_slots[i].next = _slots[i].prev = &_slots[i];
+    memset(_occupied, 0, sizeof(_occupied));
+}
+
+void TimerWheel::init(Timer* timer, void* context)
+{
+    timer->next = timer->prev = NULL;
+    timer->expiry = 0;
+    timer->context = context;
+}
+
+bool TimerWheel::isPending(const Timer* timer)
+{
+    return timer->next != NULL;
+}
+
+void TimerWheel::start(Timer* timer, uint64_t tick)
+{
+    cancel(timer);
+    if (tick <= _currentTick)
+	tick = _currentTick + 1;
+    timer->expiry = tick;
+    uint32_t slot = tick & (ETHER_WHEEL_SLOTS - 1);
+    Timer* head = &_slots[slot];
+    timer->next = head;
+    timer->prev = head->prev;
+    head->prev->next = timer;
+    head->prev = timer;
+    _occupied[slot / 64] |= (uint64_t)1 << (slot % 64);
+    _count++;
+}
+
+void TimerWheel::cancel(Timer* timer)
+{
+    if (!isPending(timer))
+	return;
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    uint32_t slot = timer->expiry & (ETHER_WHEEL_SLOTS - 1);
+    if (_slots[slot].next == &_slots[slot])
+	_occupied[slot / 64] &= ~((uint64_t)1 << (slot % 64));
+    timer->next = timer->prev = NULL;
+    _count--;
+}
+
+uint32_t TimerWheel::nextOccupied(uint32_t after)
+{
+    while (after <= ETHER_WHEEL_SLOTS)
+    {
+	uint32_t slot = (_currentTick + after) & (ETHER_WHEEL_SLOTS - 1);
+	uint64_t bits = _occupied[slot / 64] >> (slot % 64);
+	if (bits)
+	    return after + __builtin_ctzll(bits);
+	// Nothing in the rest of this word
+	after += 64 - (slot % 64);
+    }
+    return ETHER_WHEEL_SLOTS + 1;
+}
+
+bool TimerWheel::expiresBefore(const Timer* a, const Timer* b)
+{
+    return a->expiry < b->expiry;
+}
+
+void TimerWheel::advance(uint64_t tick, std::vector<Timer*>& expired)
+{
+    if (tick <= _currentTick)
+	return;
+    // Each slot only needs to be examined once, however far we have to go
+    uint64_t slots = tick - _currentTick;
+    if (slots > ETHER_WHEEL_SLOTS)
+	slots = ETHER_WHEEL_SLOTS;
+    size_t first = expired.size();
+    for (uint32_t t = nextOccupied(1); _count && t <= slots; t = nextOccupied(t + 1))
+    {
+	Timer* head = &_slots[(_currentTick + t) & (ETHER_WHEEL_SLOTS - 1)];
+	Timer* timer = head->next;
+	while (timer != head)
+	{
+	    Timer* next = timer->next;
+	    if (timer->expiry <= tick)
+	    {
+		cancel(timer);
+		expired.push_back(timer);
+	    }
+	    timer = next;
+	}
+    }
+    // The slots come out in expiry order, unless we went more than a revolution,
+    // when a slot can hold timers from several revolutions
+    if (tick - _currentTick > ETHER_WHEEL_SLOTS)
+	std::stable_sort(expired.begin() + first, expired.end(), expiresBefore);
+    _currentTick = tick;
+}
+
+bool TimerWheel::nextExpiry(uint64_t* tick)
+{
+    if (!_count)
+	return false;
+    // The first timer in the next revolution is the next to expire, if there is one.
+    // Otherwise it is the earliest of all of them
+    uint64_t earliest = UINT64_MAX;
+    for (uint32_t t = nextOccupied(1); t <= ETHER_WHEEL_SLOTS; t = nextOccupied(t + 1))
+    {
+	Timer* head = &_slots[(_currentTick + t) & (ETHER_WHEEL_SLOTS - 1)];
+	for (Timer* timer = head->next; timer != head; timer = timer->next)
+	{
+	    if (timer->expiry == _currentTick + t)
+	    {
+		*tick = timer->expiry;
+		return true;
+	    }
+	    earliest = std::min(earliest, timer->expiry);
+	}
+    }
+    *tick = earliest;
+    return true;
+}
+
+/////////////////////////////////////////////////////////////////////
+PcapWriter::PcapWriter()
+    : _file(NULL),
+      _running(false),
+      _stopping(false)
+{
+    pthread_mutex_init(&_mutex, NULL);
+    pthread_cond_init(&_cond, NULL);
+}
+
+PcapWriter::~PcapWriter()
+{
+    if (_running)
+    {
+	pthread_mutex_lock(&_mutex);
+	_stopping = true;
+	pthread_cond_signal(&_cond);
+	pthread_mutex_unlock(&_mutex);
+	pthread_join(_thread, NULL);
+    }
+    if (_file && _file != stdout)
+	fclose(_file);
+    pthread_cond_destroy(&_cond);
+    pthread_mutex_destroy(&_mutex);
+}
+
+bool PcapWriter::open(const char* filename, uint32_t linkType)
+{
+    _file = strcmp(filename, "-") == 0 ? stdout : fopen(filename, "wb");
+    if (!_file)
+    {
+	fprintf(stderr, "Could not create capture file %s: %s\n", filename, strerror(errno));
+	return false;
+    }
+    // pcap file header, in our own byte order, which readers work out from the magic number
+    uint32_t header[6];
+    header[0] = 0xa1b2c3d4;        // Magic number: microsecond timestamps
+    header[1] = 2 | (4 << 16);     // Version 2.4
+    header[2] = 0;                 // Timestamps are UTC
+    header[3] = 0;                 // Timestamp accuracy
+    header[4] = 65535;             // Snapshot length
+    header[5] = linkType;
+    fwrite(header, sizeof(header), 1, _file);
+    fflush(_file);
+    _pending.reserve(ETHER_PCAP_BUFFER_LEN * 2);
+
+    if (pthread_create(&_thread, NULL, run, this) != 0)
+    {
+	fprintf(stderr, "Could not start capture thread\n");
+	return false;
+    }
+    _running = true;
+    return true;
+}
+
+void PcapWriter::write(uint64_t micros, const void* header, uint16_t headerLen, const uint8_t* data, uint16_t len)
+{
+    uint32_t record[4];
+    record[0] = micros / 1000000;      // Timestamp seconds
+    record[1] = micros % 1000000;      // Timestamp microseconds
+    record[2] = record[3] = headerLen + len; // Captured and original lengths
+
+    pthread_mutex_lock(&_mutex);
+    _pending.insert(_pending.end(), (const uint8_t*)record, (const uint8_t*)record + sizeof(record));
+    _pending.insert(_pending.end(), (const uint8_t*)header, (const uint8_t*)header + headerLen);
+    _pending.insert(_pending.end(), data, data + len);
+    if (_pending.size() >= ETHER_PCAP_BUFFER_LEN)
+	pthread_cond_signal(&_cond);
+    pthread_mutex_unlock(&_mutex);
+}
+
+void* PcapWriter::run(void* arg)
+{
+    ((PcapWriter*)arg)->writeRecords();
+    return NULL;
+}
+
+void PcapWriter::writeRecords()
+{
+    // Swap in an empty buffer and write out the full one without holding the lock,
+    // so the ether never waits for the disk
+    std::vector<uint8_t> writing;
+    writing.reserve(ETHER_PCAP_BUFFER_LEN * 2);
+    pthread_mutex_lock(&_mutex);
+    while (1)
+    {
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += 1;
+	while (!_stopping && _pending.size() < ETHER_PCAP_BUFFER_LEN)
+	    if (pthread_cond_timedwait(&_cond, &_mutex, &deadline) == ETIMEDOUT)
+		break;
+	bool stopping = _stopping;
+	_pending.swap(writing);
+	pthread_mutex_unlock(&_mutex);
+
+	if (!writing.empty())
+	{
+	    fwrite(&writing[0], writing.size(), 1, _file);
+	    fflush(_file);
+	    writing.clear();
+	}
+	if (stopping)
+	    return;
+	pthread_mutex_lock(&_mutex);
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+EtherClient::EtherClient()
+    : dead(false),
+      haveAddress(false),
+      thisAddress(0),
+      rxBufLen(0),
+      channel(0),
+      bps(0),
+      power(0),
+      txEnd(0),
+      packetLen(0),
+      rxEnd(0),
+      rxPower(0),
+      rxInterference(-INFINITY),
+      sleeping(false),
+      wakeOnPacket(false)
+{
+    TimerWheel::init(&timer, this);
+    TimerWheel::init(&wakeTimer, this);
+}
+
+// Rounds a power in dBm to the nearest whole dBm that fits in an int8_t
+static int8_t wholeDbm(float power)
+{
+    return (int8_t)std::max(-128.0f, std::min(127.0f, roundf(power)));
+}
+
+// Clients are kept in order of node address, so what happens at any instant
+// does not depend on the order they happened to connect in
+static bool clientBefore(const EtherClient* a, const EtherClient* b)
+{
+    uint16_t aa = a->haveAddress ? a->thisAddress : 256;
+    uint16_t ba = b->haveAddress ? b->thisAddress : 256;
+    return aa < ba;
+}
+
+/////////////////////////////////////////////////////////////////////
+Ether::Ether(uint32_t bps)
+    : _startMicros(0),
+      _tickUsecs(ETHER_TICK_USECS),
+      _bps(bps),
+      _virtualTime(false),
+      _expectedClients(0),
+      _virtualMicros(0),
+      _connectedClients(0),
+      _replaying(false),
+      _pathLossExponent(ETHER_PATH_LOSS_EXPONENT),
+      _referenceLossDb(ETHER_REFERENCE_LOSS_DB),
+      _sensitivityDbm(ETHER_SENSITIVITY_DBM),
+      _scheduleNext(0),
+      _pcap(NULL)
+{
+    // If no explicit probability, use 1.0 (certainty), with no path loss or burst losses
+    Link link = { 1.0, 0.0, -1, false };
+    _links.assign(256 * 256, link);
+    memset(_positions, 0, sizeof(_positions));
+    _startMicros = monotonicMicros();
+}
+
+// config file for etherSimulator
+// Specify the probability of correct delivery between nodea and nodeb (bidirectional)
+// probability:nodea:nodeb:probability
+// nodea and nodeb are integers 0 to 255
+// probability is a float range 0.0 to 1.0
+// In this example, the probability of successful transmission
+// between nodes 10 and 2 (and vice versa) is given as 0.5 (ie 50% chance)
+// probability:10:2:0.5
+//
+// Optionally, place nodes on a floor plan, x and y in metres. The received power between
+// two placed nodes falls off with distance, and they cannot hear each other if it is below
+// the receiver sensitivity. Weaker signals also lose in collisions.
+// position:node:x:y
+// Change the log-distance path loss model, the loss in dB at 1 metre and the exponent:
+// pathloss:lossat1m:exponent
+// Change the receiver sensitivity in dBm:
+// sensitivity:dbm
+// Give the link between nodea and nodeb (bidirectional) Gilbert-Elliott burst losses:
+// packets are lost with probability lossgood in the good state and lossbad in the bad state,
+// and before each packet the link goes bad with probability tobad or good with probability togood.
+// This is in addition to the probability of delivery.
+// burst:nodea:nodeb:tobad:togood:lossgood:lossbad
+// Any of these lines can be prefixed with at:seconds: to make the change that many
+// seconds after the simulation starts, such as a node moving or a link fading:
+// at:60:probability:10:2:0.0
+// Lines starting with # are comments
+bool Ether::readConfig(const char* config)
+{
+    FILE* f = fopen(config, "r");
+    if (!f)
+    {
+	fprintf(stderr, "Could not open config file %s: %s\n", config, strerror(errno));
+	return false;
+    }
+    char line[256];
+    while (fgets(line, sizeof(line), f))
+    {
+	line[strcspn(line, "\r\n")] = 0;
+	if (line[0] == '#' || line[0] == 0)
+	    continue;
+	double seconds;
+	int offset;
+	if (sscanf(line, "at:%lf:%n", &seconds, &offset) == 1 && seconds >= 0)
+	    _schedule.push_back(std::make_pair((uint64_t)(seconds * 1000000), std::string(line + offset)));
+	else if (!configure(line))
+	    fprintf(stderr, "Ignoring unknown config line: %s\n", line);
+    }
+    fclose(f);
+    std::stable_sort(_schedule.begin(), _schedule.end(), scheduledBefore);
+    return true;
+}
+
+Ether::~Ether()
+{
+    delete _pcap;
+}
+
+bool Ether::capture(const char* filename)
+{
+    delete _pcap;
+    _pcap = new PcapWriter();
+    if (!_pcap->open(filename, ETHER_PCAP_LINKTYPE))
+    {
+	delete _pcap;
+	_pcap = NULL;
+	return false;
+    }
+    return true;
+}
+
+void Ether::capturePacket(uint64_t at, uint8_t event, const EtherClient* node, uint8_t channel, uint32_t bps,
+			  float power, const uint8_t* packet, uint16_t len)
+{
+    if (!_pcap)
+	return;
+    EtherPcapHeader header;
+    header.event = event;
+    header.node = node->haveAddress ? node->thisAddress : 0xff; // Broadcast
+    header.channel = channel;
+    header.power = wholeDbm(power);
+    header.bitsPerSecond = htonl(bps);
+    _pcap->write(at - _startMicros, &header, sizeof(header), packet, len);
+}
+
+bool Ether::scheduledBefore(const std::pair<uint64_t, std::string>& a, const std::pair<uint64_t, std::string>& b)
+{
+    return a.first < b.first;
+}
+
+bool Ether::configure(const char* line)
+{
+    unsigned int nodea, nodeb;
+    float a, b, c, d;
+    if (   sscanf(line, "probability:%u:%u:%f", &nodea, &nodeb, &a) == 3
+	&& nodea < 256 && nodeb < 256)
+    {
+	_links[nodea * 256 + nodeb].probability = a;
+	_links[nodeb * 256 + nodea].probability = a; // Bidirectional
+    }
+    else if (   sscanf(line, "position:%u:%f:%f", &nodea, &a, &b) == 3
+	     && nodea < 256)
+    {
+	_positions[nodea].known = true;
+	_positions[nodea].x = a;
+	_positions[nodea].y = b;
+	updatePathLoss(nodea);
+    }
+    else if (sscanf(line, "pathloss:%f:%f", &a, &b) == 2)
+    {
+	_referenceLossDb = a;
+	_pathLossExponent = b;
+	updatePathLoss(-1);
+    }
+    else if (sscanf(line, "sensitivity:%f", &a) == 1)
+    {
+	_sensitivityDbm = a;
+    }
+    else if (   sscanf(line, "burst:%u:%u:%f:%f:%f:%f", &nodea, &nodeb, &a, &b, &c, &d) == 6
+	     && nodea < 256 && nodeb < 256)
+    {
+	// Each direction has its own state, but they share the model
+	Burst burst = { a, b, c, d };
+	int16_t index = _links[nodea * 256 + nodeb].burst;
+	if (index < 0)
+	{
+	    index = _bursts.size();
+	    _bursts.push_back(burst);
+	}
+	else
+	    _bursts[index] = burst;
+	_links[nodea * 256 + nodeb].burst = index;
+	_links[nodeb * 256 + nodea].burst = index;
+    }
+    else
+	return false;
+    return true;
+}
+
+void Ether::updatePathLoss(int node)
+{
+    for (int i = 0; i < 256; i++)
+    {
+	if (node >= 0 && i != node)
+	    continue;
+	for (int j = 0; j < 256; j++)
+	{
+	    float lossDb = 0.0;
+	    if (_positions[i].known && _positions[j].known)
+	    {
+		float dx = _positions[i].x - _positions[j].x;
+		float dy = _positions[i].y - _positions[j].y;
+		// Closer than 1 metre is treated as 1 metre
+		float distance = std::max(sqrtf(dx * dx + dy * dy), 1.0f);
+		lossDb = _referenceLossDb + 10 * _pathLossExponent * log10f(distance);
+	    }
+	    _links[i * 256 + j].lossDb = lossDb;
+	    _links[j * 256 + i].lossDb = lossDb;
+	}
+    }
+}
+
+void Ether::applySchedule()
+{
+    uint64_t elapsed = now() - _startMicros;
+    while (_scheduleNext < _schedule.size() && _schedule[_scheduleNext].first <= elapsed)
+    {
+	if (!configure(_schedule[_scheduleNext].second.c_str()))
+	    fprintf(stderr, "Ignoring unknown config line: %s\n", _schedule[_scheduleNext].second.c_str());
+	_scheduleNext++;
+    }
+}
+
+void Ether::setVirtualTime(uint32_t expectedClients)
+{
+    _virtualTime = true;
+    _expectedClients = expectedClients;
+    // Virtual time starts at 0, and nothing need be late
+    _startMicros = 0;
+    _tickUsecs = 1;
+}
+
+bool Ether::isVirtualTime()
+{
+    return _virtualTime;
+}
+
+uint64_t Ether::now()
+{
+    return _virtualTime ? _virtualMicros : monotonicMicros();
+}
+
+void Ether::addClient(EtherClient* client)
+{
+    _clients.push_back(client);
+    _connectedClients++;
+}
+
+void Ether::disconnect(EtherClient* client)
+{
+    if (client->dead)
+	return;
+    client->dead = true;
+    if (_virtualTime)
+    {
+	if (client->haveAddress)
+	    fprintf(stderr, "etherSimulator: node %u disconnected at %llu us. Carrying on without it\n", 
+		    client->thisAddress, (unsigned long long)_virtualMicros);
+	else
+	    fprintf(stderr, "etherSimulator: client disconnected at %llu us. Carrying on without it\n", 
+		    (unsigned long long)_virtualMicros);
+	if (_connectedClients < _expectedClients)
+	    fprintf(stderr, "etherSimulator: still waiting for %u more clients to connect\n", 
+		    _expectedClients - _connectedClients);
+    }
+    _wheel.cancel(&client->timer);
+    _wheel.cancel(&client->wakeTimer);
+    size_t j = 0;
+    for (size_t i = 0; i < _onAir.size(); i++)
+	if (_onAir[i].sender != client)
+	    _onAir[j++] = _onAir[i];
+    _onAir.resize(j);
+    for (size_t i = 0; i < _clients.size(); i++)
+    {
+	if (_clients[i] == client)
+	{
+	    _clients.erase(_clients.begin() + i);
+	    break;
+	}
+    }
+}
+
+bool Ether::receive(EtherClient* client, const uint8_t* data, uint32_t len)
+{
+    while (len && !client->dead)
+    {
+	// Take as much as there is room for
+	uint32_t count = sizeof(client->rxBuf) - client->rxBufLen;
+	if (count > len)
+	    count = len;
+	memcpy(client->rxBuf + client->rxBufLen, data, count);
+	client->rxBufLen += count;
+	data += count;
+	len -= count;
+
+	// Handle all the complete messages we have
+	uint32_t offset = 0;
+	while (client->rxBufLen - offset >= sizeof(uint32_t))
+	{
+	    uint32_t messageLen;
+	    memcpy(&messageLen, client->rxBuf + offset, sizeof(messageLen));
+	    messageLen = ntohl(messageLen);
+	    if (messageLen > ETHER_MAX_MESSAGE_LEN)
+	    {
+		fprintf(stderr, "etherSimulator: client sent ridiculous length: %u. Corrupt message stream? Disconnecting\n", messageLen);
+		disconnect(client);
+		return false;
+	    }
+	    if (client->rxBufLen - offset < sizeof(messageLen) + messageLen)
+		break; // Wait for the rest of it
+	    if (messageLen > 0)
+		handleMessage(client, client->rxBuf + offset + sizeof(messageLen), messageLen);
+	    offset += sizeof(messageLen) + messageLen;
+	}
+	// Keep any partial message for next time
+	memmove(client->rxBuf, client->rxBuf + offset, client->rxBufLen - offset);
+	client->rxBufLen -= offset;
+    }
+    return true;
+}
+
+void Ether::handleMessage(EtherClient* client, const uint8_t* message, uint32_t len)
+{
+    uint8_t type = message[0];
+    if (type == RH_TCP_MESSAGE_TYPE_SLEEP && len >= 9)
+    {
+	// The flags octet was added later, so may not be there
+	if (!_virtualTime)
+	{
+	    fprintf(stderr, "etherSimulator: client is running in virtual time, but etherSimulator is not. Use -v\n");
+	    return;
+	}
+	// Client has nothing to do until the given virtual time
+	uint64_t until;
+	memcpy(&until, message + 1, sizeof(until));
+	until = be64toh(until);
+	client->sleeping = true;
+	client->wakeOnPacket = len >= 10 && (message[9] & RH_TCP_SLEEP_FLAG_WAKE_ON_PACKET);
+	if (until > _virtualMicros)
+	    _wheel.start(&client->wakeTimer, ticksAt(until));
+	// else it will wake at this instant, once everyone else is asleep too
+    }
+    else if (_virtualTime && !_replaying)
+    {
+	// Hold it until all the clients are finished with this instant
+	uint32_t nlen = htonl(len);
+	client->held.insert(client->held.end(), (const uint8_t*)&nlen, (const uint8_t*)&nlen + sizeof(nlen));
+	client->held.insert(client->held.end(), message, message + len);
+    }
+    else if (type == RH_TCP_MESSAGE_TYPE_THISADDRESS && len >= 2)
+    {
+	// Client notifies us of its node ID
+	client->thisAddress = message[1];
+	client->haveAddress = true;
+	std::stable_sort(_clients.begin(), _clients.end(), clientBefore);
+    }
+    else if (type == RH_TCP_MESSAGE_TYPE_RADIO && len >= 7)
+    {
+	// Client has changed channel, data rate or power
+	uint32_t bps;
+	memcpy(&bps, message + 2, sizeof(bps));
+	client->channel = message[1];
+	client->bps = ntohl(bps);
+	client->power = (int8_t)message[6];
+	// Tell it what we will actually use
+	uint8_t radio[6];
+	radio[0] = client->channel;
+	bps = htonl(bpsOf(client));
+	memcpy(radio + 1, &bps, sizeof(bps));
+	radio[5] = (uint8_t)client->power;
+	sendMessage(client, RH_TCP_MESSAGE_TYPE_RADIO, radio, sizeof(radio));
+    }
+    else if (type == RH_TCP_MESSAGE_TYPE_PACKET)
+    {
+	// New packet for transmission: the headers and payload following the type
+	transmit(client, message + 1, len - 1);
+    }
+    // Else ignore it
+}
+
+void Ether::transmit(EtherClient* sender, const uint8_t* packet, uint16_t len)
+{
+    if (len > RH_TCP_MAX_PAYLOAD_LEN)
+	len = RH_TCP_MAX_PAYLOAD_LEN;
+
+    // Packets are delivered after the nominal transmission time is complete,
+    // given the message length and the sender's bits per second
+    uint64_t start = now();
+    uint64_t end = start + (uint64_t)len * 8 * 1000000 / bpsOf(sender);
+
+    // Catch up with any changes to the links since the last packet
+    applySchedule();
+    capturePacket(start, ETHER_PCAP_EVENT_TRANSMIT, sender, sender->channel, bpsOf(sender), sender->power, packet, len);
+
+    // Forget transmissions that are over
+    size_t j = 0;
+    for (size_t i = 0; i < _onAir.size(); i++)
+	if (_onAir[i].end > start)
+	    _onAir[j++] = _onAir[i];
+    _onAir.resize(j);
+
+    // The radio is half duplex, so the sender loses anything it was receiving
+    if (TimerWheel::isPending(&sender->timer))
+    {
+	_wheel.cancel(&sender->timer);
+	capturePacket(start, ETHER_PCAP_EVENT_COLLISION, sender, sender->channel, bpsOf(sender),
+		      sender->rxPower, sender->packet, sender->packetLen);
+    }
+    sender->txEnd = end;
+
+    // Try to deliver the packet to all the other clients
+    for (size_t i = 0; i < _clients.size(); i++)
+    {
+	EtherClient* client = _clients[i];
+	if (client == sender || client->dead)
+	    continue; // Dont deliver back to the same client
+
+	// Check the network config and see if this node is in range at all
+	if (!channelsOverlap(sender, client) || probabilityOfSuccessfulDelivery(sender, client) <= 0.0)
+	    continue;
+	float power = receivedPower(sender, client);
+
+	// A packet that has finished but not been delivered yet, because of the timer resolution,
+	// cannot collide with this one
+	if (TimerWheel::isPending(&client->timer) && client->rxEnd <= start)
+	{
+	    _wheel.cancel(&client->timer);
+	    deliver(client);
+	}
+
+	// It can only be received on the same channel, at the same data rate, while not transmitting.
+	// Otherwise it is just interference.
+	// Check the network config and see if delivery to this node is successful
+	bool receivable =    client->channel == sender->channel
+	                  && bpsOf(client) == bpsOf(sender)
+	                  && client->txEnd <= start
+	                  && willDeliverFromTo(sender, client);
+
+	if (TimerWheel::isPending(&client->timer))
+	{
+	    // The packet reached this destination while it was receiving another
+	    if (receivable && power >= client->rxPower + ETHER_CAPTURE_DB)
+	    {
+		// Strong enough to capture the receiver, and the waiting packet is lost
+		_wheel.cancel(&client->timer);
+		capturePacket(start, ETHER_PCAP_EVENT_COLLISION, client, client->channel, bpsOf(client),
+			      client->rxPower, client->packet, client->packetLen);
+	    }
+	    else
+	    {
+		// Collision with waiting packet. It will be lost unless it is strong enough
+		client->rxInterference = std::max(client->rxInterference, power);
+		continue;
+	    }
+	}
+	if (receivable)
+	{
+	    // New packet, queue it for delivery to the client after the
+	    // nominal transmission time is complete, if it survives any collisions
+	    memcpy(client->packet, packet, len);
+	    client->packetLen = len;
+	    client->rxEnd = end;
+	    client->rxPower = power;
+	    client->rxInterference = interferenceAt(client, sender);
+	    _wheel.start(&client->timer, ticksAt(end));
+	}
+    }
+
+    Transmission transmission = { sender, end };
+    _onAir.push_back(transmission);
+}
+
+void Ether::deliver(EtherClient* client)
+{
+    if (client->rxInterference > client->rxPower - ETHER_CAPTURE_DB)
+    {
+	// Lost in a collision
+	capturePacket(client->rxEnd, ETHER_PCAP_EVENT_COLLISION, client, client->channel, bpsOf(client),
+		      client->rxPower, client->packet, client->packetLen);
+	return;
+    }
+    capturePacket(client->rxEnd, ETHER_PCAP_EVENT_DELIVER, client, client->channel, bpsOf(client),
+		  client->rxPower, client->packet, client->packetLen);
+    // The power it arrived at goes first, for the client's lastRssi()
+    int8_t rssi = wholeDbm(client->rxPower);
+    sendMessage(client, RH_TCP_MESSAGE_TYPE_RSSI, (const uint8_t*)&rssi, sizeof(rssi));
+    sendMessage(client, RH_TCP_MESSAGE_TYPE_PACKET, client->packet, client->packetLen);
+    // A client that is only waiting for something to receive wakes now, 
+    // along with anyone who only slept for an instant
+    if (client->sleeping && client->wakeOnPacket)
+	_wheel.cancel(&client->wakeTimer);
+}
+
+uint32_t Ether::bpsOf(const EtherClient* client)
+{
+    return client->bps ? client->bps : _bps;
+}
+
+bool Ether::channelsOverlap(const EtherClient* from, const EtherClient* to)
+{
+    // Wide channels overlap the next channel up as well
+    int fromTop = from->channel + (bpsOf(from) > ETHER_WIDE_CHANNEL_BPS ? 1 : 0);
+    int toTop = to->channel + (bpsOf(to) > ETHER_WIDE_CHANNEL_BPS ? 1 : 0);
+    return from->channel <= toTop && to->channel <= fromTop;
+}
+
+float Ether::receivedPower(const EtherClient* from, const EtherClient* to)
+{
+    if (!from->haveAddress || !to->haveAddress)
+	return from->power;
+    return from->power - _links[from->thisAddress * 256 + to->thisAddress].lossDb;
+}
+
+float Ether::interferenceAt(const EtherClient* client, const EtherClient* except)
+{
+    float strongest = -INFINITY;
+    uint64_t t = now();
+    for (size_t i = 0; i < _onAir.size(); i++)
+    {
+	const EtherClient* sender = _onAir[i].sender;
+	if (   _onAir[i].end > t
+	    && sender != client
+	    && sender != except
+	    && channelsOverlap(sender, client)
+	    && probabilityOfSuccessfulDelivery(sender, client) > 0.0)
+	    strongest = std::max(strongest, receivedPower(sender, client));
+    }
+    return strongest;
+}
+
+void Ether::deliverExpired()
+{
+    std::vector<TimerWheel::Timer*> expired;
+    _wheel.advance(ticksAt(monotonicMicros()), expired);
+    for (size_t i = 0; i < expired.size(); i++)
+    {
+	EtherClient* client = (EtherClient*)expired[i]->context;
+	if (!client->dead)
+	    deliver(client);
+    }
+}
+
+void Ether::advanceVirtualTime()
+{
+    // Virtual time stands still until all the expected clients have connected,
+    // even if some have disconnected since
+    while (_connectedClients >= _expectedClients)
+    {
+	// and are all asleep
+	for (size_t i = 0; i < _clients.size(); i++)
+	    if (!_clients[i]->sleeping)
+		return;
+
+	// Everyone has finished with this instant. Now play out what they did, in address order.
+	// THISADDRESS messages may reorder _clients, so work from a copy
+	std::vector<EtherClient*> clients(_clients);
+	_replaying = true;
+	for (size_t i = 0; i < clients.size(); i++)
+	{
+	    EtherClient* client = clients[i];
+	    uint32_t offset = 0;
+	    while (offset < client->held.size())
+	    {
+		uint32_t len;
+		memcpy(&len, &client->held[offset], sizeof(len));
+		len = ntohl(len);
+		handleMessage(client, &client->held[offset + sizeof(len)], len);
+		offset += sizeof(len) + len;
+	    }
+	    client->held.clear();
+	}
+	_replaying = false;
+
+	// Anyone who only slept for an instant wakes now, without time moving on
+	bool woken = false;
+	for (size_t i = 0; i < _clients.size(); i++)
+	{
+	    if (!TimerWheel::isPending(&_clients[i]->wakeTimer))
+	    {
+		wake(_clients[i]);
+		woken = true;
+	    }
+	}
+	if (woken)
+	    return;
+
+	// Jump to the next thing that happens
+	uint64_t tick;
+	if (!_wheel.nextExpiry(&tick))
+	    return;
+	_virtualMicros = tick * _tickUsecs;
+	std::vector<TimerWheel::Timer*> expired;
+	_wheel.advance(tick, expired);
+	// Deliver packets before waking anyone, so a client waking at the same instant
+	// as a delivery sees the packet
+	for (size_t i = 0; i < expired.size(); i++)
+	{
+	    EtherClient* client = (EtherClient*)expired[i]->context;
+	    if (expired[i] == &client->timer && !client->dead)
+		deliver(client);
+	}
+	// Wake everyone whose time has come, or who was woken by a packet
+	for (size_t i = 0; i < _clients.size(); i++)
+	    if (_clients[i]->sleeping && !TimerWheel::isPending(&_clients[i]->wakeTimer))
+		wake(_clients[i]);
+    }
+}
+
+void Ether::wake(EtherClient* client)
+{
+    uint64_t now = htobe64(_virtualMicros);
+    client->sleeping = false;
+    sendMessage(client, RH_TCP_MESSAGE_TYPE_TIME, (const uint8_t*)&now, sizeof(now));
+}
+
+float Ether::probabilityOfSuccessfulDelivery(const EtherClient* from, const EtherClient* to)
+{
+    // Nodes that have not told us their address are always reachable
+    if (!from->haveAddress || !to->haveAddress)
+	return 1.0;
+    // Too weak to be heard at all
+    if (receivedPower(from, to) < _sensitivityDbm)
+	return 0.0;
+    return _links[from->thisAddress * 256 + to->thisAddress].probability;
+}
+
+bool Ether::willDeliverFromTo(const EtherClient* from, const EtherClient* to)
+{
+    float prob = probabilityOfSuccessfulDelivery(from, to);
+    if (prob < 1.0 && drand48() >= prob)
+	return false;
+    if (!from->haveAddress || !to->haveAddress)
+	return true;
+
+    Link& link = _links[from->thisAddress * 256 + to->thisAddress];
+    if (link.burst < 0)
+	return true;
+    // Gilbert-Elliott: move between the good and bad states, then lose the packet
+    // with the probability for the new state
+    const Burst& burst = _bursts[link.burst];
+    if (drand48() < (link.bad ? burst.toGood : burst.toBad))
+	link.bad = !link.bad;
+    return drand48() >= (link.bad ? burst.lossBad : burst.lossGood);
+}
+
+uint64_t Ether::ticksAt(uint64_t usecs)
+{
+    // Round up, so nothing is ever delivered early
+    return (usecs - _startMicros + _tickUsecs - 1) / _tickUsecs;
+}
@@ -0,0 +1,418 @@
+// ether.h
+//
+// The simulated luminiferous ether shared by etherSimulator.cpp and simHost.cpp.
+// Passes RHTcpProtocol messages between simulated nodes, modelling transmission time,
+// channels, data rates, collisions and capture, half duplex radios, 
+// the probability of delivery between each pair of nodes, node positions and path loss,
+// burst losses, links that change over time, and virtual time.
+// Can capture everything that happens on the air to a pcap file.
+// How messages actually get to and from the nodes is up to subclasses of Ether.
+
+#ifndef ether_h
+#define ether_h
+
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <vector>
+#include <string>
+#include <RHTcpProtocol.h>
+
+// Resolution of the delivery timer wheel in microseconds in real time.
+// This is the maximum lateness of a delivery, over and above the scheduling latency of the host.
+// In virtual time the wheel ticks every microsecond, so nothing is rounded
+#define ETHER_TICK_USECS 100
+
+// Number of slots in the timer wheel. Must be a power of 2.
+// Deliveries further in the future than a tick * ETHER_WHEEL_SLOTS
+// wait in their slot for more than one revolution of the wheel
+#define ETHER_WHEEL_SLOTS 4096
+
+// A packet survives overlapping transmissions on the same or adjacent channels
+// if it is received at least this many dB stronger than the strongest of them
+#define ETHER_CAPTURE_DB 6.0
+
+// Data rates above this occupy 2 channels, as on the nRF24 at 2Mbps
+#define ETHER_WIDE_CHANNEL_BPS 1000000
+
+// Default log-distance path loss model, roughly 2.4GHz indoors:
+// loss in dB = ETHER_REFERENCE_LOSS_DB + 10 * ETHER_PATH_LOSS_EXPONENT * log10(metres)
+#define ETHER_PATH_LOSS_EXPONENT 3.0
+#define ETHER_REFERENCE_LOSS_DB 40.0
+
+// Default weakest signal a receiver can hear, in dBm
+#define ETHER_SENSITIVITY_DBM -85.0
+
+// pcap link type of captured packets: LINKTYPE_USER0, the first of the link types reserved for private use.
+// In Wireshark, decode it with Edit -> Preferences -> Protocols -> DLT_USER
+#define ETHER_PCAP_LINKTYPE 147
+
+// Captured packets are written out by a thread of their own when this many octets are waiting,
+// or at least once a second
+#define ETHER_PCAP_BUFFER_LEN 65536
+
+// What happened to a captured packet
+#define ETHER_PCAP_EVENT_TRANSMIT  0 // Started transmitting. node is the sender, power is its transmit power
+#define ETHER_PCAP_EVENT_DELIVER   1 // Delivered. node is the receiver, power is the received power
+#define ETHER_PCAP_EVENT_COLLISION 2 // Lost in a collision at the receiver. node and power as for DELIVER
+
+// Each captured packet is this header, followed by the RH_TCP packet: the TO, FROM, ID and FLAGS headers
+// and the payload. The pcap timestamp is the time since the simulation started, at the start of the
+// transmission, at the end for deliveries and collisions, or when a packet being received is lost to
+// a stronger one or to the receiver transmitting.
+typedef struct
+{
+    uint8_t  event;         // ETHER_PCAP_EVENT_*
+    uint8_t  node;          // Node address, or 255 (broadcast) if the node has not said what it is
+    uint8_t  channel;       // Channel it was sent on
+    int8_t   power;         // dBm
+    uint32_t bitsPerSecond; // Data rate it was sent at, in network byte order
+} EtherPcapHeader;
+
+/////////////////////////////////////////////////////////////////////
+// Writes a pcap file without slowing down the ether: records are buffered
+// in memory and written out by a thread of their own
+class PcapWriter
+{
+public:
+    PcapWriter();
+
+    // Writes out everything still buffered and closes the file
+    ~PcapWriter();
+
+    // Create the file, or use stdout if filename is "-", write the pcap file header and start the writer thread.
+    // Returns false if the file could not be created
+    bool open(const char* filename, uint32_t linkType);
+
+    // Add a record with the given timestamp, made of header followed by data
+    void write(uint64_t micros, const void* header, uint16_t headerLen, const uint8_t* data, uint16_t len);
+
+private:
+    // The writer thread
+    static void* run(void* arg);
+    void         writeRecords();
+
+    FILE*                _file;
+    pthread_t            _thread;
+    bool                 _running;
+
+    // Protect _pending and _stopping, and wake the writer thread
+    pthread_mutex_t      _mutex;
+    pthread_cond_t       _cond;
+
+    // Records waiting to be written
+    std::vector<uint8_t> _pending;
+
+    // True when the writer thread is to write out the last of _pending and stop
+    bool                 _stopping;
+};
+
+// Largest RHTcpProtocol message (not including the length) we are prepared to accept
+#define ETHER_MAX_MESSAGE_LEN (sizeof(RHTcpTypeMessage) - sizeof(uint32_t))
+
+// Returns microseconds from an arbitrary fixed point in the past
+extern uint64_t monotonicMicros();
+
+/////////////////////////////////////////////////////////////////////
+// Single level hashed timer wheel.
+// Timers are intrusive, so starting and cancelling are O(1) and need no allocation.
+class TimerWheel
+{
+public:
+    // A timer. Embed one of these in each object that needs to be scheduled.
+    typedef struct Timer
+    {
+	struct Timer* next;    // Next in the slot, NULL if not started
+	struct Timer* prev;    // Previous in the slot
+	uint64_t      expiry;  // Absolute tick at which this timer expires
+	void*         context; // Whatever the owner wants to find when the timer expires
+    } Timer;
+
+    TimerWheel();
+
+    // Initialises a timer so it can be started and cancelled
+    static void init(Timer* timer, void* context);
+
+    // Returns true if the timer has been started and has not yet expired or been cancelled
+    static bool isPending(const Timer* timer);
+
+    // Starts a timer to expire at the given absolute tick.
+    // If the tick has already passed, it will expire on the next advance()
+    void start(Timer* timer, uint64_t tick);
+
+    // Cancels a timer. Harmless if the timer is not pending
+    void cancel(Timer* timer);
+
+    // Moves the wheel forward to the given absolute tick. Any timers expiring at or before it are
+    // removed from the wheel and returned in expiry order. Timers expiring at the same tick
+    // are returned in the order they were started
+    void advance(uint64_t tick, std::vector<Timer*>& expired);
+
+    // Finds the tick when the next pending timer will expire, however far away it is.
+    // Returns false if there are no pending timers
+    bool nextExpiry(uint64_t* tick);
+
+private:
+    // Returns how many ticks after _currentTick the next slot with any timers in it comes,
+    // starting from the given number of ticks after. ETHER_WHEEL_SLOTS + 1 if there is none
+    uint32_t nextOccupied(uint32_t after);
+
+    // Orders timers by expiry
+    static bool expiresBefore(const Timer* a, const Timer* b);
+
+    // Dummy heads of the circular list in each slot
+    Timer    _slots[ETHER_WHEEL_SLOTS];
+
+    // One bit for each slot, set if the slot has any timers in it,
+    // so finding the next timer does not mean looking at every empty slot on the way
+    uint64_t _occupied[ETHER_WHEEL_SLOTS / 64];
+
+    // The last tick that was processed by advance()
+    uint64_t _currentTick;
+
+    // Number of pending timers
+    uint32_t _count;
+};
+
+/////////////////////////////////////////////////////////////////////
+// A connected RH_TCP client, ie a simulated node
+class EtherClient
+{
+public:
+    EtherClient();
+    virtual ~EtherClient() {}
+
+    // True if the client has been disconnected, and will be deleted shortly
+    bool                 dead;
+
+    // True after the client has told us its node address
+    bool                 haveAddress;
+
+    // The node address sent in the last RH_TCP_MESSAGE_TYPE_THISADDRESS
+    uint8_t              thisAddress;
+
+    // Octets received from the client but not yet assembled into a complete message
+    uint8_t              rxBuf[4096];
+    uint32_t             rxBufLen;
+
+    // Radio settings from the last RH_TCP_MESSAGE_TYPE_RADIO.
+    // bps is 0 for the ether's default, power is in dBm
+    uint8_t              channel;
+    uint32_t             bps;
+    int8_t               power;
+
+    // When the client's latest transmission ends. It cannot receive until then
+    uint64_t             txEnd;
+
+    // Packet being received, waiting for its transmission time to elapse before delivery to this client.
+    // The timer is pending while there is a packet waiting.
+    TimerWheel::Timer    timer;
+    uint8_t              packet[RH_TCP_MAX_PAYLOAD_LEN];
+    uint16_t             packetLen;
+
+    // When the packet being received ends, the power it is received at, 
+    // and the strongest other transmission overlapping it so far, in dBm
+    uint64_t             rxEnd;
+    float                rxPower;
+    float                rxInterference;
+
+    // In virtual time, true while the client is waiting for a RH_TCP_MESSAGE_TYPE_TIME.
+    // The wakeTimer is pending if it is asleep until a later time than now.
+    // wakeOnPacket is true if it asked to be woken as soon as a packet is delivered to it
+    bool                 sleeping;
+    bool                 wakeOnPacket;
+    TimerWheel::Timer    wakeTimer;
+
+    // In virtual time, complete messages received from the client while it was running,
+    // with their lengths, held until every client has finished with the current instant
+    std::vector<uint8_t> held;
+};
+
+/////////////////////////////////////////////////////////////////////
+// The ether model
+class Ether
+{
+public:
+    Ether(uint32_t bps);
+    virtual ~Ether();
+
+    // Read the probability of successful delivery between node pairs,
+    // and optionally the node positions, path loss and burst loss models and changes over time,
+    // from a chain.conf or floorplan.conf style file.
+    // Returns false if the file could not be read
+    bool readConfig(const char* config);
+
+    // Capture every packet transmitted, delivered and lost in a collision to a pcap file,
+    // or to stdout if filename is "-". See EtherPcapHeader.
+    // Returns false if the file could not be created
+    bool capture(const char* filename);
+
+    // Run in virtual time instead of real time, once the expected number of clients have connected
+    void setVirtualTime(uint32_t expectedClients);
+
+    // Returns true if running in virtual time
+    bool isVirtualTime();
+
+    // Current time in microseconds, virtual or real
+    uint64_t now();
+
+protected:
+    // Start passing messages to and from a new client
+    void addClient(EtherClient* client);
+
+    // Stop passing messages to and from a client, and mark it dead.
+    // In virtual time, the rest of the clients carry on without it.
+    // Subclasses close the connection and delete it when it is safe to do so
+    virtual void disconnect(EtherClient* client);
+
+    // Octets have been received from the client. Handles any complete messages.
+    // Returns false if the message stream is corrupt, after disconnecting the client
+    bool receive(EtherClient* client, const uint8_t* data, uint32_t len);
+
+    // Send a complete RHTcpProtocol message to the client
+    virtual void sendMessage(EtherClient* client, uint8_t type, const uint8_t* data, uint16_t len) = 0;
+
+    // Process deliveries that have expired in real time
+    void deliverExpired();
+
+    // In virtual time, if all the clients are asleep, process what they did at this instant
+    // and move virtual time on until one of them wakes up
+    void advanceVirtualTime();
+
+    // Convert between microseconds and timer wheel ticks since the ether started
+    uint64_t ticksAt(uint64_t usecs);
+
+    // Monotonic time when the ether started, in microseconds. 0 in virtual time
+    uint64_t                  _startMicros;
+
+    // Microseconds per timer wheel tick: ETHER_TICK_USECS, or 1 in virtual time
+    uint64_t                  _tickUsecs;
+
+    TimerWheel                _wheel;
+
+    // All connected clients, in order of node address
+    std::vector<EtherClient*> _clients;
+
+private:
+    // Handle a complete RHTcpProtocol message from a client. message points at the type octet
+    void handleMessage(EtherClient* client, const uint8_t* message, uint32_t len);
+
+    // Send a packet from the sender to all the other clients that can hear it
+    void transmit(EtherClient* sender, const uint8_t* packet, uint16_t len);
+
+    // The transmission time of the packet waiting for the client has elapsed: deliver it,
+    // unless it was lost in a collision
+    void deliver(EtherClient* client);
+
+    // The client's data rate in bits per second
+    uint32_t bpsOf(const EtherClient* client);
+
+    // Returns true if transmissions from one client would reach the other's receiver 
+    // on the channels they are using, whether or not it can decode them
+    bool channelsOverlap(const EtherClient* from, const EtherClient* to);
+
+    // The power of the sender's transmissions at the receiver in dBm
+    float receivedPower(const EtherClient* from, const EtherClient* to);
+
+    // The strongest transmission in the air at the receiver now, apart from the given sender's, in dBm.
+    // -INFINITY if there is none
+    float interferenceAt(const EtherClient* client, const EtherClient* except);
+
+    // Wake up a sleeping client, telling it the virtual time
+    void wake(EtherClient* client);
+
+    // Look up the source and dest nodes in the netconfig and return the 0.0 to 1.0 probability
+    // of successful delivery
+    float probabilityOfSuccessfulDelivery(const EtherClient* from, const EtherClient* to);
+
+    // Return true if the message is simulated to have been received successfully
+    // taking into account the probability of successful delivery and any burst losses
+    bool willDeliverFromTo(const EtherClient* from, const EtherClient* to);
+
+    // Apply one line of the config file. Returns false if it is not understood
+    bool configure(const char* line);
+
+    // Recompute the path loss of every link to and from the node, or of all links if node is -1
+    void updatePathLoss(int node);
+
+    // Apply the config lines scheduled for now or earlier
+    void applySchedule();
+
+    // Write a packet to the capture file, if there is one
+    void capturePacket(uint64_t at, uint8_t event, const EtherClient* node, uint8_t channel, uint32_t bps,
+		       float power, const uint8_t* packet, uint16_t len);
+
+    // Ordering of _schedule
+    static bool scheduledBefore(const std::pair<uint64_t, std::string>& a, const std::pair<uint64_t, std::string>& b);
+
+    // Default data rate in bits per second
+    uint32_t                  _bps;
+
+    // A transmission in the air, or recently so
+    typedef struct
+    {
+	EtherClient* sender;
+	uint64_t     end;    // When it ends
+    } Transmission;
+
+    // Transmissions that may still be in the air, in the order they started
+    std::vector<Transmission> _onAir;
+
+    // Virtual time, set by setVirtualTime()
+    bool                      _virtualTime;
+    uint32_t                  _expectedClients;
+    uint64_t                  _virtualMicros;
+
+    // Number of clients that have ever connected. Virtual time starts when it reaches _expectedClients,
+    // and goes on without any that disconnect after that
+    uint32_t                  _connectedClients;
+
+    // True while replaying the messages held from the clients in virtual time
+    bool                      _replaying;
+
+    // Everything about the link from one node to another that does not depend on their radio settings,
+    // precomputed so it is cheap to look up for every packet. Indexed by [from * 256 + to]
+    typedef struct
+    {
+	float   probability; // Probability of successful delivery
+	float   lossDb;      // Path loss. 0 unless the positions of both nodes are known
+	int16_t burst;       // Index in _bursts of its burst loss model, -1 if none
+	bool    bad;         // The burst loss model is in its bad state
+    } Link;
+    std::vector<Link>         _links;
+
+    // Gilbert-Elliott burst loss model
+    typedef struct
+    {
+	float toBad;    // Probability of going from the good state to the bad state, per packet
+	float toGood;   // Probability of going from the bad state to the good state, per packet
+	float lossGood; // Probability of losing a packet in the good state
+	float lossBad;  // Probability of losing a packet in the bad state
+    } Burst;
+    std::vector<Burst>        _bursts;
+
+    // Node positions in metres, indexed by node address
+    typedef struct
+    {
+	bool  known;
+	float x;
+	float y;
+    } Position;
+    Position                  _positions[256];
+
+    // Path loss model parameters and receiver sensitivity
+    float                     _pathLossExponent;
+    float                     _referenceLossDb;
+    float                     _sensitivityDbm;
+
+    // Config lines to apply later, with the time in microseconds since the start, in time order
+    std::vector<std::pair<uint64_t, std::string> > _schedule;
+
+    // The next line in _schedule to apply
+    size_t                    _scheduleNext;
+
+    // Where packets are captured to, or NULL
+    PcapWriter*               _pcap;
+};
+
+#endif
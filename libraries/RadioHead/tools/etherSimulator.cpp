@@ -0,0 +1,452 @@
+// etherSimulator.cpp
+//
+// Simulates the luminiferous ether for RH_TCP.
+// Native replacement for etherSimulator.pl, built on epoll and a timer wheel so that
+// hundreds of simulated nodes can share one ether with sub-millisecond delivery jitter.
+// Connects multiple instances of RH_TCP clients together and passes
+// simulated messages between them, using the framing defined in RHTcpProtocol.h.
+// The ether itself is modelled in ether.cpp.
+//
+// Build with
+// cd whatever/RadioHead
+// g++ -O2 -I . -pthread tools/etherSimulator.cpp tools/ether.cpp -o etherSimulator
+//
+// usage: etherSimulator [-h] [-c configfile] [-b bitspersec] [-p portnumber] [-v] [-n numclients] [-s seed] [-w capturefile]
+// The options and the config file format are the same as for etherSimulator.pl, plus:
+// -v Run in virtual time. The clients must all be sketches run with --virtual-time.
+//    Virtual time only moves on when every client is asleep waiting for it, 
+//    and then jumps straight to the next delivery or wakeup, so simulations run as fast as the
+//    clients can. What the clients do at the same virtual instant is handled in order of
+//    node address, so given the same seeds the simulation runs the same way every time.
+// -n Number of clients to wait for before virtual time starts. Defaults to 1
+// -s Seed for the random number generator, for reproducible simulations.
+// -b is the data rate of clients that have not set their own with RH_TCP::setRF().
+// The config file can also place nodes on a floor plan, with path loss, burst losses
+// and changes over time. See tools/floorplan.conf and Ether::readConfig().
+// -w Capture every packet transmitted, delivered or lost in a collision to a pcap file, or to stdout if -,
+//    with simulated timestamps. See EtherPcapHeader in ether.h for the format. For example, to watch live:
+//    ./etherSimulator -w - | wireshark -k -i -
+//    The capture is complete when etherSimulator is stopped with SIGINT or SIGTERM.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <vector>
+#include "ether.h"
+
+// Maximum number of epoll events handled per call to epoll_wait()
+#define ETHER_MAX_EVENTS 256
+
+/////////////////////////////////////////////////////////////////////
+// A client connected by TCP
+class TcpClient : public EtherClient
+{
+public:
+    TcpClient(int fd) : fd(fd) {}
+
+    // The connected socket
+    int                  fd;
+
+    // Octets we could not yet write to the client
+    std::vector<uint8_t> txBuf;
+};
+
+/////////////////////////////////////////////////////////////////////
+// The ether server. Accepts connections from RH_TCP clients and passes packets between them
+class EtherServer : public Ether
+{
+public:
+    EtherServer(uint16_t port, uint32_t bps);
+
+    // Sets up the listening socket, the delivery timer and epoll.
+    // Returns false on failure
+    bool init();
+
+    // Runs the event loop until SIGINT or SIGTERM
+    void run();
+
+protected:
+    // Close the connection to the client. The TcpClient is deleted after the current batch of events
+    virtual void disconnect(EtherClient* client);
+
+    // Send a complete RHTcpProtocol message to the client, buffering anything that cannot be sent now
+    virtual void sendMessage(EtherClient* client, uint8_t type, const uint8_t* data, uint16_t len);
+
+private:
+    // Accept all pending client connections
+    void acceptClients();
+
+    // Read from the client and handle any complete messages
+    void handleInput(TcpClient* client);
+
+    // Try to send any buffered output to the client
+    void flush(TcpClient* client);
+
+    // Process expired deliveries
+    void handleTimer();
+
+    // Set the timerfd to expire at the next pending delivery
+    void armTimer();
+
+    uint16_t             _port;
+    int                  _listenFd;
+    int                  _timerFd;
+    int                  _epollFd;
+
+    // The tick the timerfd is currently armed for, 0 if disarmed
+    uint64_t             _armedTick;
+
+    // Clients that have been disconnected, waiting to be deleted
+    std::vector<TcpClient*> _dead;
+};
+
+// Set by SIGINT and SIGTERM
+static volatile sig_atomic_t stopping = 0;
+
+static void stop(int)
+{
+    stopping = 1;
+}
+
+EtherServer::EtherServer(uint16_t port, uint32_t bps)
+    : Ether(bps),
+      _port(port),
+      _listenFd(-1),
+      _timerFd(-1),
+      _epollFd(-1),
+      _armedTick(0)
+{
+}
+
+bool EtherServer::init()
+{
+    signal(SIGPIPE, SIG_IGN);
+    // Stop cleanly, so the capture file is complete
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    // Listen on IPv6 and IPv4 if we can, else just IPv4
+    int on = 1;
+    int off = 0;
+    _listenFd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (_listenFd >= 0)
+    {
+	struct sockaddr_in6 addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin6_family = AF_INET6;
+	addr.sin6_addr = in6addr_any;
+	addr.sin6_port = htons(_port);
+	setsockopt(_listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	setsockopt(_listenFd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+	if (bind(_listenFd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+	{
+	    close(_listenFd);
+	    _listenFd = -1;
+	}
+    }
+    if (_listenFd < 0)
+    {
+	_listenFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (_listenFd < 0)
+	{
+	    fprintf(stderr, "etherSimulator: socket failed: %s\n", strerror(errno));
+	    return false;
+	}
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(_port);
+	setsockopt(_listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (bind(_listenFd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+	{
+	    fprintf(stderr, "etherSimulator: could not bind to port %d: %s\n", _port, strerror(errno));
+	    return false;
+	}
+    }
+    if (listen(_listenFd, SOMAXCONN) < 0)
+    {
+	fprintf(stderr, "etherSimulator: listen failed: %s\n", strerror(errno));
+	return false;
+    }
+
+    _timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    _epollFd = epoll_create1(0);
+    if (_timerFd < 0 || _epollFd < 0)
+    {
+	fprintf(stderr, "etherSimulator: could not create timerfd or epoll: %s\n", strerror(errno));
+	return false;
+    }
+
+    // The listening socket and the timer are recognised by pointers to their fds
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &_listenFd;
+    epoll_ctl(_epollFd, EPOLL_CTL_ADD, _listenFd, &ev);
+    ev.data.ptr = &_timerFd;
+    epoll_ctl(_epollFd, EPOLL_CTL_ADD, _timerFd, &ev);
+
+    return true;
+}
+
+void EtherServer::run()
+{
+    struct epoll_event events[ETHER_MAX_EVENTS];
+    while (!stopping)
+    {
+	int n = epoll_wait(_epollFd, events, ETHER_MAX_EVENTS, -1);
+	if (n < 0)
+	{
+	    if (errno == EINTR)
+		continue;
+	    fprintf(stderr, "etherSimulator: epoll_wait failed: %s\n", strerror(errno));
+	    exit(1);
+	}
+	for (int i = 0; i < n; i++)
+	{
+	    if (events[i].data.ptr == &_listenFd)
+		acceptClients();
+	    else if (events[i].data.ptr == &_timerFd)
+		handleTimer();
+	    else
+	    {
+		TcpClient* client = (TcpClient*)events[i].data.ptr;
+		if (!client->dead && (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+		    handleInput(client);
+		if (!client->dead && (events[i].events & EPOLLOUT))
+		    flush(client);
+	    }
+	}
+	if (isVirtualTime())
+	    advanceVirtualTime();
+	else
+	{
+	    // Deliveries may have become due while we were busy
+	    handleTimer();
+	    armTimer();
+	}
+
+	// Only now is it safe to delete clients that were disconnected during this batch
+	for (size_t i = 0; i < _dead.size(); i++)
+	    delete _dead[i];
+	_dead.clear();
+    }
+}
+
+void EtherServer::acceptClients()
+{
+    int fd;
+    while ((fd = accept4(_listenFd, NULL, NULL, SOCK_NONBLOCK)) >= 0)
+    {
+	// Messages are small and latency sensitive
+	int on = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+	// Create a new object to hold data about RH_TCP messages to and from this client
+	TcpClient* client = new TcpClient(fd);
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = client;
+	epoll_ctl(_epollFd, EPOLL_CTL_ADD, fd, &ev);
+	addClient(client);
+    }
+}
+
+void EtherServer::handleInput(TcpClient* client)
+{
+    uint8_t buf[4096];
+    ssize_t count = read(client->fd, buf, sizeof(buf));
+    if (count < 0)
+    {
+	if (errno != EAGAIN && errno != EINTR)
+	    disconnect(client);
+	return;
+    }
+    else if (count == 0)
+    {
+	// End of file, the client has gone away
+	disconnect(client);
+	return;
+    }
+    receive(client, buf, count);
+}
+
+void EtherServer::sendMessage(EtherClient* ether, uint8_t type, const uint8_t* data, uint16_t len)
+{
+    TcpClient* client = (TcpClient*)ether;
+    RHTcpTypeMessage m;
+    m.length = htonl(len + 1);
+    m.type = type;
+    memcpy(m.payload, data, len);
+    const uint8_t* p = (const uint8_t*)&m;
+    size_t size = sizeof(m.length) + 1 + len;
+
+    if (client->txBuf.empty())
+    {
+	ssize_t sent = send(client->fd, p, size, MSG_NOSIGNAL);
+	if (sent < 0)
+	{
+	    if (errno != EAGAIN && errno != EINTR)
+	    {
+		disconnect(client);
+		return;
+	    }
+	    sent = 0;
+	}
+	p += sent;
+	size -= sent;
+	if (size == 0)
+	    return; // All sent, the usual case
+	// Wait until the client can take the rest
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLOUT;
+	ev.data.ptr = client;
+	epoll_ctl(_epollFd, EPOLL_CTL_MOD, client->fd, &ev);
+    }
+    client->txBuf.insert(client->txBuf.end(), p, p + size);
+}
+
+void EtherServer::flush(TcpClient* client)
+{
+    if (!client->txBuf.empty())
+    {
+	ssize_t sent = send(client->fd, &client->txBuf[0], client->txBuf.size(), MSG_NOSIGNAL);
+	if (sent < 0)
+	{
+	    if (errno != EAGAIN && errno != EINTR)
+		disconnect(client);
+	    return;
+	}
+	client->txBuf.erase(client->txBuf.begin(), client->txBuf.begin() + sent);
+    }
+    if (client->txBuf.empty())
+    {
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = client;
+	epoll_ctl(_epollFd, EPOLL_CTL_MOD, client->fd, &ev);
+    }
+}
+
+void EtherServer::disconnect(EtherClient* ether)
+{
+    TcpClient* client = (TcpClient*)ether;
+    if (client->dead)
+	return;
+    Ether::disconnect(client);
+    epoll_ctl(_epollFd, EPOLL_CTL_DEL, client->fd, NULL);
+    close(client->fd);
+    _dead.push_back(client);
+}
+
+void EtherServer::handleTimer()
+{
+    uint64_t expirations;
+    while (read(_timerFd, &expirations, sizeof(expirations)) > 0)
+	; // Just drain it
+    _armedTick = 0;
+    deliverExpired();
+}
+
+void EtherServer::armTimer()
+{
+    uint64_t tick;
+    if (!_wheel.nextExpiry(&tick))
+	tick = 0;
+    if (tick == _armedTick)
+	return;
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if (tick)
+    {
+	uint64_t usecs = _startMicros + tick * _tickUsecs;
+	its.it_value.tv_sec = usecs / 1000000;
+	its.it_value.tv_nsec = (usecs % 1000000) * 1000;
+    }
+    // A zero it_value disarms the timer
+    timerfd_settime(_timerFd, TFD_TIMER_ABSTIME, &its, NULL);
+    _armedTick = tick;
+}
+
+/////////////////////////////////////////////////////////////////////
+static void usage(const char* name)
+{
+    printf("usage: %s [-h] [-c configfile] [-b bitspersec] [-p portnumber] [-v] [-n numclients] [-s seed] [-w capturefile]\n", name);
+    exit(0);
+}
+
+int main(int argc, char** argv)
+{
+    // Configurable variables
+    const char* config = NULL;
+    uint16_t port = 4000;
+    uint32_t bps = 10000;
+    bool virtualTime = false;
+    uint32_t expectedClients = 1;
+    bool haveSeed = false;
+    long seed = 0;
+    const char* capture = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "hc:b:p:vn:s:w:")) != -1)
+    {
+	switch (opt)
+	{
+	    case 'c':
+		config = optarg; // Config file
+		break;
+	    case 'b':
+		bps = atol(optarg); // Bits per second simulated baud rate
+		break;
+	    case 'p':
+		port = atoi(optarg); // port number
+		break;
+	    case 'v':
+		virtualTime = true;
+		break;
+	    case 'n':
+		expectedClients = atol(optarg); // Clients to wait for before starting virtual time
+		break;
+	    case 's':
+		seed = atol(optarg); // Random number seed
+		haveSeed = true;
+		break;
+	    case 'w':
+		capture = optarg; // pcap file to capture packets to
+		break;
+	    default:
+		usage(argv[0]);
+	}
+    }
+    if (bps == 0)
+	usage(argv[0]);
+
+    srand48(haveSeed ? seed : getpid() ^ (unsigned) time(NULL));
+    EtherServer server(port, bps);
+    if (virtualTime)
+	server.setVirtualTime(expectedClients);
+    if (config && !server.readConfig(config))
+	exit(1);
+    if (capture && !server.capture(capture))
+	exit(1);
+    if (!server.init())
+	exit(1);
+    server.run();
+    return 0;
+}
@@ -0,0 +1,508 @@
+// simHost.cpp
+//
+// Runs many simulated RadioHead sketches as nodes within a single process, sharing an in-memory
+// luminiferous ether, in virtual time.
+// Each node is a sketch built with 'simBuild --hosted' into a shared library. Every node gets a
+// private copy of the library, so its globals and the library's statics are its own,
+// and runs setup() and loop() in a coroutine of its own. The nodes take turns, switching only when
+// they are idle in virtual time (in delay() or YIELD), and their RH_TCP drivers pass
+// RHTcpProtocol messages to the ether with function calls instead of sockets.
+// So there are no syscalls in the packet path, and the simulation is the same every time for the same seed.
+// The ether is the same as for etherSimulator -v, see ether.cpp
+//
+// Build with
+// cd whatever/RadioHead
+// g++ -O2 -I . -pthread -rdynamic tools/simHost.cpp tools/ether.cpp -o simHost -ldl
+// and build each sketch with
+// tools/simBuild --hosted sketchname.pde
+//
+// usage: simHost [-h] [-c configfile] [-b bitspersec] [-s seed] [-t seconds] [-f nodesfile] [-w capturefile] ["sketch.so args..."]...
+// Each node is specified by the name of its sketch library followed by the arguments to pass to it,
+// either as one command line argument, or one per line in the nodes file.
+// -c -b -w As for etherSimulator
+// -s Seed for the random number generators in the ether and the nodes
+// -t How many seconds of virtual time to run for. Defaults to forever
+// Example:
+// ./simHost -t 60 simulator_reliable_datagram_server.so simulator_reliable_datagram_client.so
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <ucontext.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <string>
+#include <vector>
+#include "ether.h"
+
+// Stack for each node. Allocated lazily by the OS, so only what is used costs anything
+#define SIMHOST_STACK_SIZE (256 * 1024)
+
+class Node;
+
+/////////////////////////////////////////////////////////////////////
+// A connection from a node's RH_TCP driver to the ether
+class HostClient : public EtherClient
+{
+public:
+    HostClient(Node* node) : node(node) {}
+
+    // The node that made the connection
+    Node*                node;
+
+    // RHTcpProtocol messages from the ether, not yet read by the node
+    std::vector<uint8_t> inbound;
+};
+
+/////////////////////////////////////////////////////////////////////
+// A simulated node
+class Node
+{
+public:
+    Node(uint32_t id);
+
+    // The library, followed by its arguments
+    std::vector<std::string> args;
+
+    uint32_t                 id;
+
+    // The private copy of the library
+    void*                    handle;
+
+    // simulator_main() in the library
+    int                    (*main)(int argc, char** argv);
+
+    ucontext_t               context;
+    void*                    stack;
+
+    // True once the node has started running
+    bool                     started;
+
+    // True if simulator_main() returned. The node never runs again
+    bool                     finished;
+
+    // The connection the node is waiting to read from, if any
+    HostClient*              waitingFor;
+};
+
+Node::Node(uint32_t id)
+    : id(id),
+      handle(NULL),
+      main(NULL),
+      stack(NULL),
+      started(false),
+      finished(false),
+      waitingFor(NULL)
+{
+}
+
+/////////////////////////////////////////////////////////////////////
+// The host. Runs the nodes and the ether
+class SimHost : public Ether
+{
+public:
+    SimHost(uint32_t bps);
+
+    // Add a node, given the library name and arguments separated by white space.
+    // Returns false if there is no library name
+    bool addNode(const char* spec);
+
+    // Add a node for each line in the file. Returns false if the file could not be read
+    bool readNodes(const char* file);
+
+    // Load a private copy of the library for each node.
+    // seed is passed on to the nodes. Returns false on failure
+    bool load(unsigned long seed);
+
+    // Run the simulation until the given virtual time in microseconds,
+    // or until there is nothing more that can happen
+    void run(uint64_t until);
+
+    // Called by the nodes, through the simhost_* functions
+    int     connect();
+    ssize_t write(int connection, const void* buf, size_t len);
+    ssize_t read(int connection, void* buf, size_t len);
+    void    wait(int connection);
+
+protected:
+    // Queue the message for the node to read
+    virtual void sendMessage(EtherClient* client, uint8_t type, const uint8_t* data, uint16_t len);
+
+private:
+    // Returns true if the node has something to do
+    bool isRunnable(const Node* node);
+
+    // Run the node until it waits for something
+    void resume(Node* node);
+
+    // Entry point of each node's coroutine
+    static void start();
+
+    std::vector<Node*>       _nodes;
+
+    // All connections, indexed by the connection number returned to the node
+    std::vector<HostClient*> _connections;
+
+    // The node running now, or NULL if the host is running
+    Node*                    _current;
+
+    // Where to go back to when the current node waits
+    ucontext_t               _hostContext;
+};
+
+// The one and only host
+static SimHost* host = NULL;
+
+SimHost::SimHost(uint32_t bps)
+    : Ether(bps),
+      _current(NULL)
+{
+    // Nodes are all started before virtual time begins
+    setVirtualTime(0);
+}
+
+bool SimHost::addNode(const char* spec)
+{
+    Node* node = new Node(_nodes.size());
+    const char* p = spec;
+    while (*p)
+    {
+	while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')
+	    p++;
+	const char* start = p;
+	while (*p && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r')
+	    p++;
+	if (p > start)
+	    node->args.push_back(std::string(start, p - start));
+    }
+    if (node->args.empty() || node->args[0][0] == '#')
+    {
+	delete node;
+	return false;
+    }
+    _nodes.push_back(node);
+    return true;
+}
+
+bool SimHost::readNodes(const char* file)
+{
+    FILE* f = fopen(file, "r");
+    if (!f)
+    {
+	fprintf(stderr, "simHost: could not open nodes file %s: %s\n", file, strerror(errno));
+	return false;
+    }
+    char line[1024];
+    while (fgets(line, sizeof(line), f))
+	addNode(line); // Ignore blank lines and comments
+    fclose(f);
+    return true;
+}
+
+// Copy a file. Returns false on failure
+static bool copyFile(const char* from, const char* to)
+{
+    int in = open(from, O_RDONLY);
+    if (in < 0)
+	return false;
+    int out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0700);
+    if (out < 0)
+    {
+	close(in);
+	return false;
+    }
+    char buf[65536];
+    ssize_t count;
+    bool ok = true;
+    while (ok && (count = ::read(in, buf, sizeof(buf))) > 0)
+	ok = ::write(out, buf, count) == count;
+    close(in);
+    close(out);
+    return ok && count == 0;
+}
+
+bool SimHost::load(unsigned long seed)
+{
+    // The dynamic loader only loads a library once, however many times it is opened,
+    // so each node needs its own copy of the file
+    char dir[] = "/tmp/simHostXXXXXX";
+    if (!mkdtemp(dir))
+    {
+	fprintf(stderr, "simHost: could not make temporary directory: %s\n", strerror(errno));
+	return false;
+    }
+    bool ok = true;
+    for (size_t i = 0; ok && i < _nodes.size(); i++)
+    {
+	Node* node = _nodes[i];
+	std::string copy = std::string(dir) + "/node" + std::to_string(node->id) + ".so";
+	if (!copyFile(node->args[0].c_str(), copy.c_str()))
+	{
+	    fprintf(stderr, "simHost: could not copy %s: %s\n", node->args[0].c_str(), strerror(errno));
+	    ok = false;
+	    break;
+	}
+	// RTLD_LOCAL keeps each node's symbols to itself
+	node->handle = dlopen(copy.c_str(), RTLD_NOW | RTLD_LOCAL);
+	unlink(copy.c_str()); // Stays mapped
+	if (!node->handle)
+	{
+	    fprintf(stderr, "simHost: could not load %s: %s\n", node->args[0].c_str(), dlerror());
+	    ok = false;
+	    break;
+	}
+	node->main = (int (*)(int, char**))dlsym(node->handle, "simulator_main");
+	if (!node->main)
+	{
+	    fprintf(stderr, "simHost: %s was not built with simBuild --hosted\n", node->args[0].c_str());
+	    ok = false;
+	    break;
+	}
+	// Different for every node, even if they are given the same arguments
+	node->args.push_back("--seed=" + std::to_string(seed + node->id));
+
+	node->stack = malloc(SIMHOST_STACK_SIZE);
+	getcontext(&node->context);
+	node->context.uc_stack.ss_sp = node->stack;
+	node->context.uc_stack.ss_size = SIMHOST_STACK_SIZE;
+	node->context.uc_link = &_hostContext;
+	makecontext(&node->context, start, 0);
+    }
+    rmdir(dir);
+    return ok;
+}
+
+void SimHost::start()
+{
+    Node* node = host->_current;
+    // argv belongs to the node, which may rearrange it
+    std::vector<char*> argv;
+    for (size_t i = 0; i < node->args.size(); i++)
+	argv.push_back(strdup(node->args[i].c_str()));
+    argv.push_back(NULL);
+    node->main(argv.size() - 1, &argv[0]);
+    // Sketches do not usually return, but if they do the node is finished
+    fprintf(stderr, "simHost: node %u finished\n", node->id);
+    node->finished = true;
+    // Dont let it hold up everyone else
+    for (size_t i = 0; i < host->_connections.size(); i++)
+	if (host->_connections[i]->node == node)
+	    host->disconnect(host->_connections[i]);
+    // Returns to _hostContext through uc_link
+}
+
+bool SimHost::isRunnable(const Node* node)
+{
+    if (node->finished)
+	return false;
+    if (!node->started)
+	return true;
+    return node->waitingFor && !node->waitingFor->inbound.empty();
+}
+
+void SimHost::resume(Node* node)
+{
+    node->started = true;
+    node->waitingFor = NULL;
+    _current = node;
+    swapcontext(&_hostContext, &node->context);
+    _current = NULL;
+}
+
+void SimHost::run(uint64_t until)
+{
+    uint64_t startedAt = monotonicMicros();
+    while (now() < until)
+    {
+	// Let everyone with something to do have a go. Each runs until it sleeps
+	bool ran = false;
+	for (size_t i = 0; i < _nodes.size(); i++)
+	{
+	    if (isRunnable(_nodes[i]))
+	    {
+		resume(_nodes[i]);
+		ran = true;
+	    }
+	}
+	if (ran)
+	    continue; // Some may be runnable again already
+	// Everyone is asleep. Move virtual time on to when the next one wakes up
+	advanceVirtualTime();
+	bool runnable = false;
+	for (size_t i = 0; !runnable && i < _nodes.size(); i++)
+	    runnable = isRunnable(_nodes[i]);
+	if (!runnable)
+	{
+	    fprintf(stderr, "simHost: nothing more can happen\n");
+	    break;
+	}
+    }
+    uint64_t elapsed = monotonicMicros() - startedAt;
+    fprintf(stderr, "simHost: %u nodes ran for %.3f virtual seconds in %.3f real seconds\n",
+	    (unsigned)_nodes.size(), now() / 1000000.0, elapsed / 1000000.0);
+}
+
+int SimHost::connect()
+{
+    if (!_current)
+	return -1;
+    HostClient* client = new HostClient(_current);
+    addClient(client);
+    _connections.push_back(client);
+    return _connections.size() - 1;
+}
+
+ssize_t SimHost::write(int connection, const void* buf, size_t len)
+{
+    if (connection < 0 || (size_t)connection >= _connections.size() || _connections[connection]->dead)
+    {
+	errno = EBADF;
+	return -1;
+    }
+    if (!receive(_connections[connection], (const uint8_t*)buf, len))
+    {
+	errno = EPIPE;
+	return -1;
+    }
+    return len;
+}
+
+ssize_t SimHost::read(int connection, void* buf, size_t len)
+{
+    if (connection < 0 || (size_t)connection >= _connections.size())
+    {
+	errno = EBADF;
+	return -1;
+    }
+    std::vector<uint8_t>& inbound = _connections[connection]->inbound;
+    if (inbound.empty())
+    {
+	errno = EAGAIN;
+	return -1;
+    }
+    if (len > inbound.size())
+	len = inbound.size();
+    memcpy(buf, &inbound[0], len);
+    inbound.erase(inbound.begin(), inbound.begin() + len);
+    return len;
+}
+
+void SimHost::wait(int connection)
+{
+    if (connection < 0 || (size_t)connection >= _connections.size() || !_current)
+	return;
+    HostClient* client = _connections[connection];
+    Node* node = _current;
+    while (client->inbound.empty())
+    {
+	node->waitingFor = client;
+	swapcontext(&node->context, &_hostContext);
+    }
+}
+
+void SimHost::sendMessage(EtherClient* ether, uint8_t type, const uint8_t* data, uint16_t len)
+{
+    HostClient* client = (HostClient*)ether;
+    uint32_t length = htonl(len + 1);
+    client->inbound.insert(client->inbound.end(), (const uint8_t*)&length, (const uint8_t*)&length + sizeof(length));
+    client->inbound.push_back(type);
+    client->inbound.insert(client->inbound.end(), data, data + len);
+}
+
+/////////////////////////////////////////////////////////////////////
+// The interface to the nodes. See RHutil/simulator.h
+extern "C"
+{
+    int simhost_connect()
+    {
+	return host->connect();
+    }
+
+    ssize_t simhost_write(int connection, const void* buf, size_t len)
+    {
+	return host->write(connection, buf, len);
+    }
+
+    ssize_t simhost_read(int connection, void* buf, size_t len)
+    {
+	return host->read(connection, buf, len);
+    }
+
+    void simhost_wait(int connection)
+    {
+	host->wait(connection);
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+static void usage(const char* name)
+{
+    printf("usage: %s [-h] [-c configfile] [-b bitspersec] [-s seed] [-t seconds] [-f nodesfile] [-w capturefile] [\"sketch.so args...\"]...\n", name);
+    exit(0);
+}
+
+int main(int argc, char** argv)
+{
+    // Configurable variables
+    const char* config = NULL;
+    const char* nodes = NULL;
+    uint32_t bps = 10000;
+    unsigned long seed = getpid() ^ (unsigned) time(NULL);
+    uint64_t until = UINT64_MAX;
+    const char* capture = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "hc:b:s:t:f:w:")) != -1)
+    {
+	switch (opt)
+	{
+	    case 'c':
+		config = optarg; // Config file
+		break;
+	    case 'b':
+		bps = atol(optarg); // Bits per second simulated baud rate
+		break;
+	    case 's':
+		seed = strtoul(optarg, NULL, 0); // Random number seed
+		break;
+	    case 't':
+		until = (uint64_t)(atof(optarg) * 1000000); // Virtual seconds to run for
+		break;
+	    case 'f':
+		nodes = optarg; // Nodes file
+		break;
+	    case 'w':
+		capture = optarg; // pcap file to capture packets to
+		break;
+	    default:
+		usage(argv[0]);
+	}
+    }
+    if (bps == 0)
+	usage(argv[0]);
+
+    srand48(seed);
+    host = new SimHost(bps);
+    if (config && !host->readConfig(config))
+	exit(1);
+    if (capture && !host->capture(capture))
+	exit(1);
+    if (nodes && !host->readNodes(nodes))
+	exit(1);
+    for (int i = optind; i < argc; i++)
+	host->addNode(argv[i]);
+    if (!host->load(seed))
+	exit(1);
+    host->run(until);
+    // Finish writing the capture file
+    delete host;
+    return 0;
+}
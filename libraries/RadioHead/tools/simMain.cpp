@@ -21,6 +21,27 @@ unsigned long start_millis;
 int    _simulator_argc;
 char** _simulator_argv;
 
+// Virtual time, enabled by --virtual-time
+bool _simulator_virtual_time = false;
+
+// Current virtual time in microseconds
+static uint64_t virtual_micros = 0;
+
+// Called when the sketch is idle in virtual time, if a driver has registered one
+static SimulatorIdleHandler idle_handler = NULL;
+
+// A sketch that spins in loop() or on millis() without a delay() or YIELD would never let virtual time
+// move on, so after this many spins without an idle, it idles as YIELD does anyway
+#define SIMULATOR_MAX_SPINS 1000
+static unsigned long spins = 0;
+static void spin();
+
+// Longest YIELD idles for in virtual time. It returns sooner if a packet is delivered.
+// Each node YIELDs until the next instant on a grid of its own, SIMULATOR_YIELD_MICROS apart and offset
+// by a random yield_phase, so nodes that are not woken by packets do not all run at the same instants
+#define SIMULATOR_YIELD_MICROS 1000
+static uint64_t yield_phase = 0;
+
 // Returns milliseconds since beginning of day
 unsigned long time_in_millis()
 {    
@@ -30,34 +51,140 @@ unsigned long time_in_millis()
     return milliseconds;
 }
 
+// Random number generator. Each simulated node has its own, even when sharing a process with others
+static struct random_data random_state;
+static char               random_state_buf[64];
+
 // Run the Arduino standard functions in the main loop
+#ifdef RH_SIMULATOR_HOSTED
+// Called by simHost, in a coroutine of its own
+extern "C" int simulator_main(int argc, char** argv)
+#else
 int main(int argc, char** argv)
+#endif
 {
+    // Remove the simulator options, leaving the rest for the sketch
+    bool          have_seed = false;
+    unsigned long seed = 0;
+    int           i, j;
+    for (i = 1, j = 1; i < argc; i++)
+    {
+	if (strcmp(argv[i], "--virtual-time") == 0)
+	    _simulator_virtual_time = true;
+	else if (strncmp(argv[i], "--seed=", 7) == 0)
+	{
+	    seed = strtoul(argv[i] + 7, NULL, 0);
+	    have_seed = true;
+	}
+	else
+	    argv[j++] = argv[i];
+    }
+    argv[j] = NULL;
+    argc = j;
+#ifdef RH_SIMULATOR_HOSTED
+    _simulator_virtual_time = true; // Nothing else makes sense
+#endif
+
     // Let simulated program have access to argc and argv
     _simulator_argc = argc;
     _simulator_argv = argv;
     start_millis = time_in_millis();
     // Seed the random number generator
-    srand(getpid() ^ (unsigned) time(NULL)/2);
+    if (have_seed)
+    {
+	// Reproducible, but different for each node, since they are given different arguments
+	for (i = 1; i < argc; i++)
+	    for (const char* p = argv[i]; *p; p++)
+		seed = (seed * 33) ^ (unsigned char)*p;
+    }
+    else
+	seed = getpid() ^ (unsigned) time(NULL)/2;
+    initstate_r(seed, random_state_buf, sizeof(random_state_buf), &random_state);
+    yield_phase = random(SIMULATOR_YIELD_MICROS);
     setup();
     while (1)
+    {
 	loop();
+	spin();
+    }
+}
+
+void simulator_set_idle_handler(SimulatorIdleHandler handler)
+{
+    idle_handler = handler;
+}
+
+// Let virtual time move on to until, or to when a packet is delivered if wake_on_packet
+static void idle_until(uint64_t until, bool wake_on_packet)
+{
+    if (idle_handler)
+    {
+	uint64_t now = idle_handler(until, wake_on_packet);
+	virtual_micros = (now > until || wake_on_packet) ? now : until;
+    }
+    else
+	virtual_micros = until; // Nothing else to wait for
+    spins = 0;
+}
+
+// The next instant after now on this node's YIELD grid
+static uint64_t next_yield()
+{
+    return virtual_micros + SIMULATOR_YIELD_MICROS 
+	- (virtual_micros + SIMULATOR_YIELD_MICROS - yield_phase) % SIMULATOR_YIELD_MICROS;
+}
+
+static void spin()
+{
+    if (_simulator_virtual_time && ++spins > SIMULATOR_MAX_SPINS)
+	idle_until(next_yield(), true);
+}
+
+uint64_t simulator_micros()
+{
+    if (_simulator_virtual_time)
+	return virtual_micros;
+    return (uint64_t)millis() * 1000;
+}
+
+void simulator_yield()
+{
+    if (_simulator_virtual_time)
+	idle_until(next_yield(), true);
 }
 
 void delay(unsigned long ms)
 {
-    usleep(ms * 1000);
+    if (_simulator_virtual_time)
+	idle_until(virtual_micros + (uint64_t)ms * 1000, false);
+    else
+	usleep(ms * 1000);
+}
+
+void delayMicroseconds(unsigned int us)
+{
+    if (_simulator_virtual_time)
+	idle_until(virtual_micros + us, false);
+    else
+	usleep(us);
 }
 
 // Arduino equivalent, milliseconds since process start
 unsigned long millis()
 {
+    if (_simulator_virtual_time)
+    {
+	spin();
+	return virtual_micros / 1000;
+    }
     return time_in_millis() - start_millis;
 }
 
 long random(long from, long to)
 {
-    return from + (random() % (to - from));
+    int32_t r;
+    random_r(&random_state, &r);
+    return from + (r % (to - from));
 }
 
 long random(long to)
@@ -2,9 +2,13 @@
 // outputing statistics about their performance for each channel/data rate/power combination.
 
 #include <RHReliableDatagram.h>
+#if (RH_PLATFORM == RH_PLATFORM_SIMULATOR)
+#include "simulated_radio.h"
+#else
 #include <RH_NRF24.h>
 #include <SPI.h>
 #include "MemoryFree.h"
+#endif
 
 #include "message.h"
 #include "helpers.h"
@@ -23,6 +27,11 @@ RHReliableDatagram theManager(theDriver, SERVER_ADDRESS);
 // Message transmitted between the server and clients. Reused for sending/receiving.
 Message theMessage; // Don't put this on the stack.
 
+// Replies on their way to clients. They are sent without waiting for the ACK (see reply()) so one slow 
+// client does not hold up the others, and each must stay untouched until theManager is done with it.
+Message theReplies[RH_RELIABLE_DATAGRAM_MAX_PENDING];
+uint8_t theReplyHandles[RH_RELIABLE_DATAGRAM_MAX_PENDING]; // 0 if the reply is free.
+
 ////////////////////////////////////////////////////////////////////////////////
 
 // The server is a state machine. Below is the list of states it may be in. 
@@ -79,6 +88,23 @@ void broadcast(const Message::Type& type)
   // }
 }
 
+// Send theMessage to a client without waiting for the ACK. theManager.poll() in loop() takes care of
+// retransmissions. Falls back to a blocking send if all the replies are still on their way.
+void reply(const Message::Address& to)
+{
+  for (int i = 0; i < RH_RELIABLE_DATAGRAM_MAX_PENDING; ++i)
+  {
+    if (0 == theReplyHandles[i] || RHReliableDatagram::SendPending != theManager.sendStatus(theReplyHandles[i]))
+    {
+      theReplies[i] = theMessage;
+      theReplyHandles[i] = theManager.startSend((byte *) &theReplies[i], sizeof(theReplies[i]), to);
+      return;
+    }
+  }
+  
+  theMessage.sendThrough(theManager, to);
+}
+
 // Count received pings.
 void onPing(const Message::Address& from)
 {
@@ -210,13 +236,13 @@ void onWorking()
         
         theMessage.type = Message::PONG;
         // The rest stays the same.
-        theMessage.sendThrough(theManager, from);
+        reply(from);
         // Serial.println(F("PING-PONG!"));
       }
       else
       {
         theMessage.type = Message::ERROR;
-        theMessage.sendThrough(theManager, from);
+        reply(from);
       }
     }  
   }
@@ -247,7 +273,7 @@ void onReporting()
       {
         printReport(from, theMessage.data.report);
         theMessage.type = Message::OK;
-        theMessage.sendThrough(theManager, from);
+        reply(from);
       }
       else
       {
@@ -259,7 +285,7 @@ void onReporting()
         }
         
         theMessage.type = Message::QUERY;
-        theMessage.sendThrough(theManager, from);
+        reply(from);
       }
     }
   }
@@ -303,7 +329,7 @@ void onTuning()
     {
       theMessage.type = Message::TUNE;
       applyCurrentScenario(theMessage.data.tuningParams);
-      theMessage.sendThrough(theManager, from);
+      reply(from);
     }
   }
 
@@ -358,6 +384,8 @@ void loop()
       startPairing();
   }
   
+  theManager.poll();
+  
   delay(10);
 }
 